@@ -0,0 +1,9 @@
+#!/bin/bash
+
+# synthetic corpus is generated once, its documents are processed without mystem
+if [ ! -f ./bench/corpus.list ]
+then
+	mkdir -p ./bench
+	./occup --documents=100 generate-corpus ./bench ./data/ListOccupations.txt || exit 1
+fi
+./occup benchmark ./bench ./data/Templates.txt ./data/ListOccupations.txt
@@ -1,4 +1,3 @@
 #!/bin/bash
 
-g++ -Wall -O2 --std=c++0x ./src/main.cpp -o occup
-
+g++ -Wall -O2 --std=c++0x -pthread ./src/main.cpp ./src/utf8tools.cpp ./src/gzip.cpp ./src/mappedfile.cpp ./src/processinfo.cpp ./src/childprocess.cpp ./src/generatedmatcher.cpp -o occup
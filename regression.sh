@@ -0,0 +1,90 @@
+#!/bin/bash
+
+# documents of ./regression are processed with the recorded mystem result and
+# with source and compiled dictionaries, the results must be the same
+work=$(mktemp -d) || exit 1
+trap 'rm -rf "$work"' EXIT
+./occup build-dictionaries "$work/compiled.bin" ./regression/dictionary1.txt ./regression/dictionary2.txt || exit 1
+status=0
+for f in ./regression/*.objects
+do
+	base=$(basename "${f%.*}")
+	for run in source compiled
+	do
+		mkdir -p "$work/$run"
+		cp ./regression/$base.txt ./regression/$base.spans ./regression/$base.objects "$work/$run/"
+	done
+	./occup --mystem=replay:./regression "$work/source/$base" ./regression/templates.txt \
+		./regression/dictionary1.txt ./regression/dictionary2.txt || exit 1
+	./occup --mystem=replay:./regression "$work/compiled/$base" ./regression/templates.txt \
+		"$work/compiled.bin" || exit 1
+	if ! cmp -s "$work/source/$base.task3" "$work/compiled/$base.task3"
+	then
+		echo "$base: results of source and compiled dictionaries differ"
+		status=1
+	fi
+done
+
+# the matcher generated for the templates and dictionaries of ./regression
+# must find the same occupations as the interpreter, benchmark also compares
+# them on backtracking probes of a generated corpus
+./occup generate-matcher "$work/generatedmatcher.cpp" ./regression/templates.txt \
+	./regression/dictionary1.txt ./regression/dictionary2.txt || exit 1
+g++ -Wall -O2 --std=c++0x -pthread -I./src $(ls ./src/*.cpp | grep -v generatedmatcher.cpp) \
+	"$work/generatedmatcher.cpp" -o "$work/occup" || exit 1
+for f in ./regression/*.objects
+do
+	base=$(basename "${f%.*}")
+	mkdir -p "$work/generated"
+	cp ./regression/$base.txt ./regression/$base.spans ./regression/$base.objects "$work/generated/"
+	"$work/occup" --matcher=generated --mystem=replay:./regression "$work/generated/$base" \
+		./regression/templates.txt ./regression/dictionary1.txt ./regression/dictionary2.txt || exit 1
+	if ! cmp -s "$work/source/$base.task3" "$work/generated/$base.task3"
+	then
+		echo "$base: results of interpreted and generated matchers differ"
+		status=1
+	fi
+done
+mkdir -p "$work/corpus"
+"$work/occup" --documents=20 generate-corpus "$work/corpus" \
+	./regression/dictionary1.txt ./regression/dictionary2.txt > /dev/null || exit 1
+"$work/occup" --matcher=generated --iterations=1 benchmark "$work/corpus" ./regression/templates.txt \
+	./regression/dictionary1.txt ./regression/dictionary2.txt > /dev/null || status=1
+
+# streams are rewritten by each run, so they cannot be combined with
+# the manifest, which skips documents, and two streams cannot share a file
+for options in "--manifest=$work/manifest.txt --output=jsonl:$work/records.jsonl" \
+	"--output=jsonl --output=binary" "--output=jsonl:$work/records --output=binary:$work/records"
+do
+	if ./occup $options --mystem=replay:./regression "$work/source/backtracking" \
+		./regression/templates.txt ./regression/dictionary1.txt 2> /dev/null > /dev/null
+	then
+		echo "options $options are not rejected"
+		status=1
+	fi
+done
+
+# eval must score facts as t3_eval.py of factRuEval-2016, which is checked
+# out as for test.sh, on a few documents of its devset
+factRuEval=../../factRuEval-2016
+if [ -f "$factRuEval/scripts/t3_eval.py" ]
+then
+	mkdir -p "$work/devset" "$work/task3"
+	for f in $(ls "$factRuEval"/devset/*.facts | head -10)
+	do
+		cp "${f%.*}".txt "${f%.*}".spans "${f%.*}".objects "${f%.*}".facts "$work/devset/"
+	done
+	ls "$work"/devset/*.facts | sed 's/\.facts$//' > "$work/devset.list"
+	./occup --batch "$work/devset.list" ./data/Templates.txt ./data/ListOccupations.txt || exit 1
+	mv "$work"/devset/*.task3 "$work/task3/"
+	expected=$(python3 "$factRuEval/scripts/t3_eval.py" -s "$work/devset" -t "$work/task3" \
+		| grep -i "overall" | grep -o "[0-9]*\.[0-9]*" | head -3 | xargs printf "%.4f ")
+	actual=$(./occup eval "$work/devset.list" ./data/Templates.txt ./data/ListOccupations.txt \
+		| grep "^overall" | cut -f 2-4 | xargs printf "%.4f ")
+	if [ "$expected" != "$actual" ]
+	then
+		echo "eval: precision, recall and F1 $actual differ from t3_eval.py $expected"
+		status=1
+	fi
+fi
+exit $status
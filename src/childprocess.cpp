@@ -0,0 +1,91 @@
+#include "childprocess.h"
+
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <cerrno>
+#include <csignal>
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
+
+using namespace std;
+
+#ifdef _WIN32
+
+bool RunChildProcess( const string& commandLine, size_t timeoutMilliseconds, bool& timedOut )
+{
+	timedOut = false;
+	STARTUPINFOA startupInfo = {};
+	startupInfo.cb = sizeof( startupInfo );
+	PROCESS_INFORMATION processInfo = {};
+	// the command line may be modified by CreateProcess
+	vector<char> line( commandLine.cbegin(), commandLine.cend() );
+	line.push_back( '\0' );
+	if( CreateProcessA( nullptr, line.data(), nullptr, nullptr, FALSE, 0, nullptr, nullptr,
+		&startupInfo, &processInfo ) == 0 )
+	{
+		return false;
+	}
+	CloseHandle( processInfo.hThread );
+	const DWORD timeout = ( timeoutMilliseconds == 0 ) ? INFINITE
+		: static_cast<DWORD>( timeoutMilliseconds );
+	if( WaitForSingleObject( processInfo.hProcess, timeout ) == WAIT_TIMEOUT ) {
+		timedOut = true;
+		TerminateProcess( processInfo.hProcess, 1 );
+		WaitForSingleObject( processInfo.hProcess, INFINITE );
+	}
+	DWORD exitCode = 1;
+	GetExitCodeProcess( processInfo.hProcess, &exitCode );
+	CloseHandle( processInfo.hProcess );
+	return ( !timedOut && exitCode == 0 );
+}
+
+#else
+
+bool RunChildProcess( const string& commandLine, size_t timeoutMilliseconds, bool& timedOut )
+{
+	timedOut = false;
+	const pid_t pid = fork();
+	if( pid < 0 ) {
+		return false;
+	}
+	if( pid == 0 ) {
+		// the shell and its children are killed together as a process group
+		setpgid( 0, 0 );
+		execl( "/bin/sh", "sh", "-c", commandLine.c_str(), static_cast<char*>( nullptr ) );
+		_exit( 127 );
+	}
+	setpgid( pid, pid );
+
+	const auto deadline = chrono::steady_clock::now()
+		+ chrono::milliseconds( timeoutMilliseconds );
+	// the exit is polled with a growing interval of at most 10 milliseconds
+	chrono::microseconds interval( 100 );
+	int status = 0;
+	while( true ) {
+		const pid_t result = waitpid( pid, &status, timeoutMilliseconds == 0 ? 0 : WNOHANG );
+		if( result == pid ) {
+			break;
+		}
+		if( result < 0 && errno != EINTR ) {
+			return false;
+		}
+		if( chrono::steady_clock::now() >= deadline ) {
+			timedOut = true;
+			kill( -pid, SIGKILL );
+			waitpid( pid, &status, 0 );
+			return false;
+		}
+		this_thread::sleep_for( interval );
+		interval = min( interval * 2, chrono::microseconds( 10000 ) );
+	}
+	return ( WIFEXITED( status ) && WEXITSTATUS( status ) == 0 );
+}
+
+#endif
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <string>
+#include <cstddef>
+
+// Run a command line and wait for its exit at most timeoutMilliseconds
+// (0 - without a limit), the command is killed when the time is out.
+// The command line is run by the shell on Unix and as a program with
+// arguments on Windows. Returns false if the command cannot be run,
+// fails or is killed, timedOut is set if it is killed.
+bool RunChildProcess( const std::string& commandLine, size_t timeoutMilliseconds,
+	bool& timedOut );
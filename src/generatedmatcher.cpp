@@ -0,0 +1,7 @@
+// Dictionaries compiled into C++ code by `occup generate-matcher`,
+// which replaces this file with generated one (see README).
+
+#include "generatedmatcher.h"
+
+const CGeneratedDictionaries* const GeneratedDictionaries[1] = { nullptr };
+const size_t GeneratedDictionariesCount = 0;
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Dictionaries (templates or dictionaries of phrases) compiled into C++ code
+// by `occup generate-matcher` (see CDictionaries::UseGenerated). Words of
+// the lines are ids 1..WordsCount found by switches over the length, the first
+// and the last byte of a word, and nodes of the trie of the lines are states
+// of switches over the ids.
+struct CGeneratedDictionaries {
+	// key of the lines of the dictionaries (see CDictionaries::Key)
+	const char* Key;
+	// number of word ids, CDictionaries adds the position of a word
+	// in a line multiplied by it to the id
+	size_t WordsCount;
+	// id of a word or 0
+	size_t ( *WordId )( const char* word, size_t length );
+	// dictionary of each node of the trie or 0, the root is node 0
+	const uint32_t* Dictionary;
+	// child node of a node by a word id or 0
+	size_t ( *Child )( size_t node, size_t word );
+};
+
+// Dictionaries built into the program, generatedmatcher.cpp is replaced
+// by the output of generate-matcher.
+extern const CGeneratedDictionaries* const GeneratedDictionaries[];
+extern const size_t GeneratedDictionariesCount;
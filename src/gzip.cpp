@@ -0,0 +1,584 @@
+#include "gzip.h"
+
+#include <array>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+
+using namespace std;
+
+// Formats are described in RFC 1951 (deflate) and RFC 1952 (gzip).
+
+static const unsigned short LengthBase[29] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const unsigned char LengthExtra[29] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const unsigned short DistanceBase[30] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const unsigned char DistanceExtra[30] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+static const size_t WindowSize = 32768;
+static const size_t MaxCodeLength = 15;
+
+static uint32_t Crc32( const char* data, size_t size )
+{
+	static const array<uint32_t, 256> table = []()
+	{
+		array<uint32_t, 256> crcs;
+		for( uint32_t i = 0; i < 256; i++ ) {
+			uint32_t crc = i;
+			for( int bit = 0; bit < 8; bit++ ) {
+				crc = ( crc & 1 ) ? ( 0xEDB88320U ^ ( crc >> 1 ) ) : ( crc >> 1 );
+			}
+			crcs[i] = crc;
+		}
+		return crcs;
+	}();
+
+	uint32_t crc = 0xFFFFFFFFU;
+	for( size_t i = 0; i < size; i++ ) {
+		crc = table[( crc ^ static_cast<unsigned char>( data[i] ) ) & 0xFF] ^ ( crc >> 8 );
+	}
+	return crc ^ 0xFFFFFFFFU;
+}
+
+static uint32_t ReadUint32( const unsigned char* bytes )
+{
+	return ( static_cast<uint32_t>( bytes[0] ) | static_cast<uint32_t>( bytes[1] ) << 8
+		| static_cast<uint32_t>( bytes[2] ) << 16 | static_cast<uint32_t>( bytes[3] ) << 24 );
+}
+
+static unsigned ReverseBits( unsigned code, size_t length )
+{
+	unsigned reversed = 0;
+	for( size_t i = 0; i < length; i++ ) {
+		reversed = ( reversed << 1 ) | ( code & 1 );
+		code >>= 1;
+	}
+	return reversed;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Bits of deflate data, the least significant bits of a byte are the first.
+class CBitReader {
+public:
+	CBitReader( const unsigned char* _data, size_t _size ) :
+		data( _data ),
+		size( _size ),
+		offset( 0 ),
+		bits( 0 ),
+		bitsCount( 0 )
+	{
+	}
+
+	// Buffer as many bits as possible, returns the number of buffered bits.
+	size_t Fill()
+	{
+		while( bitsCount <= 56 && offset < size ) {
+			bits |= static_cast<uint64_t>( data[offset++] ) << bitsCount;
+			bitsCount += 8;
+		}
+		return bitsCount;
+	}
+	unsigned Peek( size_t count ) const
+	{
+		return static_cast<unsigned>( bits & ( ( static_cast<uint64_t>( 1 ) << count ) - 1 ) );
+	}
+	void Drop( size_t count )
+	{
+		bits >>= count;
+		bitsCount -= count;
+	}
+	bool Read( size_t count, unsigned& value )
+	{
+		if( Fill() < count ) {
+			return false;
+		}
+		value = Peek( count );
+		Drop( count );
+		return true;
+	}
+	// Skip bits to the next byte.
+	void Align() { Drop( bitsCount % 8 ); }
+	bool ReadBytes( size_t count, string& output );
+	// Offset of the byte after the read bits.
+	size_t ByteOffset() const { return offset - bitsCount / 8; }
+
+private:
+	const unsigned char* data;
+	size_t size;
+	size_t offset;
+	uint64_t bits;
+	size_t bitsCount;
+};
+
+bool CBitReader::ReadBytes( size_t count, string& output )
+{
+	Align();
+	for( ; count > 0 && bitsCount > 0; count-- ) {
+		output += static_cast<char>( Peek( 8 ) );
+		Drop( 8 );
+	}
+	if( size - offset < count ) {
+		return false;
+	}
+	output.append( reinterpret_cast<const char*>( data + offset ), count );
+	offset += count;
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Canonical Huffman code of deflate, codes of up to FastBits bits
+// are decoded by a table, longer codes are decoded bit by bit.
+class CHuffmanCode {
+public:
+	// Build the code by lengths of codes of symbols (0 is no code),
+	// returns false if the lengths are not valid.
+	bool Build( const unsigned char* lengths, size_t count );
+	// Returns the symbol or -1 if the code is not valid.
+	int Decode( CBitReader& reader ) const;
+
+private:
+	static const size_t FastBits = 9;
+
+	// symbol << 4 | length of the code of the symbol, 0 for longer codes
+	array<unsigned short, 1 << FastBits> fast;
+	array<unsigned short, MaxCodeLength + 1> counts;
+	// symbols ordered by their codes
+	array<unsigned short, 288> symbols;
+};
+
+const size_t CHuffmanCode::FastBits;
+
+bool CHuffmanCode::Build( const unsigned char* lengths, size_t count )
+{
+	counts.fill( 0 );
+	fast.fill( 0 );
+	for( size_t symbol = 0; symbol < count; symbol++ ) {
+		counts[lengths[symbol]]++;
+	}
+	counts[0] = 0;
+	// an over-subscribed code is not valid, an incomplete one is allowed
+	int left = 1;
+	for( size_t length = 1; length <= MaxCodeLength; length++ ) {
+		left = left * 2 - counts[length];
+		if( left < 0 ) {
+			return false;
+		}
+	}
+
+	array<unsigned short, MaxCodeLength + 2> offsets;
+	offsets[1] = 0;
+	for( size_t length = 1; length <= MaxCodeLength; length++ ) {
+		offsets[length + 1] = offsets[length] + counts[length];
+	}
+	for( size_t symbol = 0; symbol < count; symbol++ ) {
+		if( lengths[symbol] != 0 ) {
+			symbols[offsets[lengths[symbol]]++] = static_cast<unsigned short>( symbol );
+		}
+	}
+
+	unsigned code = 0;
+	size_t index = 0;
+	for( size_t length = 1; length <= FastBits; length++ ) {
+		for( size_t i = 0; i < counts[length]; i++ ) {
+			const unsigned short entry =
+				static_cast<unsigned short>( symbols[index++] << 4 | length );
+			for( unsigned bits = ReverseBits( code++, length ); bits < fast.size();
+				bits += 1U << length )
+			{
+				fast[bits] = entry;
+			}
+		}
+		code <<= 1;
+	}
+	return true;
+}
+
+int CHuffmanCode::Decode( CBitReader& reader ) const
+{
+	const size_t available = reader.Fill();
+	const unsigned entry = fast[reader.Peek( min( FastBits, available ) )];
+	if( entry != 0 && ( entry & 15 ) <= available ) {
+		reader.Drop( entry & 15 );
+		return static_cast<int>( entry >> 4 );
+	}
+	int code = 0;
+	int first = 0;
+	int index = 0;
+	for( size_t length = 1; length <= MaxCodeLength && length <= available; length++ ) {
+		code |= static_cast<int>( reader.Peek( length ) >> ( length - 1 ) );
+		const int count = counts[length];
+		if( code - first < count ) {
+			reader.Drop( length );
+			return symbols[index + code - first];
+		}
+		index += count;
+		first = ( first + count ) << 1;
+		code <<= 1;
+	}
+	return -1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+static bool InflateBlock( CBitReader& reader, const CHuffmanCode& literals,
+	const CHuffmanCode& distances, string& output, size_t start )
+{
+	while( true ) {
+		const int symbol = literals.Decode( reader );
+		if( symbol < 0 ) {
+			return false;
+		} else if( symbol < 256 ) {
+			output += static_cast<char>( symbol );
+		} else if( symbol == 256 ) {
+			return true;
+		} else if( symbol - 257 >= 29 ) {
+			return false;
+		} else {
+			unsigned extra = 0;
+			if( !reader.Read( LengthExtra[symbol - 257], extra ) ) {
+				return false;
+			}
+			const size_t length = LengthBase[symbol - 257] + extra;
+			const int distanceSymbol = distances.Decode( reader );
+			if( distanceSymbol < 0 || distanceSymbol >= 30
+				|| !reader.Read( DistanceExtra[distanceSymbol], extra ) )
+			{
+				return false;
+			}
+			const size_t distance = DistanceBase[distanceSymbol] + extra;
+			if( distance > output.size() - start ) {
+				return false;
+			}
+			// a match may overlap the bytes it makes
+			size_t from = output.size() - distance;
+			for( size_t i = 0; i < length; i++ ) {
+				output += output[from++];
+			}
+		}
+	}
+}
+
+static bool ReadDynamicCodes( CBitReader& reader, CHuffmanCode& literals,
+	CHuffmanCode& distances )
+{
+	static const unsigned char Order[19] = {
+		16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+	unsigned literalsCount = 0;
+	unsigned distancesCount = 0;
+	unsigned lengthCodesCount = 0;
+	if( !reader.Read( 5, literalsCount ) || !reader.Read( 5, distancesCount )
+		|| !reader.Read( 4, lengthCodesCount ) )
+	{
+		return false;
+	}
+	literalsCount += 257;
+	distancesCount += 1;
+	lengthCodesCount += 4;
+
+	unsigned char lengths[286 + 30] = {};
+	for( size_t i = 0; i < lengthCodesCount; i++ ) {
+		unsigned length = 0;
+		if( !reader.Read( 3, length ) ) {
+			return false;
+		}
+		lengths[Order[i]] = static_cast<unsigned char>( length );
+	}
+	CHuffmanCode lengthCode;
+	if( !lengthCode.Build( lengths, 19 ) ) {
+		return false;
+	}
+
+	const size_t count = literalsCount + distancesCount;
+	size_t index = 0;
+	while( index < count ) {
+		const int symbol = lengthCode.Decode( reader );
+		if( symbol < 0 ) {
+			return false;
+		}
+		if( symbol < 16 ) {
+			lengths[index++] = static_cast<unsigned char>( symbol );
+			continue;
+		}
+		unsigned char length = 0;
+		unsigned repeat = 0;
+		if( symbol == 16 ) {
+			if( index == 0 || !reader.Read( 2, repeat ) ) {
+				return false;
+			}
+			length = lengths[index - 1];
+			repeat += 3;
+		} else if( symbol == 17 ) {
+			if( !reader.Read( 3, repeat ) ) {
+				return false;
+			}
+			repeat += 3;
+		} else {
+			if( !reader.Read( 7, repeat ) ) {
+				return false;
+			}
+			repeat += 11;
+		}
+		if( index + repeat > count ) {
+			return false;
+		}
+		for( ; repeat > 0; repeat-- ) {
+			lengths[index++] = length;
+		}
+	}
+	// the end of block must have a code
+	return ( lengths[256] != 0 && literals.Build( lengths, literalsCount )
+		&& distances.Build( lengths + literalsCount, distancesCount ) );
+}
+
+static bool Inflate( CBitReader& reader, string& output )
+{
+	static CHuffmanCode fixedLiterals;
+	static CHuffmanCode fixedDistances;
+	static const bool fixedCodes = []()
+	{
+		unsigned char lengths[288];
+		memset( lengths, 8, 144 );
+		memset( lengths + 144, 9, 112 );
+		memset( lengths + 256, 7, 24 );
+		memset( lengths + 280, 8, 8 );
+		fixedLiterals.Build( lengths, 288 );
+		memset( lengths, 5, 30 );
+		return fixedDistances.Build( lengths, 30 );
+	}();
+	static_cast<void>( fixedCodes );
+
+	const size_t start = output.size();
+	CHuffmanCode literals;
+	CHuffmanCode distances;
+	unsigned isFinal = 0;
+	do {
+		unsigned type = 0;
+		if( !reader.Read( 1, isFinal ) || !reader.Read( 2, type ) ) {
+			return false;
+		}
+		if( type == 0 ) {
+			unsigned length = 0;
+			unsigned lengthComplement = 0;
+			reader.Align();
+			if( !reader.Read( 16, length ) || !reader.Read( 16, lengthComplement )
+				|| length != ( ~lengthComplement & 0xFFFF )
+				|| !reader.ReadBytes( length, output ) )
+			{
+				return false;
+			}
+		} else if( type == 1 ) {
+			if( !InflateBlock( reader, fixedLiterals, fixedDistances, output, start ) ) {
+				return false;
+			}
+		} else if( type == 2 ) {
+			if( !ReadDynamicCodes( reader, literals, distances )
+				|| !InflateBlock( reader, literals, distances, output, start ) )
+			{
+				return false;
+			}
+		} else {
+			return false;
+		}
+	} while( isFinal == 0 );
+	return true;
+}
+
+bool GunzipData( const char* data, size_t size, string& output )
+{
+	const unsigned char* const bytes = reinterpret_cast<const unsigned char*>( data );
+	size_t offset = 0;
+	do {
+		// header: magic, method (deflate), flags, time, extra flags, system
+		if( size - offset < 18 || bytes[offset] != 0x1F || bytes[offset + 1] != 0x8B
+			|| bytes[offset + 2] != 8 || ( bytes[offset + 3] & 0xE0 ) != 0 )
+		{
+			return false;
+		}
+		const unsigned char flags = bytes[offset + 3];
+		offset += 10;
+		if( ( flags & 4 ) != 0 ) { // extra field
+			offset += 2 + ( bytes[offset] | bytes[offset + 1] << 8 );
+		}
+		for( const unsigned char flag : { 8, 16 } ) { // name and comment
+			if( ( flags & flag ) != 0 ) {
+				while( offset < size && bytes[offset] != 0 ) {
+					offset++;
+				}
+				offset++;
+			}
+		}
+		if( ( flags & 2 ) != 0 ) { // header CRC
+			offset += 2;
+		}
+		if( offset > size ) {
+			return false;
+		}
+
+		const size_t start = output.size();
+		CBitReader reader( bytes + offset, size - offset );
+		if( !Inflate( reader, output ) ) {
+			return false;
+		}
+		offset += reader.ByteOffset();
+		// trailer: CRC and size modulo 2^32
+		if( size - offset < 8
+			|| ReadUint32( bytes + offset ) != Crc32( output.data() + start, output.size() - start )
+			|| ReadUint32( bytes + offset + 4 ) != static_cast<uint32_t>( output.size() - start ) )
+		{
+			return false;
+		}
+		offset += 8;
+	} while( offset < size );
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Bits of deflate data, Huffman codes are written from the most significant bit.
+class CBitWriter {
+public:
+	explicit CBitWriter( string& _output ) :
+		output( _output ),
+		bits( 0 ),
+		bitsCount( 0 )
+	{
+	}
+
+	void Write( unsigned value, size_t count )
+	{
+		bits |= static_cast<uint64_t>( value ) << bitsCount;
+		bitsCount += count;
+		while( bitsCount >= 8 ) {
+			output += static_cast<char>( bits & 0xFF );
+			bits >>= 8;
+			bitsCount -= 8;
+		}
+	}
+	void WriteCode( unsigned code, size_t length ) { Write( ReverseBits( code, length ), length ); }
+	void Flush() { Write( 0, ( 8 - bitsCount % 8 ) % 8 ); }
+
+private:
+	string& output;
+	uint64_t bits;
+	size_t bitsCount;
+};
+
+static void WriteFixedLiteral( CBitWriter& writer, unsigned symbol )
+{
+	if( symbol < 144 ) {
+		writer.WriteCode( 0x30 + symbol, 8 );
+	} else if( symbol < 256 ) {
+		writer.WriteCode( 0x190 + symbol - 144, 9 );
+	} else if( symbol < 280 ) {
+		writer.WriteCode( symbol - 256, 7 );
+	} else {
+		writer.WriteCode( 0xC0 + symbol - 280, 8 );
+	}
+}
+
+static void WriteMatch( CBitWriter& writer, size_t length, size_t distance )
+{
+	size_t lengthCode = 28;
+	while( LengthBase[lengthCode] > length ) {
+		lengthCode--;
+	}
+	WriteFixedLiteral( writer, static_cast<unsigned>( 257 + lengthCode ) );
+	writer.Write( static_cast<unsigned>( length - LengthBase[lengthCode] ),
+		LengthExtra[lengthCode] );
+	size_t distanceCode = 29;
+	while( DistanceBase[distanceCode] > distance ) {
+		distanceCode--;
+	}
+	writer.WriteCode( static_cast<unsigned>( distanceCode ), 5 );
+	writer.Write( static_cast<unsigned>( distance - DistanceBase[distanceCode] ),
+		DistanceExtra[distanceCode] );
+}
+
+string GzipData( const char* data, size_t size )
+{
+	static const size_t MinMatch = 3;
+	static const size_t MaxMatch = 258;
+	static const size_t MaxChain = 32;
+	static const size_t HashBits = 15;
+
+	// header: magic, deflate, no flags, no time, no extra flags, unknown system
+	string output( "\x1F\x8B\x08\x00\x00\x00\x00\x00\x00\xFF", 10 );
+	CBitWriter writer( output );
+	writer.Write( 1, 1 ); // the final block
+	writer.Write( 1, 2 ); // fixed Huffman codes
+
+	// chains of previous positions with the same hash of MinMatch bytes
+	vector<int> heads( 1 << HashBits, -1 );
+	vector<int> previous( size, -1 );
+	auto hash = [data]( size_t position ) -> size_t
+	{
+		const uint32_t value = static_cast<unsigned char>( data[position] )
+			| static_cast<unsigned char>( data[position + 1] ) << 8
+			| static_cast<unsigned char>( data[position + 2] ) << 16;
+		return ( value * 2654435761U ) >> ( 32 - HashBits );
+	};
+	auto insert = [&]( size_t position )
+	{
+		if( position + MinMatch <= size ) {
+			int& head = heads[hash( position )];
+			previous[position] = head;
+			head = static_cast<int>( position );
+		}
+	};
+
+	size_t position = 0;
+	while( position < size ) {
+		size_t bestLength = 0;
+		size_t bestDistance = 0;
+		if( position + MinMatch <= size ) {
+			const size_t maxLength = min( MaxMatch, size - position );
+			int candidate = heads[hash( position )];
+			for( size_t chain = 0; candidate >= 0 && chain < MaxChain
+				&& position - candidate <= WindowSize; chain++ )
+			{
+				const char* const match = data + candidate;
+				size_t length = 0;
+				while( length < maxLength && match[length] == data[position + length] ) {
+					length++;
+				}
+				if( length > bestLength ) {
+					bestLength = length;
+					bestDistance = position - candidate;
+					if( length == maxLength ) {
+						break;
+					}
+				}
+				candidate = previous[candidate];
+			}
+		}
+		if( bestLength >= MinMatch ) {
+			WriteMatch( writer, bestLength, bestDistance );
+			for( const size_t end = position + bestLength; position < end; position++ ) {
+				insert( position );
+			}
+		} else {
+			WriteFixedLiteral( writer, static_cast<unsigned char>( data[position] ) );
+			insert( position );
+			position++;
+		}
+	}
+	WriteFixedLiteral( writer, 256 );
+	writer.Flush();
+
+	const uint32_t trailer[2] = { Crc32( data, size ), static_cast<uint32_t>( size ) };
+	for( const uint32_t value : trailer ) {
+		for( int shift = 0; shift < 32; shift += 8 ) {
+			output += static_cast<char>( ( value >> shift ) & 0xFF );
+		}
+	}
+	return output;
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <string>
+#include <cstddef>
+
+// Decompress gzip data (one or more members) and append it to the output,
+// returns false if the data is not valid gzip data.
+bool GunzipData( const char* data, size_t size, std::string& output );
+
+// Compress data to gzip data by LZ77 with fixed Huffman codes,
+// which is fast and is decompressed by any gzip.
+std::string GzipData( const char* data, size_t size );
@@ -1,17 +1,41 @@
 #include <map>
 #include <array>
+#include <deque>
+#include <queue>
+#include <mutex>
+#include <memory>
+#include <atomic>
+#include <cstdio>
+#include <cstdint>
 #include <bitset>
 #include <limits>
 #include <string>
 #include <vector>
+#include <random>
+#include <thread>
+#include <chrono>
+#include <sstream>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <iterator>
 #include <algorithm>
 #include <exception>
+#include <functional>
 #include <unordered_map>
+#include <condition_variable>
 
+#include "gzip.h"
 #include "utf8tools.h"
+#include "mappedfile.h"
+#include "processinfo.h"
+#include "childprocess.h"
+#include "generatedmatcher.h"
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
 
 using namespace std;
 
@@ -83,1052 +107,8200 @@ void TextReplace( string& text, const string& replacements )
 	}
 }
 
-///////////////////////////////////////////////////////////////////////////////
-
-void PrepareTextFile( const string& sourceFilename, const string& destFilename )
+// Convert CP1251 text to UTF-8 (symbols except ASCII and Cyrillic letters
+// are replaced with '?').
+string ConvertWindows1251ToUtf8( const string& text )
 {
-	ifstream src( sourceFilename );
-	ofstream dest( destFilename, ios_base::out | ios_base::binary );
-
-	if( !src.good() ) {
-		throw CException( "Cannot read text file `" + sourceFilename + "`." );
-	}
-
-	string line;
-	while( src.good() ) {
-		getline( src, line );
-		if( !ConvertUtf8ToWindows1251( line, ' ' ) ) {
-			throw CException( "Cannot read as valid UTF-8 text file `" + sourceFilename + "` ." );
+	string utf8Text;
+	for( char c : text ) {
+		const unsigned char uc = static_cast<unsigned char>( c );
+		if( uc < 128 ) {
+			utf8Text += c;
+		} else if( uc >= 192 ) {
+			const unsigned int code = 0x410 + ( uc - 192 );
+			utf8Text += static_cast<char>( 0xC0 | ( code >> 6 ) );
+			utf8Text += static_cast<char>( 0x80 | ( code & 0x3F ) );
+		} else {
+			utf8Text += '?';
 		}
-		TextReplace( line, ReplacementsCP1251 );
-		line += '\n';
-		dest.write( line.data(), line.length() );
 	}
+	return utf8Text;
 }
 
-///////////////////////////////////////////////////////////////////////////////
-
-bool System( const string& arg )
+// Normalize UTF-8 text in place the same way as ReplacementsCP1251 does
+// CP1251 text: Cyrillic letters are lower cased,  is replaced with ,
+// symbols except letters, digits and some punctuation are replaced with
+// spaces, so each character of the text stays one character.
+// Returns false if the text is not valid UTF-8.
+bool NormalizeUtf8Text( string& text )
 {
-	if( system( nullptr ) == 0 ) {
-		throw CException( " Function `int system( const char* )` is not supported." );
-	}
-
-#ifdef _WIN32
-	const int returnCode = system( ( "\"" + arg + "\"" ).c_str() );
-#else
-	const int returnCode = system( arg.c_str() );
-#endif
+	size_t to = 0;
+	size_t from = 0;
+	while( from < text.length() ) {
+		unsigned int code = 0;
+		const size_t length = DecodeUtf8Char( text, from, code );
+		if( length == 0 ) {
+			return false;
+		}
+		from += length;
 
-	return ( returnCode == 0 );
+		if( code < 128 ) {
+			text[to++] = ReplacementsCP1251[code];
+			continue;
+		}
+		if( code >= 0x410 && code < 0x430 ) {
+			code += 0x20; // upper case
+		} else if( code == 0x401 || code == 0x451 ) {
+			code = 0x435;
+		}
+		if( code >= 0x430 && code < 0x450 ) {
+			text[to++] = static_cast<char>( 0xC0 | ( code >> 6 ) );
+			text[to++] = static_cast<char>( 0x80 | ( code & 0x3F ) );
+		} else if( code == 0x201A ) {
+			text[to++] = ',';
+		} else if( code == 0x2026 ) {
+			text[to++] = '.';
+		} else if( code == 0x2013 || code == 0x2014 || code == 0xAD ) {
+			text[to++] = '-';
+		} else {
+			text[to++] = ' ';
+		}
+	}
+	text.erase( to );
+	return true;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 
-vector<string> SplitString( const string& str, const char* delimiters = " \t\r",
-	bool preserveEmptyStrings = false )
-{
-	vector<string> strings;
-	size_t offset = 0;
-	while( offset < str.length() ) {
-		size_t delimiterPos = str.find_first_of( delimiters, offset );
-		if( delimiterPos == string::npos ) {
-			break;
-		}
+// Encoding of normalized texts of documents, dictionaries and templates,
+// which are matched with each other and with the output of mystem.
+enum TTextEncoding {
+	TE_Cp1251,
+	TE_Utf8
+};
 
-		const string part = str.substr( offset, delimiterPos - offset );
-		if( preserveEmptyStrings || !part.empty() ) {
-			strings.push_back( part );
-		}
+// Encoding of the run (see --encoding).
+TTextEncoding TextEncoding = TE_Cp1251;
 
-		offset = delimiterPos + 1;
-	}
+// Templates and dictionaries of the run are matched by their generated
+// matchers (see --matcher).
+bool UseGeneratedMatchers = false;
 
-	const string part = str.substr( offset );
-	if( preserveEmptyStrings || !part.empty() ) {
-		strings.push_back( part );
+// Letters and digits of normalized text are words, the characters
+// of normalized UTF-8 text are ASCII or lower case Cyrillic letters.
+// Returns the length of the character at the offset in bytes,
+// 0 if it is not valid.
+inline size_t NormalizedCharLength( const TTextEncoding encoding, const string& text,
+	const size_t offset, bool& isAlphaOrDigit )
+{
+	const unsigned char c = static_cast<unsigned char>( text[offset] );
+	if( c < 128 || encoding == TE_Cp1251 ) {
+		isAlphaOrDigit = IsCharAlphaOrDigit( text[offset] );
+		return 1;
 	}
+	unsigned int code = 0;
+	const size_t length = DecodeUtf8Char( text, offset, code );
+	isAlphaOrDigit = ( code >= 0x410 && code < 0x450 );
+	return length;
+}
 
-	return strings;
+// Number of characters of text in the encoding.
+size_t TextLength( const string& text, const TTextEncoding encoding = TextEncoding )
+{
+	return ( encoding == TE_Utf8 ) ? Utf8Length( text ) : text.length();
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 
-class CDictionaries {
-	friend class CFinder;
+// Header of a record of a pack (see CPack). It is followed by
+// char Name[NameSize] and char Data[DataSize] (in native byte order).
+struct CPackRecordHeader {
+	uint64_t Kind;
+	uint64_t NameSize;
+	uint64_t DataSize;
+};
 
+const char PackMagic[8] = { 'O', 'C', 'C', 'P', 'A', 'C', 'K', '1' };
+
+// Files (named byte strings) in one file, which is mapped into memory.
+// A pack is the magic followed by records: files and, after each run which
+// added files, the table of all files (names, offsets and sizes) and
+// a trailer with the offset of the table. Added files are appended
+// and replace files with the same name. A pack without a valid trailer
+// (an interrupted run) is opened by a scan of its records.
+class CPack {
 public:
-	CDictionaries();
+	CPack();
 
-	bool IsEmpty() const { return levels.empty(); }
-	void AddFile( const string& dictionaryFilename, size_t dictionaryIndex = 1 );
-	void AddLine( const string& line, size_t dictionaryIndex = 1 );
+	// A missing pack is created unless it is opened read only.
+	void Open( const string& filename, bool readOnly = false );
+	bool IsOpen() const { return !filename.empty(); }
+	// Write the table if files are added and close the pack.
+	void Close();
+
+	// Contents of a file, data points into the mapped pack or to the buffer.
+	bool Find( const string& name, const char*& data, size_t& size, string& buffer );
+	bool Has( const string& name ) const;
+	void Add( const string& name, const string& data );
+	// Sorted names of files.
+	vector<string> Names() const;
 
 private:
-	size_t wordIndex;
+	enum TRecordKind {
+		RK_File = 1,
+		RK_Table,
+		RK_Trailer
+	};
 
-	typedef basic_string<size_t> CWords;
-	struct CLevel {
-		unordered_map<string, size_t> WordToIndex;
-		unordered_map<CWords, size_t> PrefixToDictionary;
+	struct CEntry {
+		uint64_t Offset;
+		uint64_t Size;
 	};
-	vector<CLevel> levels;
+
+	string filename;
+	CMappedFile file;
+	ofstream output;
+	// size of the pack with appended records
+	uint64_t size;
+	bool readOnly;
+	bool modified;
+	unordered_map<string, CEntry> entries;
+	// files are read and added by threads
+	mutable mutex lock;
+
+	bool readRecordHeader( uint64_t offset, CPackRecordHeader& header ) const;
+	bool readTable();
+	void scanRecords();
+	void writeRecord( TRecordKind kind, const string& name, const char* data, size_t dataSize );
 };
 
-CDictionaries::CDictionaries() :
-	wordIndex( 0 )
+CPack::CPack() :
+	size( 0 ),
+	readOnly( false ),
+	modified( false )
 {
 }
 
-void CDictionaries::AddFile( const string& dictionaryFilename, size_t dictionaryIndex )
+void CPack::Open( const string& _filename, bool _readOnly )
 {
-	ifstream dictionaryFile( dictionaryFilename );
-	if( !dictionaryFile.good() ) {
-		throw CException( "Cannot read dictionary `" + dictionaryFilename + "`." );
+	if( IsOpen() ) {
+		throw logic_error( "CPack::Open" );
 	}
-	string line;
-	while( dictionaryFile.good() ) {
-		getline( dictionaryFile, line );
-		ConvertUtf8ToWindows1251( line );
-		TextReplace( line, ReplacementsCP1251 );
-		AddLine( line, dictionaryIndex );
+	filename = _filename;
+	readOnly = _readOnly;
+	entries.clear();
+	modified = false;
+	if( !ifstream( filename ).good() ) {
+		if( readOnly ) {
+			filename.clear();
+			throw CException( "Pack `" + _filename + "` not found." );
+		}
+		ofstream newPack( filename, ios::out | ios::binary );
+		newPack.write( PackMagic, sizeof( PackMagic ) );
+		if( !newPack.good() ) {
+			throw CException( "Cannot write pack `" + filename + "`." );
+		}
+	}
+	if( !file.Open( filename ) ) {
+		throw CException( "Cannot map pack `" + filename + "`." );
+	}
+	if( file.Size() < sizeof( PackMagic )
+		|| !equal( PackMagic, PackMagic + sizeof( PackMagic ), file.Data() ) )
+	{
+		throw CException( "Bad pack `" + filename + "` format." );
+	}
+	if( !readTable() ) {
+		scanRecords();
+	}
+	size = file.Size();
+	if( readOnly ) {
+		return;
+	}
+	output.open( filename, ios::out | ios::binary | ios::app );
+	if( !output.good() ) {
+		throw CException( "Cannot write pack `" + filename + "`." );
 	}
 }
 
-void CDictionaries::AddLine( const string& line, size_t dictionaryIndex )
+void CPack::Close()
 {
-	if( dictionaryIndex == 0 ) {
-		throw logic_error( "CDictionaries::AddLine invalid dictionaryIndex" );
-	}
-
-	vector<string> strings = SplitString( line );
-	if( strings.empty() ) {
+	if( !IsOpen() ) {
 		return;
 	}
-
-	if( levels.size() < strings.size() ) {
-		levels.resize( strings.size() );
+	if( modified ) {
+		string table;
+		auto appendValue = [&table]( const uint64_t value )
+		{
+			table.append( reinterpret_cast<const char*>( &value ), sizeof( value ) );
+		};
+		for( const pair<const string, CEntry>& entry : entries ) {
+			appendValue( entry.first.length() );
+			appendValue( entry.second.Offset );
+			appendValue( entry.second.Size );
+			table += entry.first;
+		}
+		const uint64_t tableOffset = size;
+		writeRecord( RK_Table, "", table.data(), table.length() );
+		writeRecord( RK_Trailer, "", reinterpret_cast<const char*>( &tableOffset ),
+			sizeof( tableOffset ) );
 	}
-
-	CWords words;
-	words.reserve( strings.size() );
-	for( size_t i = 0; i < strings.size(); i++ ) {
-		++wordIndex;
-
-		auto p1 = levels[i].WordToIndex.insert( make_pair( strings[i], wordIndex ) );
-		words.push_back( p1.first->second );
-
-		auto p2 = levels[i].PrefixToDictionary.insert( make_pair( words, 0 ) );
-		if( i == strings.size() - 1 ) {
-			if( p2.first->second != 0 && p2.first->second != dictionaryIndex ) {
-				throw CException( "Duplicates were found in the dictionaries." );
-			}
-			p2.first->second = dictionaryIndex;
+	if( !readOnly ) {
+		output.close();
+		if( output.fail() ) {
+			throw CException( "Cannot write pack `" + filename + "`." );
 		}
 	}
+	file.Close();
+	entries.clear();
+	filename.clear();
 }
 
-///////////////////////////////////////////////////////////////////////////////
-
-class CFinder {
-public:
-	struct CMatch {
-		size_t Begin;
-		size_t End;
-		size_t Dictionary;
-
-		CMatch( size_t begin, size_t end, size_t dictionary ) :
-			Begin( begin ),
-			End( end ),
-			Dictionary( dictionary )
-		{
-		}
-	};
-	typedef vector<CMatch> CMatches;
-
-	explicit CFinder( const CDictionaries& dictionaries );
-
-	void Reset();
-	void Push( const string& word );
-	void Finish();
-	const CMatches& Matches() const { return matches; }
-
-private:
-	const CDictionaries& dictionaries;
-	CDictionaries::CWords words;
-	size_t count;
-	size_t dictionary;
-	size_t wordIndex;
-	CMatches matches;
+bool CPack::Find( const string& name, const char*& data, size_t& dataSize, string& buffer )
+{
+	lock_guard<mutex> guard( lock );
+	auto entry = entries.find( name );
+	if( entry == entries.end() ) {
+		return false;
+	}
+	dataSize = static_cast<size_t>( entry->second.Size );
+	if( entry->second.Offset + entry->second.Size <= file.Size() ) {
+		data = file.Data() + entry->second.Offset;
+		return true;
+	}
+	// the file is added after the pack is mapped
+	output.flush();
+	ifstream input( filename, ios::in | ios::binary );
+	input.seekg( static_cast<streamoff>( entry->second.Offset ) );
+	buffer.resize( dataSize );
+	input.read( &buffer[0], static_cast<streamsize>( dataSize ) );
+	if( !input.good() && dataSize > 0 ) {
+		throw CException( "Cannot read pack `" + filename + "`." );
+	}
+	data = buffer.data();
+	return true;
+}
 
-	void addMatch( size_t begin, size_t end, size_t dictionary );
-	bool addWord( const string& word );
-	void dump();
-	bool processWords();
-};
+bool CPack::Has( const string& name ) const
+{
+	lock_guard<mutex> guard( lock );
+	return ( entries.find( name ) != entries.cend() );
+}
 
-CFinder::CFinder( const CDictionaries& _dictionaries ) :
-	dictionaries( _dictionaries )
+void CPack::Add( const string& name, const string& data )
 {
-	Reset();
+	lock_guard<mutex> guard( lock );
+	if( readOnly ) {
+		throw logic_error( "CPack::Add" );
+	}
+	const uint64_t offset = size + sizeof( CPackRecordHeader ) + name.length();
+	writeRecord( RK_File, name, data.data(), data.length() );
+	CEntry& entry = entries[name];
+	entry.Offset = offset;
+	entry.Size = data.length();
+	modified = true;
 }
 
-void CFinder::Reset()
+vector<string> CPack::Names() const
 {
-	words.clear();
-	count = 0;
-	dictionary = 0;
-	wordIndex = 0;
-	matches.clear();
+	lock_guard<mutex> guard( lock );
+	vector<string> names;
+	names.reserve( entries.size() );
+	for( const pair<const string, CEntry>& entry : entries ) {
+		names.push_back( entry.first );
+	}
+	sort( names.begin(), names.end() );
+	return names;
 }
 
-void CFinder::Push( const string& word )
+// Whether the whole record at the offset is in the mapped pack.
+bool CPack::readRecordHeader( const uint64_t offset, CPackRecordHeader& header ) const
 {
-	while( !addWord( word ) ) {
-		if( words.empty() ) {
-			wordIndex++;
-			break;
-		} else if( count > 0 ) {
-			dump();
-		} else {
-			words.erase( words.begin() );
-			wordIndex++;
-		}
+	if( offset > file.Size() || file.Size() - offset < sizeof( header ) ) {
+		return false;
 	}
+	copy( file.Data() + offset, file.Data() + offset + sizeof( header ),
+		reinterpret_cast<char*>( &header ) );
+	const uint64_t restSize = file.Size() - offset - sizeof( header );
+	return ( header.NameSize <= restSize && header.DataSize <= restSize - header.NameSize );
 }
 
-void CFinder::Finish()
+bool CPack::readTable()
 {
-	if( count > 0 ) {
-		dump();
+	const uint64_t trailerSize = sizeof( CPackRecordHeader ) + sizeof( uint64_t );
+	if( file.Size() < sizeof( PackMagic ) + trailerSize ) {
+		return false;
+	}
+	const uint64_t trailerOffset = file.Size() - trailerSize;
+	CPackRecordHeader header;
+	if( !readRecordHeader( trailerOffset, header ) || header.Kind != RK_Trailer
+		|| header.NameSize != 0 || header.DataSize != sizeof( uint64_t ) )
+	{
+		return false;
+	}
+	uint64_t tableOffset = 0;
+	const char* trailerData = file.Data() + trailerOffset + sizeof( header );
+	copy( trailerData, trailerData + sizeof( tableOffset ),
+		reinterpret_cast<char*>( &tableOffset ) );
+	if( tableOffset < sizeof( PackMagic ) || !readRecordHeader( tableOffset, header )
+		|| header.Kind != RK_Table || header.NameSize != 0
+		|| tableOffset + sizeof( header ) + header.DataSize != trailerOffset )
+	{
+		return false;
 	}
 
-	while( !words.empty() ) {
-		if( processWords() && count > 0 ) {
-			dump();
-		} else if( !words.empty() ) {
-			words.erase( words.begin() );
-			wordIndex++;
+	const char* table = file.Data() + tableOffset + sizeof( header );
+	const char* const tableEnd = table + header.DataSize;
+	uint64_t values[3];
+	while( table < tableEnd ) {
+		if( static_cast<size_t>( tableEnd - table ) < sizeof( values ) ) {
+			entries.clear();
+			return false;
+		}
+		copy( table, table + sizeof( values ), reinterpret_cast<char*>( values ) );
+		table += sizeof( values );
+		if( values[0] > static_cast<uint64_t>( tableEnd - table )
+			|| values[1] > tableOffset || values[2] > tableOffset - values[1] )
+		{
+			entries.clear();
+			return false;
 		}
+		CEntry& entry = entries[string( table, static_cast<size_t>( values[0] ) )];
+		entry.Offset = values[1];
+		entry.Size = values[2];
+		table += values[0];
 	}
+	return true;
 }
 
-void CFinder::addMatch( size_t begin, size_t end, size_t dictionary )
+void CPack::scanRecords()
 {
-	matches.emplace_back( begin, end, dictionary );
+	// records after a damaged record are lost, files added to the pack
+	// are appended after it and are found by the table
+	uint64_t offset = sizeof( PackMagic );
+	CPackRecordHeader header;
+	while( readRecordHeader( offset, header ) ) {
+		const uint64_t nameOffset = offset + sizeof( header );
+		if( header.Kind == RK_File ) {
+			CEntry& entry = entries[string( file.Data() + nameOffset,
+				static_cast<size_t>( header.NameSize ) )];
+			entry.Offset = nameOffset + header.NameSize;
+			entry.Size = header.DataSize;
+		}
+		offset = nameOffset + header.NameSize + header.DataSize;
+	}
 }
 
-bool CFinder::addWord( const string& word )
+void CPack::writeRecord( const TRecordKind kind, const string& name, const char* data,
+	const size_t dataSize )
 {
-	const CDictionaries::CLevel& level = dictionaries.levels[words.size()];
-	auto wordIndex = level.WordToIndex.find( word );
-	if( wordIndex != level.WordToIndex.end() ) {
-		words.push_back( wordIndex->second );
-		if( processWords() ) {
-			return true;
-		}
-		words.pop_back();
+	CPackRecordHeader header;
+	header.Kind = kind;
+	header.NameSize = name.length();
+	header.DataSize = dataSize;
+	output.write( reinterpret_cast<const char*>( &header ), sizeof( header ) );
+	output.write( name.data(), name.length() );
+	output.write( data, dataSize );
+	if( !output.good() ) {
+		throw CException( "Cannot write pack `" + filename + "`." );
 	}
-	return false;
+	size += sizeof( header ) + name.length() + dataSize;
 }
 
-void CFinder::dump()
+///////////////////////////////////////////////////////////////////////////////
+
+// Caches of a document are files which extensions start with .todua-.
+bool IsCacheFilename( const string& filename )
 {
-	if( count == 0 || words.size() < count ) {
-		throw logic_error( "CFinder::dump()" );
-	}
-	addMatch( wordIndex, wordIndex + count, dictionary );
-	words.erase( words.begin(), words.begin() + count );
-	wordIndex += count;
-	count = 0;
-	dictionary = 0;
+	const size_t dotPos = filename.find_last_of( "./\\" );
+	return ( dotPos != string::npos && filename.compare( dotPos, 7, ".todua-" ) == 0 );
 }
 
-bool CFinder::processWords()
+// Decompressed contents of the gzip copy FILENAME.gz of a file,
+// returns false if there is no such copy.
+bool ReadCompressedFile( const string& filename, string& contents )
 {
-	const CDictionaries::CLevel& level = dictionaries.levels[words.size() - 1];
-	auto prefixIndex = level.PrefixToDictionary.find( words );
-	if( prefixIndex != level.PrefixToDictionary.end() ) {
-		if( prefixIndex->second > 0 ) {
-			count = words.size();
-			dictionary = prefixIndex->second;
-			if( count == dictionaries.levels.size() ) {
-				dump();
-			}
+	const string compressedFilename = filename + ".gz";
+	ifstream compressed( compressedFilename, ios::in | ios::binary );
+	if( !compressed.good() ) {
+		if( ifstream( filename + ".zst" ).good() ) {
+			throw CException( "File `" + filename + ".zst` is compressed by zstd,"
+				" which is not supported, compress it by gzip." );
 		}
-		return true;
+		return false;
 	}
-	return false;
+	const string data( ( istreambuf_iterator<char>( compressed ) ),
+		istreambuf_iterator<char>() );
+	contents.clear();
+	if( !GunzipData( data.data(), data.size(), contents ) ) {
+		throw CException( "Bad gzip file `" + compressedFilename + "`." );
+	}
+	return true;
 }
 
-///////////////////////////////////////////////////////////////////////////////
-
-struct CInterval {
-	size_t Begin;
-	size_t End;
+// Write a gzip copy FILENAME.gz of a file instead of the file.
+void WriteCompressedFile( const string& filename, const string& contents )
+{
+	const string compressedFilename = filename + ".gz";
+	ofstream compressedFile( compressedFilename, ios::out | ios::binary );
+	compressedFile << GzipData( contents.data(), contents.size() );
+	if( !compressedFile.good() ) {
+		throw CException( "Cannot write file `" + compressedFilename + "`." );
+	}
+	// an uncompressed file would be read instead
+	remove( filename.c_str() );
+}
 
-	CInterval() :
-		Begin( numeric_limits<size_t>::max() ),
-		End( 0 )
+// Files of documents are files or files of packs (see --pack): inputs (.txt,
+// .spans, .objects, .facts) are in the pack, caches (.todua-*) are
+// in the pack PACK.cache and results are in the pack PACK.out.
+// A file which is not packed may be a gzip copy FILENAME.gz, caches are
+// written compressed if CompressCaches.
+// Files which are not packed may be read and written asynchronously
+// (see --async-io): ReadAhead queues reads of files by a pool of threads
+// and WriteAsync queues writes, which are done in order by one thread.
+// Until a file is forgotten or written, its contents are taken from memory,
+// so readers wait only for reads which are not finished yet.
+class CDocumentFiles {
+public:
+	CDocumentFiles() :
+		compressCaches( false ),
+		stopping( false ),
+		pendingWrites( 0 )
 	{
 	}
+	~CDocumentFiles() { stopAsyncIo(); }
+
+	// See CPack::Open.
+	void Open( const string& packFilename, bool readOnly = false );
+	// Close packs and finish asynchronous writes.
+	void Close();
+	bool IsPacked() const { return inputs.IsOpen(); }
+	void SetCompressCaches( bool compress ) { compressCaches = compress; }
+	bool CompressCaches() const { return compressCaches; }
+
+	void StartAsyncIo( size_t threadsCount );
+	bool IsAsync() const { return !asyncThreads.empty(); }
+	void ReadAhead( const string& filename );
+	// Drop the contents of a file read ahead.
+	void Forget( const string& filename );
+	// Contents of a file read ahead or being written, waits for its read,
+	// returns false if there is no such file in memory. The contents are
+	// null if the file does not exist.
+	bool FindAsync( const string& filename, shared_ptr<const string>& contents );
+	void WriteAsync( const string& filename, string&& contents, bool compress );
+
+	bool Exists( const string& filename );
+	// Contents of a file of packs (see CPack::Find).
+	bool Find( const string& filename, const char*& data, size_t& size, string& buffer );
+	// Add a file to packs.
+	void Write( const string& filename, const string& contents );
+	// Names of files of packs.
+	vector<string> Names() const;
 
-	CInterval( size_t begin, size_t end ) :
-		Begin( begin ),
-		End( end )
-	{
+private:
+	CPack inputs;
+	CPack caches;
+	CPack outputs;
+	bool compressCaches;
+
+	struct CAsyncFile {
+		bool Done;
+		bool Writing;
+		shared_ptr<const string> Contents;
+		exception_ptr Error;
+
+		explicit CAsyncFile( bool writing ) :
+			Done( writing ),
+			Writing( writing )
+		{
+		}
+	};
+	mutex asyncMutex;
+	condition_variable asyncChanged;
+	map<string, shared_ptr<CAsyncFile>> asyncFiles;
+	deque<function<void()>> reads;
+	deque<function<void()>> writes;
+	vector<thread> asyncThreads;
+	bool stopping;
+	size_t pendingWrites;
+	// the first error of asynchronous writes
+	string writeError;
+
+	CPack& packOf( const string& filename );
+	void runTasks( deque<function<void()>>& tasks );
+	void readFile( const string& filename, const shared_ptr<CAsyncFile>& file );
+	void writeFile( const string& filename, const shared_ptr<CAsyncFile>& file,
+		bool compress );
+	void stopAsyncIo();
+};
+
+// Files of documents of the run.
+CDocumentFiles DocumentFiles;
+
+void CDocumentFiles::Open( const string& packFilename, bool readOnly )
+{
+	inputs.Open( packFilename, readOnly );
+	caches.Open( packFilename + ".cache", readOnly );
+	outputs.Open( packFilename + ".out", readOnly );
+}
+
+void CDocumentFiles::Close()
+{
+	inputs.Close();
+	caches.Close();
+	outputs.Close();
+	stopAsyncIo();
+	if( !writeError.empty() ) {
+		const string error = writeError;
+		writeError.clear();
+		throw CException( error );
 	}
+}
 
-	bool Defined() const
-	{
-		return ( Begin < End );
+void CDocumentFiles::StartAsyncIo( size_t threadsCount )
+{
+	stopping = false;
+	asyncThreads.emplace_back( &CDocumentFiles::runTasks, this, ref( writes ) );
+	for( size_t i = 0; i < threadsCount; i++ ) {
+		asyncThreads.emplace_back( &CDocumentFiles::runTasks, this, ref( reads ) );
 	}
+}
 
-	size_t Length() const
-	{
-		return ( End - Begin );
+void CDocumentFiles::ReadAhead( const string& filename )
+{
+	if( !IsAsync() || IsPacked() ) {
+		return;
+	}
+	lock_guard<mutex> lock( asyncMutex );
+	shared_ptr<CAsyncFile>& file = asyncFiles[filename];
+	if( file == nullptr ) {
+		file = make_shared<CAsyncFile>( false );
+		reads.emplace_back( bind( &CDocumentFiles::readFile, this, filename, file ) );
+		asyncChanged.notify_all();
 	}
+}
 
-	bool HasNoIntersection( const CInterval& another ) const
-	{
-		return ( End <= another.Begin || another.End <= Begin );
+void CDocumentFiles::Forget( const string& filename )
+{
+	lock_guard<mutex> lock( asyncMutex );
+	auto file = asyncFiles.find( filename );
+	if( file != asyncFiles.end() && !file->second->Writing ) {
+		asyncFiles.erase( file );
 	}
+}
 
-	void Offset( size_t offset )
-	{
-		Begin += offset;
-		End += offset;
+bool CDocumentFiles::FindAsync( const string& filename, shared_ptr<const string>& contents )
+{
+	unique_lock<mutex> lock( asyncMutex );
+	auto entry = asyncFiles.find( filename );
+	if( entry == asyncFiles.end() ) {
+		return false;
 	}
-};
+	const shared_ptr<CAsyncFile> file = entry->second;
+	asyncChanged.wait( lock, [&file]() { return file->Done; } );
+	if( file->Error ) {
+		rethrow_exception( file->Error );
+	}
+	contents = file->Contents;
+	return true;
+}
 
-enum TNamedEntityType {
-	NET_None,
-	NET_Org,
-	NET_Person,
-	NET_Location
-};
+void CDocumentFiles::WriteAsync( const string& filename, string&& contents, bool compress )
+{
+	lock_guard<mutex> lock( asyncMutex );
+	shared_ptr<CAsyncFile> file = make_shared<CAsyncFile>( true );
+	file->Contents = make_shared<const string>( move( contents ) );
+	asyncFiles[filename] = file;
+	pendingWrites++;
+	writes.emplace_back( bind( &CDocumentFiles::writeFile, this, filename, file, compress ) );
+	asyncChanged.notify_all();
+}
 
-const char* NamedEntityTypeText( TNamedEntityType type )
+void CDocumentFiles::runTasks( deque<function<void()>>& tasks )
 {
-	switch( type ) {
-		case NET_Org:
-			return "Org";
-		case NET_Person:
-			return "Person";
-		case NET_Location:
-			return "Location";
-		default:
-			break;
+	unique_lock<mutex> lock( asyncMutex );
+	while( true ) {
+		asyncChanged.wait( lock, [&]() { return stopping || !tasks.empty(); } );
+		if( tasks.empty() ) {
+			return;
+		}
+		const function<void()> task = move( tasks.front() );
+		tasks.pop_front();
+		lock.unlock();
+		task();
+		lock.lock();
 	}
-	return "None";
 }
 
-struct CNamedEntity : public CInterval {
-	TNamedEntityType Type;
+void CDocumentFiles::readFile( const string& filename, const shared_ptr<CAsyncFile>& file )
+{
+	shared_ptr<string> contents = make_shared<string>();
+	exception_ptr error;
+	try {
+		ifstream input( filename );
+		if( input.good() ) {
+			contents->assign( istreambuf_iterator<char>( input ), istreambuf_iterator<char>() );
+		} else if( !ReadCompressedFile( filename, *contents ) ) {
+			contents.reset();
+		}
+	} catch( ... ) {
+		error = current_exception();
+	}
+	lock_guard<mutex> lock( asyncMutex );
+	file->Contents = contents;
+	file->Error = error;
+	file->Done = true;
+	asyncChanged.notify_all();
+}
 
-	CNamedEntity() :
-		Type( NET_None )
+void CDocumentFiles::writeFile( const string& filename, const shared_ptr<CAsyncFile>& file,
+	bool compress )
+{
+	string error;
+	try {
+		if( compress ) {
+			WriteCompressedFile( filename, *file->Contents );
+		} else {
+			ofstream output( filename );
+			output << *file->Contents;
+			if( !output.good() ) {
+				throw CException( "Cannot write file `" + filename + "`." );
+			}
+		}
+	} catch( exception& e ) {
+		error = e.what();
+	}
+	lock_guard<mutex> lock( asyncMutex );
+	// the file is read from the disk unless it is written again
+	auto entry = asyncFiles.find( filename );
+	if( entry != asyncFiles.end() && entry->second == file ) {
+		asyncFiles.erase( entry );
+	}
+	if( writeError.empty() ) {
+		writeError = error;
+	}
+	pendingWrites--;
+	asyncChanged.notify_all();
+}
+
+// Reads which are not started are cancelled, writes are finished.
+void CDocumentFiles::stopAsyncIo()
+{
 	{
+		lock_guard<mutex> lock( asyncMutex );
+		reads.clear();
+		stopping = true;
+		asyncChanged.notify_all();
 	}
+	for( thread& asyncThread : asyncThreads ) {
+		asyncThread.join();
+	}
+	asyncThreads.clear();
+	asyncFiles.clear();
+}
 
-	bool Defined() const
+bool CDocumentFiles::Exists( const string& filename )
+{
+	if( IsPacked() ) {
+		return packOf( filename ).Has( filename );
+	}
+	shared_ptr<const string> contents;
+	if( FindAsync( filename, contents ) ) {
+		return ( contents != nullptr );
+	}
+	return ( ifstream( filename ).good() || ifstream( filename + ".gz" ).good() );
+}
+
+bool CDocumentFiles::Find( const string& filename, const char*& data, size_t& size,
+	string& buffer )
+{
+	return packOf( filename ).Find( filename, data, size, buffer );
+}
+
+void CDocumentFiles::Write( const string& filename, const string& contents )
+{
+	packOf( filename ).Add( filename, contents );
+}
+
+vector<string> CDocumentFiles::Names() const
+{
+	vector<string> names = inputs.Names();
+	for( const CPack* pack : { &caches, &outputs } ) {
+		const vector<string> packNames = pack->Names();
+		names.insert( names.end(), packNames.cbegin(), packNames.cend() );
+	}
+	return names;
+}
+
+CPack& CDocumentFiles::packOf( const string& filename )
+{
+	if( IsCacheFilename( filename ) ) {
+		return caches;
+	}
+	const size_t dotPos = filename.find_last_of( "./\\" );
+	const string extension = ( dotPos != string::npos && filename[dotPos] == '.' )
+		? filename.substr( dotPos ) : "";
+	if( extension == ".txt" || extension == ".spans" || extension == ".objects"
+		|| extension == ".facts" )
 	{
-		return ( Type != NET_None && CInterval::Defined() );
+		return inputs;
 	}
+	return outputs;
+}
 
-	bool SetType( const string& type )
+// Read-only stream buffer of bytes in memory.
+class CMemoryBuffer : public streambuf {
+public:
+	void Set( const char* data, size_t size )
 	{
-		Type = NET_None;
-		if( type == "Person" ) {
-			Type = NET_Person;
-		} else if( type == "Org" || type == "LocOrg" ) {
-			Type = NET_Org;
-		} else if( type == "Location" ) {
-			Type = NET_Location;
-		}
-		return ( Type != NET_None );
+		char* begin = const_cast<char*>( data );
+		setg( begin, begin, begin + size );
 	}
 };
 
-class CNamedEntities : public vector<CNamedEntity> {
+// Input of a file of a document (see CDocumentFiles),
+// the stream is not good if there is no such file.
+class CDocumentInput {
 public:
-	CNamedEntities()
+	explicit CDocumentInput( const string& filename );
+
+	istream& Stream()
 	{
+		return inMemory ? memory : static_cast<istream&>( file );
 	}
 
-	void Read( const string& baseFilename );
-	void Sort();
-	bool Check() const;
+private:
+	bool inMemory;
+	ifstream file;
+	string contents;
+	shared_ptr<const string> asyncContents;
+	CMemoryBuffer buffer;
+	istream memory;
 };
 
-void CNamedEntities::Read( const string& baseFilename )
+CDocumentInput::CDocumentInput( const string& filename ) :
+	inMemory( true ),
+	memory( &buffer )
 {
-	clear();
+	const char* data = nullptr;
+	size_t size = 0;
+	if( DocumentFiles.IsPacked() ) {
+		if( DocumentFiles.Find( filename, data, size, contents ) ) {
+			buffer.Set( data, size );
+		} else {
+			memory.setstate( ios::failbit );
+		}
+		return;
+	}
+	if( DocumentFiles.FindAsync( filename, asyncContents ) ) {
+		if( asyncContents != nullptr ) {
+			buffer.Set( asyncContents->data(), asyncContents->size() );
+		} else {
+			memory.setstate( ios::failbit );
+		}
+		return;
+	}
+	file.open( filename );
+	if( !file.good() && ReadCompressedFile( filename, contents ) ) {
+		buffer.Set( contents.data(), contents.size() );
+	} else {
+		inMemory = false;
+	}
+}
 
-	const string spansFilename = baseFilename + ".spans";
-	const string objectsFilename = baseFilename + ".objects";
+// Output of a file of a document (see CDocumentFiles), the file of a pack,
+// a compressed file or a file written asynchronously is written by Close.
+class CDocumentOutput {
+public:
+	explicit CDocumentOutput( const string& filename );
 
-	ifstream spans( spansFilename );
-	if( !spans.good() ) {
-		throw CException( "File `" + spansFilename + "` not found." );
-	}
-	ifstream objects( objectsFilename );
-	if( !objects.good() ) {
-		throw CException( "File `" + objectsFilename + "` not found." );
+	ostream& Stream()
+	{
+		return ( packed || compressed || async ) ? static_cast<ostream&>( memory )
+			: static_cast<ostream&>( file );
 	}
+	void Close();
 
-	// read spans
-	map<size_t, pair<size_t, size_t>> spansBeginEnd;
-	while( spans.good() ) {
-		string ignore;
-		size_t id;
-		size_t offset;
-		size_t length;
-		spans >> id >> ignore >> offset >> length;
-		if( spans.good() ) {
-			spansBeginEnd.insert( make_pair( id, make_pair( offset, offset + length ) ) );
-			spans.ignore( numeric_limits<streamsize>::max(), '\n' );
-		} else if( spans.eof() ) {
-			spans.clear( ios::eofbit );
-		}
+private:
+	const string filename;
+	const bool packed;
+	const bool compressed;
+	const bool async;
+	ofstream file;
+	ostringstream memory;
+};
+
+CDocumentOutput::CDocumentOutput( const string& _filename ) :
+	filename( _filename ),
+	packed( DocumentFiles.IsPacked() ),
+	compressed( !packed && DocumentFiles.CompressCaches() && IsCacheFilename( filename ) ),
+	async( !packed && DocumentFiles.IsAsync() )
+{
+	if( !packed && !compressed && !async ) {
+		file.open( filename );
 	}
-	if( spans.fail() ) {
-		throw CException( "Bad spans file `" + spansFilename + "` format." );
+}
+
+void CDocumentOutput::Close()
+{
+	if( packed ) {
+		DocumentFiles.Write( filename, memory.str() );
+		memory.str( "" );
+	} else if( async ) {
+		DocumentFiles.WriteAsync( filename, memory.str(), compressed );
+		memory.str( "" );
+	} else if( compressed ) {
+		WriteCompressedFile( filename, memory.str() );
+		memory.str( "" );
+	} else {
+		file.close();
 	}
+}
 
-	// read objects
-	while( objects.good() ) {
-		objects.ignore( numeric_limits<streamsize>::max(), ' ' );
-		if( objects.eof() ) {
-			objects.clear( ios_base::eofbit );
-			break;
-		}
+///////////////////////////////////////////////////////////////////////////////
 
-		string type;
-		objects >> type;
+// Normalized text of a UTF-8 text file for mystem, each line ends with '\n'.
+string PrepareText( const string& sourceFilename, const TTextEncoding encoding = TextEncoding )
+{
+	CDocumentInput input( sourceFilename );
+	istream& src = input.Stream();
+	if( !src.good() ) {
+		throw CException( "Cannot read text file `" + sourceFilename + "`." );
+	}
 
-		CNamedEntity entity;
-		if( entity.SetType( type ) ) {
-			while( objects.good() ) {
-				objects.ignore( numeric_limits<streamsize>::max(), ' ' );
-				if( isdigit( objects.peek() ) ) {
-					size_t id;
-					objects >> id;
-					auto span = spansBeginEnd.find( id );
-					if( span == spansBeginEnd.end() ) {
-						objects.setstate( ios::failbit );
-						break;
-					}
-					entity.Begin = min( entity.Begin, span->second.first );
-					entity.End = max( entity.End, span->second.second );
-				} else {
-					break;
-				}
+	string text;
+	string line;
+	while( src.good() ) {
+		getline( src, line );
+		if( encoding == TE_Utf8 ) {
+			if( !NormalizeUtf8Text( line ) ) {
+				throw CException( "Cannot read as valid UTF-8 text file `" + sourceFilename + "` ." );
 			}
-			if( entity.Defined() ) {
-				push_back( entity );
-			} else {
-				objects.setstate( ios::failbit );
+		} else {
+			if( !ConvertUtf8ToWindows1251( line, ' ' ) ) {
+				throw CException( "Cannot read as valid UTF-8 text file `" + sourceFilename + "` ." );
 			}
+			TextReplace( line, ReplacementsCP1251 );
 		}
-		if( objects.good() ) {
-			objects.ignore( numeric_limits<streamsize>::max(), '\n' );
-		}
-	}
-	Sort();
-	if( !Check() ) {
-		objects.setstate( ios::failbit );
-	}
-	if( objects.fail() ) {
-		throw CException( "Bad objects file `" + objectsFilename + "` format." );
+		text += line;
+		text += '\n';
 	}
-	/*for( const CNamedEntity& entity : *this ) {
-		cout << NamedEntityTypeText( entity.Type ) << " " << entity.Begin << " " << entity.End << endl;
-	}*/
+	return text;
 }
 
-void CNamedEntities::Sort()
+void PrepareTextFile( const string& sourceFilename, const string& destFilename,
+	const TTextEncoding encoding = TextEncoding )
 {
-	struct Predicate {
-		bool operator()( const CNamedEntity& ne1, const CNamedEntity& ne2 )
-		{
-			return ( ne1.Begin < ne2.Begin
-				|| ( ne1.Begin == ne2.Begin && ne1.End < ne2.End ) );
-		}
-	};
-	sort( begin(), end(), Predicate() );
+	const string text = PrepareText( sourceFilename, encoding );
+	ofstream dest( destFilename, ios_base::out | ios_base::binary );
+	dest.write( text.data(), text.length() );
+}
 
-	CNamedEntities tmp = move( *this );
-	for( const CNamedEntity& entity : tmp ) {
-		if( empty() || back().HasNoIntersection( entity ) ) {
-			push_back( entity );
-		} else if( back().Length() < entity.Length() ) {
-			back() = entity;
+// Offset after the end of a sentence of prepared text beginning at the offset,
+// a sentence ends with a line feed or with .!? before a space or a line feed.
+size_t SentenceEnd( const string& text, size_t offset )
+{
+	while( offset < text.length() ) {
+		const char c = text[offset++];
+		if( c == '\n' || ( ( c == '.' || c == '!' || c == '?' )
+			&& ( offset == text.length() || text[offset] == ' ' || text[offset] == '\n' ) ) )
+		{
+			break;
 		}
 	}
+	return offset;
 }
 
-bool CNamedEntities::Check() const
+///////////////////////////////////////////////////////////////////////////////
+
+bool System( const string& arg )
 {
-	size_t offset = 0;
-	for( const CNamedEntity& entity : *this ) {
-		if( entity.Begin < offset ) {
+	if( system( nullptr ) == 0 ) {
+		throw CException( " Function `int system( const char* )` is not supported." );
+	}
+
+#ifdef _WIN32
+	const int returnCode = system( ( "\"" + arg + "\"" ).c_str() );
+#else
+	const int returnCode = system( arg.c_str() );
+#endif
+
+	return ( returnCode == 0 );
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+vector<string> SplitString( const string& str, const char* delimiters = " \t\r",
+	bool preserveEmptyStrings = false )
+{
+	vector<string> strings;
+	size_t offset = 0;
+	while( offset < str.length() ) {
+		size_t delimiterPos = str.find_first_of( delimiters, offset );
+		if( delimiterPos == string::npos ) {
+			break;
+		}
+
+		const string part = str.substr( offset, delimiterPos - offset );
+		if( preserveEmptyStrings || !part.empty() ) {
+			strings.push_back( part );
+		}
+
+		offset = delimiterPos + 1;
+	}
+
+	const string part = str.substr( offset );
+	if( preserveEmptyStrings || !part.empty() ) {
+		strings.push_back( part );
+	}
+
+	return strings;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Normalize words of a dictionary line in the encoding, symbols
+// which are not in CP1251 are removed in CP1251, a line which is not
+// valid UTF-8 has no words in UTF-8.
+void NormalizeDictionaryLine( string& line, const TTextEncoding encoding = TextEncoding )
+{
+	if( encoding == TE_Utf8 ) {
+		if( !NormalizeUtf8Text( line ) ) {
+			line.clear();
+		}
+	} else {
+		ConvertUtf8ToWindows1251( line );
+		TextReplace( line, ReplacementsCP1251 );
+	}
+}
+
+// Convert a templates line to the encoding.
+void NormalizeTemplatesLine( string& line, const TTextEncoding encoding = TextEncoding )
+{
+	if( encoding == TE_Utf8 ) {
+		// control characters (as '\r') are removed as by the CP1251 conversion
+		line.erase( remove_if( line.begin(), line.end(), []( const char c )
+			{ return static_cast<unsigned char>( c ) < ' '; } ), line.end() );
+	} else {
+		ConvertUtf8ToWindows1251( line );
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Header of a compiled dictionaries file (see CDictionariesBuilder).
+// It is followed by the sections (in native byte order):
+// uint64_t WordOffsets[WordsCount + 1] - offsets of sorted words in Text,
+// uint32_t ChildrenBegin[NodesCount], uint32_t ChildrenCount[NodesCount],
+// uint32_t Dictionary[NodesCount] - word trie nodes,
+// uint32_t ChildWord[ChildrenCount], uint32_t ChildNode[ChildrenCount] -
+// children of nodes sorted by word, uint8_t WordFlags[WordsCount],
+// char Text[TextSize].
+struct CCompiledDictionariesHeader {
+	char Magic[8];
+	uint64_t WordsCount;
+	uint64_t NodesCount;
+	uint64_t ChildrenCount;
+	uint64_t RootNode;
+	uint64_t Depth;
+	uint64_t MaxDictionaryIndex;
+	uint64_t TextSize;
+};
+
+const char CompiledDictionariesMagic[8] = { 'O', 'C', 'C', 'D', 'I', 'C', 'T', '1' };
+// words of the dictionaries are normalized in UTF-8 (see TTextEncoding)
+const char CompiledUtf8DictionariesMagic[8] = { 'O', 'C', 'C', 'D', 'I', 'C', 'T', 'U' };
+
+const char* CompiledDictionariesMagicOf( const TTextEncoding encoding )
+{
+	return ( encoding == TE_Utf8 ) ? CompiledUtf8DictionariesMagic : CompiledDictionariesMagic;
+}
+
+// 64-bit FNV-1a hash of bytes, which continues the hash of preceding bytes.
+uint64_t HashBytes( const char* bytes, size_t size,
+	uint64_t hash = 14695981039346656037ULL )
+{
+	for( size_t i = 0; i < size; i++ ) {
+		hash = ( hash ^ static_cast<unsigned char>( bytes[i] ) ) * 1099511628211ULL;
+	}
+	return hash;
+}
+
+// Index of the word in sorted words of compiled dictionaries or wordsCount.
+size_t FindCompiledWord( const uint64_t* wordOffsets, const char* text,
+	const size_t wordsCount, const string& word )
+{
+	size_t first = 0;
+	size_t last = wordsCount;
+	while( first < last ) {
+		const size_t middle = first + ( last - first ) / 2;
+		const size_t offset = static_cast<size_t>( wordOffsets[middle] );
+		const size_t length = static_cast<size_t>( wordOffsets[middle + 1] ) - offset;
+		const int compare = word.compare( 0, string::npos, text + offset, length );
+		if( compare == 0 ) {
+			return middle;
+		} else if( compare < 0 ) {
+			last = middle;
+		} else {
+			first = middle + 1;
+		}
+	}
+	return wordsCount;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+class CDictionaries {
+	friend class CFinder;
+	friend class CMatcher;
+
+public:
+	// Word flags: WF_Known for each word of the dictionaries,
+	// WF_First for words which start a line,
+	// WF_Anchors << i for words of the anchor group i.
+	static const size_t WF_Known = 1;
+	static const size_t WF_First = 2;
+	static const size_t WF_Anchors = 4;
+	static const size_t MaxAnchorGroups = numeric_limits<size_t>::digits - 2;
+
+	CDictionaries();
+
+	static bool IsCompiledFile( const string& filename );
+	// Map compiled dictionaries, which are not loaded into memory.
+	void Open( const string& compiledFilename );
+	bool IsMapped() const { return static_cast<bool>( compiled ); }
+
+	bool IsEmpty() const { return ( levels.empty() && depth() == 0 ); }
+	size_t WordFlags( const string& word ) const;
+	// Flags which are set in each line (WF_First and required anchors).
+	size_t RequiredFlags() const;
+	// Add group of words one of which may be present in each line.
+	// All groups must be added before the lines.
+	void AddAnchors( const vector<string>& anchors );
+	void AddFile( const string& dictionaryFilename, size_t dictionaryIndex = 1 );
+	void AddLine( const string& line, size_t dictionaryIndex = 1 );
+
+	// Indices of words of a line, prefixes of which CFinder looks up.
+	typedef basic_string<size_t> CWords;
+	CWords Words( const string& line ) const;
+
+	// Key of the added lines, which identifies the generated matcher.
+	string Key() const;
+	// Look words and lines up by the matcher generated with the same key
+	// (see generate-matcher) or, if not use, by the levels again.
+	// Returns false if there is no such matcher.
+	bool UseGenerated( bool use = true );
+	bool IsGenerated() const { return ( generated != nullptr ); }
+	// Write the code of the generated matcher of the lines, the object
+	// CGeneratedDictionaries Generated<suffix> and its tables.
+	void WriteGenerated( ostream& output, const string& suffix ) const;
+	// Sorted added lines, their words are separated by spaces.
+	vector<string> Lines() const;
+
+private:
+	size_t wordIndex;
+	size_t linesCount;
+	// hash of the added lines and their dictionaries
+	uint64_t linesHash;
+	const CGeneratedDictionaries* generated;
+	size_t maxDictionaryIndex;
+	vector<size_t> anchorGroupLinesCounts;
+	unordered_map<string, size_t> wordFlags;
+
+	struct CLevel {
+		unordered_map<string, size_t> WordToIndex;
+		unordered_map<CWords, size_t> PrefixToDictionary;
+	};
+	vector<CLevel> levels;
+
+	struct CCompiled {
+		CMappedFile File;
+		CCompiledDictionariesHeader Header;
+		const uint64_t* WordOffsets;
+		const uint32_t* ChildrenBegin;
+		const uint32_t* ChildrenCount;
+		const uint32_t* Dictionary;
+		const uint32_t* ChildWord;
+		const uint32_t* ChildNode;
+		const uint8_t* WordFlags;
+		const char* Text;
+	};
+	unique_ptr<CCompiled> compiled;
+
+	// Maximum number of words in a line.
+	size_t depth() const;
+	// Index (not zero) of the word at the position in a line or 0. Indices
+	// of a word at different positions differ, so words which CFinder shifts
+	// to other positions after a failed match are not prefixes of lines.
+	size_t findWord( size_t position, const string& word ) const;
+	// Check that the words are a prefix of a line,
+	// dictionary is the line dictionary if the words are a whole line or 0.
+	bool findPrefix( const CWords& words, size_t& dictionary ) const;
+};
+
+CDictionaries::CDictionaries() :
+	wordIndex( 0 ),
+	linesCount( 0 ),
+	linesHash( HashBytes( nullptr, 0 ) ),
+	generated( nullptr ),
+	maxDictionaryIndex( 0 )
+{
+}
+
+bool CDictionaries::IsCompiledFile( const string& filename )
+{
+	ifstream file( filename, ios::in | ios::binary );
+	char magic[sizeof( CompiledDictionariesMagic )];
+	return ( file.read( magic, sizeof( magic ) ).good()
+		&& ( equal( magic, magic + sizeof( magic ), CompiledDictionariesMagic )
+			|| equal( magic, magic + sizeof( magic ), CompiledUtf8DictionariesMagic ) ) );
+}
+
+void CDictionaries::Open( const string& compiledFilename )
+{
+	if( !levels.empty() || compiled ) {
+		throw logic_error( "CDictionaries::Open" );
+	}
+
+	unique_ptr<CCompiled> file( new CCompiled );
+	if( !file->File.Open( compiledFilename ) ) {
+		throw CException( "Cannot map dictionaries `" + compiledFilename + "`." );
+	}
+	const string badFormat = "Bad compiled dictionaries `" + compiledFilename + "` format.";
+	CCompiledDictionariesHeader& header = file->Header;
+	if( file->File.Size() < sizeof( header ) ) {
+		throw CException( badFormat );
+	}
+	copy( file->File.Data(), file->File.Data() + sizeof( header ),
+		reinterpret_cast<char*>( &header ) );
+	const uint64_t expectedSize = sizeof( header )
+		+ ( header.WordsCount + 1 ) * sizeof( uint64_t )
+		+ header.NodesCount * 3 * sizeof( uint32_t )
+		+ header.ChildrenCount * 2 * sizeof( uint32_t )
+		+ header.WordsCount * sizeof( uint8_t ) + header.TextSize;
+	const char* const magic = CompiledDictionariesMagicOf( TextEncoding );
+	const char* const otherMagic = CompiledDictionariesMagicOf(
+		TextEncoding == TE_Utf8 ? TE_Cp1251 : TE_Utf8 );
+	if( equal( header.Magic, header.Magic + sizeof( header.Magic ), otherMagic ) ) {
+		throw CException( "Dictionaries `" + compiledFilename + "` are compiled"
+			" in another encoding, see --encoding." );
+	}
+	if( !equal( header.Magic, header.Magic + sizeof( header.Magic ), magic )
+		|| header.RootNode >= header.NodesCount || expectedSize != file->File.Size() )
+	{
+		throw CException( badFormat );
+	}
+
+	const char* data = file->File.Data() + sizeof( header );
+	auto section = [&data]( uint64_t size ) -> const char*
+	{
+		const char* begin = data;
+		data += size;
+		return begin;
+	};
+	file->WordOffsets = reinterpret_cast<const uint64_t*>(
+		section( ( header.WordsCount + 1 ) * sizeof( uint64_t ) ) );
+	file->ChildrenBegin = reinterpret_cast<const uint32_t*>(
+		section( header.NodesCount * sizeof( uint32_t ) ) );
+	file->ChildrenCount = reinterpret_cast<const uint32_t*>(
+		section( header.NodesCount * sizeof( uint32_t ) ) );
+	file->Dictionary = reinterpret_cast<const uint32_t*>(
+		section( header.NodesCount * sizeof( uint32_t ) ) );
+	file->ChildWord = reinterpret_cast<const uint32_t*>(
+		section( header.ChildrenCount * sizeof( uint32_t ) ) );
+	file->ChildNode = reinterpret_cast<const uint32_t*>(
+		section( header.ChildrenCount * sizeof( uint32_t ) ) );
+	file->WordFlags = reinterpret_cast<const uint8_t*>(
+		section( header.WordsCount * sizeof( uint8_t ) ) );
+	file->Text = section( header.TextSize );
+
+	maxDictionaryIndex = static_cast<size_t>( header.MaxDictionaryIndex );
+	compiled = move( file );
+}
+
+size_t CDictionaries::WordFlags( const string& word ) const
+{
+	if( compiled ) {
+		const size_t wordsCount = static_cast<size_t>( compiled->Header.WordsCount );
+		const size_t index = FindCompiledWord( compiled->WordOffsets,
+			compiled->Text, wordsCount, word );
+		return ( index == wordsCount ? 0 : compiled->WordFlags[index] );
+	}
+	auto flags = wordFlags.find( word );
+	return ( flags == wordFlags.end() ? 0 : flags->second );
+}
+
+size_t CDictionaries::depth() const
+{
+	return ( compiled ? static_cast<size_t>( compiled->Header.Depth ) : levels.size() );
+}
+
+size_t CDictionaries::findWord( size_t position, const string& word ) const
+{
+	if( generated != nullptr ) {
+		// the position is a part of the index, it is checked by findPrefix
+		const size_t id = generated->WordId( word.data(), word.length() );
+		return ( id == 0 ? 0 : position * generated->WordsCount + id );
+	}
+	if( compiled ) {
+		// the position is a part of the index, it is checked by findPrefix
+		const size_t wordsCount = static_cast<size_t>( compiled->Header.WordsCount );
+		const size_t index = FindCompiledWord( compiled->WordOffsets,
+			compiled->Text, wordsCount, word );
+		return ( index == wordsCount ? 0 : position * wordsCount + index + 1 );
+	}
+	if( position >= levels.size() ) {
+		return 0;
+	}
+	auto index = levels[position].WordToIndex.find( word );
+	return ( index == levels[position].WordToIndex.end() ? 0 : index->second );
+}
+
+bool CDictionaries::findPrefix( const CWords& words, size_t& dictionary ) const
+{
+	if( generated != nullptr ) {
+		size_t node = 0;
+		for( size_t position = 0; position < words.size(); position++ ) {
+			if( ( words[position] - 1 ) / generated->WordsCount != position ) {
+				return false;
+			}
+			node = generated->Child( node, ( words[position] - 1 ) % generated->WordsCount + 1 );
+			if( node == 0 ) {
+				return false;
+			}
+		}
+		dictionary = generated->Dictionary[node];
+		return true;
+	}
+	if( compiled ) {
+		const size_t wordsCount = static_cast<size_t>( compiled->Header.WordsCount );
+		size_t node = static_cast<size_t>( compiled->Header.RootNode );
+		for( size_t position = 0; position < words.size(); position++ ) {
+			if( ( words[position] - 1 ) / wordsCount != position ) {
+				return false;
+			}
+			const uint32_t index = static_cast<uint32_t>( ( words[position] - 1 ) % wordsCount );
+			const uint32_t* begin = compiled->ChildWord + compiled->ChildrenBegin[node];
+			const uint32_t* end = begin + compiled->ChildrenCount[node];
+			const uint32_t* child = lower_bound( begin, end, index );
+			if( child == end || *child != index ) {
+				return false;
+			}
+			node = compiled->ChildNode[child - compiled->ChildWord];
+		}
+		dictionary = compiled->Dictionary[node];
+		return true;
+	}
+	const CLevel& level = levels[words.size() - 1];
+	auto prefix = level.PrefixToDictionary.find( words );
+	if( prefix == level.PrefixToDictionary.end() ) {
+		return false;
+	}
+	dictionary = prefix->second;
+	return true;
+}
+
+string CDictionaries::Key() const
+{
+	ostringstream key;
+	key << hex << setw( 16 ) << setfill( '0' ) << linesHash << dec << "-" << linesCount;
+	return key.str();
+}
+
+bool CDictionaries::UseGenerated( bool use )
+{
+	generated = nullptr;
+	if( !use ) {
+		return true;
+	}
+	if( compiled ) {
+		return false;
+	}
+	const string key = Key();
+	for( size_t i = 0; i < GeneratedDictionariesCount; i++ ) {
+		if( key == GeneratedDictionaries[i]->Key ) {
+			generated = GeneratedDictionaries[i];
+			return true;
+		}
+	}
+	return false;
+}
+
+// C++ string literal of bytes, other than ASCII letters and digits are octal.
+string CppString( const string& text )
+{
+	ostringstream literal;
+	literal << '"' << oct << setfill( '0' );
+	for( const char c : text ) {
+		if( ( c >= 'a' && c <= 'z' ) || ( c >= 'A' && c <= 'Z' ) || ( c >= '0' && c <= '9' ) ) {
+			literal << c;
+		} else {
+			literal << '\\' << setw( 3 ) << static_cast<unsigned int>( static_cast<unsigned char>( c ) );
+		}
+	}
+	literal << '"';
+	return literal.str();
+}
+
+void CDictionaries::WriteGenerated( ostream& output, const string& suffix ) const
+{
+	if( compiled ) {
+		throw CException( "Compiled dictionaries cannot be generated, use their text files." );
+	}
+	// words are numbered in sorted order
+	unordered_map<size_t, const string*> indexWords;
+	for( const CLevel& level : levels ) {
+		for( const pair<const string, size_t>& word : level.WordToIndex ) {
+			indexWords[word.second] = &word.first;
+		}
+	}
+	vector<string> words;
+	for( const pair<const size_t, const string*>& word : indexWords ) {
+		words.push_back( *word.second );
+	}
+	sort( words.begin(), words.end() );
+	words.erase( unique( words.begin(), words.end() ), words.end() );
+
+	// nodes of the trie are numbered breadth-first, children of a node by ids
+	map<pair<size_t, vector<size_t>>, size_t> prefixes;
+	for( const CLevel& level : levels ) {
+		for( const pair<const CWords, size_t>& prefix : level.PrefixToDictionary ) {
+			vector<size_t> ids;
+			for( const size_t index : prefix.first ) {
+				ids.push_back( lower_bound( words.cbegin(), words.cend(),
+					*indexWords[index] ) - words.cbegin() + 1 );
+			}
+			prefixes[make_pair( ids.size(), ids )] = prefix.second;
+		}
+	}
+	map<vector<size_t>, size_t> nodes;
+	nodes[vector<size_t>()] = 0;
+	vector<size_t> nodeDictionaries( 1, 0 );
+	vector<vector<pair<size_t, size_t>>> children( 1 );
+	for( const pair<const pair<size_t, vector<size_t>>, size_t>& prefix : prefixes ) {
+		const vector<size_t>& ids = prefix.first.second;
+		const size_t node = nodeDictionaries.size();
+		nodes[ids] = node;
+		nodeDictionaries.push_back( prefix.second );
+		children.emplace_back();
+		const size_t parent = nodes.at( vector<size_t>( ids.cbegin(), ids.cend() - 1 ) );
+		children[parent].emplace_back( ids.back(), node );
+	}
+
+	// words are compared with the words of the same length, first and last byte
+	map<size_t, map<unsigned char, map<unsigned char, vector<size_t>>>> wordGroups;
+	for( size_t id = 1; id <= words.size(); id++ ) {
+		const string& word = words[id - 1];
+		wordGroups[word.length()][static_cast<unsigned char>( word.front() )]
+			[static_cast<unsigned char>( word.back() )].push_back( id );
+	}
+
+	output << "// " << linesCount << " lines, " << words.size() << " words, "
+		<< nodeDictionaries.size() << " nodes\n";
+	output << "size_t WordId" << suffix << "( const char* word, size_t length )\n{\n";
+	output << "\tswitch( length ) {\n";
+	for( const auto& lengthGroup : wordGroups ) {
+		output << "\t\tcase " << lengthGroup.first << ":\n";
+		output << "\t\t\tswitch( static_cast<unsigned char>( word[0] ) ) {\n";
+		for( const auto& firstGroup : lengthGroup.second ) {
+			output << "\t\t\t\tcase " << static_cast<size_t>( firstGroup.first ) << ":\n";
+			output << "\t\t\t\t\tswitch( static_cast<unsigned char>( word[length - 1] ) ) {\n";
+			for( const auto& lastGroup : firstGroup.second ) {
+				output << "\t\t\t\t\t\tcase " << static_cast<size_t>( lastGroup.first ) << ":\n";
+				for( const size_t id : lastGroup.second ) {
+					output << "\t\t\t\t\t\t\tif( memcmp( word, " << CppString( words[id - 1] )
+						<< ", length ) == 0 ) return " << id << ";\n";
+				}
+				output << "\t\t\t\t\t\t\tbreak;\n";
+			}
+			output << "\t\t\t\t\t}\n\t\t\t\t\tbreak;\n";
+		}
+		output << "\t\t\t}\n\t\t\tbreak;\n";
+	}
+	output << "\t}\n\treturn 0;\n}\n\n";
+	output << "const uint32_t Dictionary" << suffix << "[] = {";
+	for( size_t i = 0; i < nodeDictionaries.size(); i++ ) {
+		output << ( i % 16 == 0 ? "\n\t" : " " ) << nodeDictionaries[i] << ",";
+	}
+	output << "\n};\n\n";
+	output << "size_t Child" << suffix << "( size_t node, size_t word )\n{\n";
+	output << "\tswitch( node ) {\n";
+	for( size_t node = 0; node < children.size(); node++ ) {
+		if( children[node].empty() ) {
+			continue;
+		}
+		output << "\t\tcase " << node << ":\n\t\t\tswitch( word ) {\n";
+		for( const pair<size_t, size_t>& child : children[node] ) {
+			output << "\t\t\t\tcase " << child.first << ": return " << child.second << ";\n";
+		}
+		output << "\t\t\t}\n\t\t\tbreak;\n";
+	}
+	output << "\t}\n\treturn 0;\n}\n\n";
+	output << "const CGeneratedDictionaries Generated" << suffix << " = { \"" << Key() << "\", "
+		<< words.size() << ", WordId" << suffix << ", Dictionary" << suffix << ", Child" << suffix << " };\n\n";
+}
+
+vector<string> CDictionaries::Lines() const
+{
+	unordered_map<size_t, const string*> indexWords;
+	for( const CLevel& level : levels ) {
+		for( const pair<const string, size_t>& word : level.WordToIndex ) {
+			indexWords[word.second] = &word.first;
+		}
+	}
+	vector<string> lines;
+	for( const CLevel& level : levels ) {
+		for( const pair<const CWords, size_t>& prefix : level.PrefixToDictionary ) {
+			if( prefix.second == 0 ) {
+				continue;
+			}
+			string line;
+			for( const size_t index : prefix.first ) {
+				line += ( line.empty() ? "" : " " ) + *indexWords.at( index );
+			}
+			lines.push_back( line );
+		}
+	}
+	sort( lines.begin(), lines.end() );
+	return lines;
+}
+
+// Use the generated matcher of dictionaries if the run uses them,
+// name is used in errors.
+void SetUpMatcher( CDictionaries& dictionaries, const string& name )
+{
+	if( UseGeneratedMatchers && !dictionaries.IsEmpty() && !dictionaries.UseGenerated() ) {
+		throw CException( "Matcher of " + name + " is not generated into the program,"
+			" run generate-matcher and rebuild it." );
+	}
+}
+
+CDictionaries::CWords CDictionaries::Words( const string& line ) const
+{
+	CWords words;
+	for( const string& word : SplitString( line ) ) {
+		words.push_back( findWord( words.size(), word ) );
+	}
+	return words;
+}
+
+size_t CDictionaries::RequiredFlags() const
+{
+	size_t flags = WF_Known | WF_First;
+	for( size_t i = 0; i < anchorGroupLinesCounts.size(); i++ ) {
+		if( anchorGroupLinesCounts[i] == linesCount ) {
+			flags |= WF_Anchors << i;
+		}
+	}
+	return flags;
+}
+
+void CDictionaries::AddAnchors( const vector<string>& anchors )
+{
+	if( linesCount > 0 || compiled || anchorGroupLinesCounts.size() == MaxAnchorGroups ) {
+		throw logic_error( "CDictionaries::AddAnchors" );
+	}
+	const size_t anchorFlag = WF_Anchors << anchorGroupLinesCounts.size();
+	anchorGroupLinesCounts.push_back( 0 );
+	for( const string& anchor : anchors ) {
+		wordFlags[anchor] |= anchorFlag;
+	}
+}
+
+void CDictionaries::AddFile( const string& dictionaryFilename, size_t dictionaryIndex )
+{
+	ifstream dictionaryFile( dictionaryFilename );
+	if( !dictionaryFile.good() ) {
+		throw CException( "Cannot read dictionary `" + dictionaryFilename + "`." );
+	}
+	string line;
+	while( dictionaryFile.good() ) {
+		getline( dictionaryFile, line );
+		NormalizeDictionaryLine( line );
+		AddLine( line, dictionaryIndex );
+	}
+}
+
+void CDictionaries::AddLine( const string& line, size_t dictionaryIndex )
+{
+	if( dictionaryIndex == 0 ) {
+		throw logic_error( "CDictionaries::AddLine invalid dictionaryIndex" );
+	}
+	if( compiled ) {
+		throw CException( "Compiled dictionaries cannot be extended." );
+	}
+	maxDictionaryIndex = max( maxDictionaryIndex, dictionaryIndex );
+
+	vector<string> strings = SplitString( line );
+	if( strings.empty() ) {
+		return;
+	}
+	for( const string& word : strings ) {
+		linesHash = HashBytes( word.c_str(), word.length() + 1, linesHash );
+	}
+	linesHash = HashBytes( reinterpret_cast<const char*>( &dictionaryIndex ),
+		sizeof( dictionaryIndex ), linesHash );
+
+	if( levels.size() < strings.size() ) {
+		levels.resize( strings.size() );
+	}
+
+	size_t lineFlags = 0;
+	for( size_t i = 0; i < strings.size(); i++ ) {
+		size_t& flags = wordFlags[strings[i]];
+		flags |= WF_Known | ( i == 0 ? WF_First : 0 );
+		lineFlags |= flags;
+	}
+	linesCount++;
+	for( size_t i = 0; i < anchorGroupLinesCounts.size(); i++ ) {
+		if( ( lineFlags & ( WF_Anchors << i ) ) != 0 ) {
+			anchorGroupLinesCounts[i]++;
+		}
+	}
+
+	CWords words;
+	words.reserve( strings.size() );
+	for( size_t i = 0; i < strings.size(); i++ ) {
+		++wordIndex;
+
+		auto p1 = levels[i].WordToIndex.insert( make_pair( strings[i], wordIndex ) );
+		words.push_back( p1.first->second );
+
+		auto p2 = levels[i].PrefixToDictionary.insert( make_pair( words, 0 ) );
+		if( i == strings.size() - 1 ) {
+			if( p2.first->second != 0 && p2.first->second != dictionaryIndex ) {
+				throw CException( "Duplicates were found in the dictionaries." );
+			}
+			p2.first->second = dictionaryIndex;
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+template<typename TValue>
+void WriteValue( ostream& output, const TValue& value )
+{
+	output.write( reinterpret_cast<const char*>( &value ), sizeof( value ) );
+}
+
+// Builds compiled dictionaries (see CDictionaries::Open) in external memory.
+// Normalized lines are sorted in runs of limited memory size on disk and
+// merged with removal of duplicates, words of the lines are collected the
+// same way. The word trie is written node by node in post-order while the
+// sorted lines are read, so only the current path of the trie is in memory.
+class CDictionariesBuilder {
+public:
+	CDictionariesBuilder( const string& filename, size_t memoryLimit );
+	~CDictionariesBuilder();
+
+	void AddFile( const string& dictionaryFilename, size_t dictionaryIndex );
+	void Build();
+
+private:
+	const string filename;
+	const size_t memoryLimit;
+	size_t maxDictionaryIndex;
+	vector<string> tempFilenames;
+	// records of the current run: `words\tdictionary` or `word\tflags`
+	vector<string> records;
+	size_t recordsSize;
+	vector<string> lineRuns;
+	vector<string> wordRuns;
+
+	string newTempFilename();
+	void addRecord( string&& record, vector<string>& runs, bool isWord );
+	void flushRecords( vector<string>& runs, bool isWord );
+	static void mergeRuns( const vector<string>& runs,
+		const function<void( const string& record )>& output );
+	static string recordKey( const string& record );
+	static bool recordLess( const string& record1, const string& record2 );
+	static char mergeWordFlags( char flags1, char flags2 );
+
+	CDictionariesBuilder( const CDictionariesBuilder& ) = delete;
+	CDictionariesBuilder& operator=( const CDictionariesBuilder& ) = delete;
+};
+
+CDictionariesBuilder::CDictionariesBuilder( const string& _filename, size_t _memoryLimit ) :
+	filename( _filename ),
+	memoryLimit( _memoryLimit ),
+	maxDictionaryIndex( 0 ),
+	recordsSize( 0 )
+{
+}
+
+CDictionariesBuilder::~CDictionariesBuilder()
+{
+	for( const string& tempFilename : tempFilenames ) {
+		remove( tempFilename.c_str() );
+	}
+}
+
+void CDictionariesBuilder::AddFile( const string& dictionaryFilename, size_t dictionaryIndex )
+{
+	if( dictionaryIndex == 0 || dictionaryIndex > numeric_limits<uint32_t>::max() ) {
+		throw logic_error( "CDictionariesBuilder::AddFile invalid dictionaryIndex" );
+	}
+	maxDictionaryIndex = max( maxDictionaryIndex, dictionaryIndex );
+
+	ifstream dictionaryFile( dictionaryFilename );
+	if( !dictionaryFile.good() ) {
+		throw CException( "Cannot read dictionary `" + dictionaryFilename + "`." );
+	}
+	const string suffix = "\t" + to_string( dictionaryIndex );
+	string line;
+	while( dictionaryFile.good() ) {
+		getline( dictionaryFile, line );
+		NormalizeDictionaryLine( line );
+		const vector<string> words = SplitString( line );
+		if( words.empty() ) {
+			continue;
+		}
+		string record;
+		for( const string& word : words ) {
+			record += ( record.empty() ? "" : " " ) + word;
+		}
+		addRecord( record + suffix, lineRuns, false /* isWord */ );
+	}
+}
+
+void CDictionariesBuilder::Build()
+{
+	flushRecords( lineRuns, false /* isWord */ );
+
+	// merge lines and collect their words
+	const string linesFilename = newTempFilename();
+	{
+		ofstream lines( linesFilename, ios::out | ios::binary );
+		string lastKey;
+		string lastRecord;
+		mergeRuns( lineRuns, [&]( const string& record )
+		{
+			const string key = recordKey( record );
+			if( !lastRecord.empty() && key == lastKey ) {
+				if( record != lastRecord ) {
+					throw CException( "Duplicates were found in the dictionaries." );
+				}
+				return;
+			}
+			lines << record << '\n';
+			const vector<string> words = SplitString( key );
+			for( size_t i = 0; i < words.size(); i++ ) {
+				addRecord( words[i] + ( i == 0 ? "\t3" : "\t1" ), wordRuns, true /* isWord */ );
+			}
+			lastKey = key;
+			lastRecord = record;
+		} );
+		if( !lines.good() ) {
+			throw CException( "Cannot write `" + linesFilename + "`." );
+		}
+	}
+	flushRecords( wordRuns, true /* isWord */ );
+
+	// merge words
+	const string offsetsFilename = newTempFilename();
+	const string wordFlagsFilename = newTempFilename();
+	const string textFilename = newTempFilename();
+	uint64_t wordsCount = 0;
+	uint64_t textSize = 0;
+	{
+		ofstream offsets( offsetsFilename, ios::out | ios::binary );
+		ofstream wordFlags( wordFlagsFilename, ios::out | ios::binary );
+		ofstream text( textFilename, ios::out | ios::binary );
+		string lastWord;
+		char lastFlags = '\0';
+		auto writeWord = [&]()
+		{
+			if( lastFlags != '\0' ) {
+				WriteValue( offsets, textSize );
+				WriteValue( wordFlags, static_cast<uint8_t>( lastFlags - '0' ) );
+				text << lastWord;
+				textSize += lastWord.length();
+				wordsCount++;
+			}
+		};
+		mergeRuns( wordRuns, [&]( const string& record )
+		{
+			const string word = recordKey( record );
+			if( lastFlags != '\0' && word == lastWord ) {
+				lastFlags = mergeWordFlags( lastFlags, record.back() );
+			} else {
+				writeWord();
+				lastWord = word;
+				lastFlags = record.back();
+			}
+		} );
+		writeWord();
+		WriteValue( offsets, textSize );
+		if( !offsets.good() || !wordFlags.good() || !text.good() ) {
+			throw CException( "Cannot write temporary files of `" + filename + "`." );
+		}
+	}
+	if( wordsCount >= numeric_limits<uint32_t>::max() ) {
+		throw CException( "Too many words in the dictionaries." );
+	}
+
+	// build word trie
+	const string childrenBeginFilename = newTempFilename();
+	const string childrenCountFilename = newTempFilename();
+	const string dictionaryFilename = newTempFilename();
+	const string childWordFilename = newTempFilename();
+	const string childNodeFilename = newTempFilename();
+	uint64_t nodesCount = 0;
+	uint64_t childrenCount = 0;
+	uint64_t rootNode = 0;
+	uint64_t depth = 0;
+	{
+		CMappedFile offsets;
+		CMappedFile text;
+		if( !offsets.Open( offsetsFilename ) || !text.Open( textFilename ) ) {
+			throw CException( "Cannot map temporary files of `" + filename + "`." );
+		}
+		const uint64_t* wordOffsets = reinterpret_cast<const uint64_t*>( offsets.Data() );
+
+		ofstream childrenBegin( childrenBeginFilename, ios::out | ios::binary );
+		ofstream childrenCounts( childrenCountFilename, ios::out | ios::binary );
+		ofstream dictionaries( dictionaryFilename, ios::out | ios::binary );
+		ofstream childWords( childWordFilename, ios::out | ios::binary );
+		ofstream childNodes( childNodeFilename, ios::out | ios::binary );
+
+		struct CNode {
+			uint32_t Word;
+			uint32_t Dictionary;
+			vector<pair<uint32_t, uint32_t>> Children;
+
+			CNode( uint32_t word ) :
+				Word( word ),
+				Dictionary( 0 )
+			{
+			}
+		};
+		vector<CNode> path( 1, CNode( 0 ) );
+		auto popNode = [&]()
+		{
+			if( nodesCount >= numeric_limits<uint32_t>::max() ) {
+				throw CException( "Too many words in the dictionaries." );
+			}
+			const CNode& node = path.back();
+			WriteValue( childrenBegin, static_cast<uint32_t>( childrenCount ) );
+			WriteValue( childrenCounts, static_cast<uint32_t>( node.Children.size() ) );
+			WriteValue( dictionaries, node.Dictionary );
+			for( const pair<uint32_t, uint32_t>& child : node.Children ) {
+				WriteValue( childWords, child.first );
+				WriteValue( childNodes, child.second );
+			}
+			childrenCount += node.Children.size();
+			const uint32_t word = node.Word;
+			path.pop_back();
+			if( !path.empty() ) {
+				path.back().Children.emplace_back( word, static_cast<uint32_t>( nodesCount ) );
+			}
+			return nodesCount++;
+		};
+
+		ifstream lines( linesFilename, ios::in | ios::binary );
+		string line;
+		while( getline( lines, line ) ) {
+			const size_t tabPos = line.find( '\t' );
+			const vector<string> words = SplitString( line.substr( 0, tabPos ) );
+			size_t common = 0;
+			vector<uint32_t> wordIndices;
+			for( const string& word : words ) {
+				wordIndices.push_back( static_cast<uint32_t>( FindCompiledWord( wordOffsets,
+					text.Data(), static_cast<size_t>( wordsCount ), word ) ) );
+			}
+			while( common < wordIndices.size() && common + 1 < path.size()
+				&& path[common + 1].Word == wordIndices[common] )
+			{
+				common++;
+			}
+			while( path.size() > common + 1 ) {
+				popNode();
+			}
+			for( size_t i = common; i < wordIndices.size(); i++ ) {
+				path.emplace_back( wordIndices[i] );
+			}
+			path.back().Dictionary = static_cast<uint32_t>( stoul( line.substr( tabPos + 1 ) ) );
+			depth = max<uint64_t>( depth, words.size() );
+		}
+		while( !path.empty() ) {
+			rootNode = popNode();
+		}
+		if( !childrenBegin.good() || !childrenCounts.good() || !dictionaries.good()
+			|| !childWords.good() || !childNodes.good() )
+		{
+			throw CException( "Cannot write temporary files of `" + filename + "`." );
+		}
+	}
+
+	// write compiled dictionaries
+	CCompiledDictionariesHeader header;
+	const char* const magic = CompiledDictionariesMagicOf( TextEncoding );
+	copy( magic, magic + sizeof( header.Magic ), header.Magic );
+	header.WordsCount = wordsCount;
+	header.NodesCount = nodesCount;
+	header.ChildrenCount = childrenCount;
+	header.RootNode = rootNode;
+	header.Depth = depth;
+	header.MaxDictionaryIndex = maxDictionaryIndex;
+	header.TextSize = textSize;
+
+	ofstream output( filename, ios::out | ios::binary );
+	WriteValue( output, header );
+	for( const string& section : { offsetsFilename, childrenBeginFilename,
+		childrenCountFilename, dictionaryFilename, childWordFilename,
+		childNodeFilename, wordFlagsFilename, textFilename } )
+	{
+		ifstream input( section, ios::in | ios::binary );
+		if( input.peek() != char_traits<char>::eof() ) {
+			output << input.rdbuf();
+		}
+	}
+	if( !output.good() ) {
+		throw CException( "Cannot write compiled dictionaries `" + filename + "`." );
+	}
+}
+
+string CDictionariesBuilder::newTempFilename()
+{
+	tempFilenames.push_back( filename + ".tmp" + to_string( tempFilenames.size() ) );
+	return tempFilenames.back();
+}
+
+void CDictionariesBuilder::addRecord( string&& record, vector<string>& runs, bool isWord )
+{
+	recordsSize += record.length() + sizeof( string );
+	records.push_back( move( record ) );
+	if( recordsSize >= memoryLimit ) {
+		flushRecords( runs, isWord );
+	}
+}
+
+void CDictionariesBuilder::flushRecords( vector<string>& runs, bool isWord )
+{
+	sort( records.begin(), records.end(), recordLess );
+
+	runs.push_back( newTempFilename() );
+	ofstream run( runs.back(), ios::out | ios::binary );
+	for( size_t i = 0; i < records.size(); i++ ) {
+		if( i + 1 < records.size() && recordKey( records[i] ) == recordKey( records[i + 1] ) ) {
+			if( isWord ) {
+				// keep the last record with flags of both
+				records[i + 1].back() = mergeWordFlags( records[i].back(), records[i + 1].back() );
+				continue;
+			} else if( records[i] == records[i + 1] ) {
+				continue;
+			}
+		}
+		run << records[i] << '\n';
+	}
+	if( !run.good() ) {
+		throw CException( "Cannot write `" + runs.back() + "`." );
+	}
+
+	records.clear();
+	records.shrink_to_fit();
+	recordsSize = 0;
+}
+
+void CDictionariesBuilder::mergeRuns( const vector<string>& runs,
+	const function<void( const string& record )>& output )
+{
+	typedef pair<string, size_t> CRecord;
+	auto greaterRecord = []( const CRecord& record1, const CRecord& record2 )
+	{
+		return recordLess( record2.first, record1.first );
+	};
+	priority_queue<CRecord, vector<CRecord>, decltype( greaterRecord )> queue( greaterRecord );
+	vector<unique_ptr<ifstream>> inputs;
+	for( const string& run : runs ) {
+		inputs.emplace_back( new ifstream( run, ios::in | ios::binary ) );
+		string record;
+		if( getline( *inputs.back(), record ) ) {
+			queue.emplace( move( record ), inputs.size() - 1 );
+		}
+	}
+	while( !queue.empty() ) {
+		CRecord record = queue.top();
+		queue.pop();
+		output( record.first );
+		if( getline( *inputs[record.second], record.first ) ) {
+			queue.push( move( record ) );
+		}
+	}
+}
+
+string CDictionariesBuilder::recordKey( const string& record )
+{
+	return record.substr( 0, record.find( '\t' ) );
+}
+
+// Records are compared word by word, so lines with common first words
+// are adjacent and the order of words is the order of sorted strings.
+bool CDictionariesBuilder::recordLess( const string& record1, const string& record2 )
+{
+	auto rank = []( char c )
+	{
+		return c == '\t' ? 0 : ( c == ' ' ? 1 : static_cast<unsigned char>( c ) + 2 );
+	};
+	return lexicographical_compare( record1.begin(), record1.end(),
+		record2.begin(), record2.end(), [&rank]( char c1, char c2 )
+	{
+		return rank( c1 ) < rank( c2 );
+	} );
+}
+
+char CDictionariesBuilder::mergeWordFlags( char flags1, char flags2 )
+{
+	return static_cast<char>( '0' + ( ( flags1 - '0' ) | ( flags2 - '0' ) ) );
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+class CFinder {
+public:
+	struct CMatch {
+		size_t Begin;
+		size_t End;
+		size_t Dictionary;
+
+		CMatch( size_t begin, size_t end, size_t dictionary ) :
+			Begin( begin ),
+			End( end ),
+			Dictionary( dictionary )
+		{
+		}
+	};
+	typedef vector<CMatch> CMatches;
+
+	// Words added to the state and retries after a word was not added.
+	struct CCounters {
+		size_t Shifts;
+		size_t Backtracks;
+
+		CCounters() :
+			Shifts( 0 ),
+			Backtracks( 0 )
+		{
+		}
+
+		CCounters& operator+=( const CCounters& other )
+		{
+			Shifts += other.Shifts;
+			Backtracks += other.Backtracks;
+			return *this;
+		}
+	};
+
+	// Numbers of found and missed lookups of prefixes of words.
+	struct CLookups {
+		size_t Found;
+		size_t Missed;
+
+		CLookups() :
+			Found( 0 ),
+			Missed( 0 )
+		{
+		}
+	};
+	typedef unordered_map<CDictionaries::CWords, CLookups> CPrefixLookups;
+
+	explicit CFinder( const CDictionaries& dictionaries );
+
+	// Collect each lookup of a prefix to `lookups` (used by profiling).
+	void CollectLookups( CPrefixLookups* lookups ) { prefixLookups = lookups; }
+	void Reset();
+	bool IsEmpty() const { return words.empty(); }
+	// Number of first pushed words which matches are final.
+	size_t FinalWordsCount() const { return wordIndex; }
+	void Push( const string& word );
+	// Same as Push of `wordsCount` words absent in the dictionaries.
+	void Skip( size_t wordsCount = 1 );
+	void Finish();
+	const CMatches& Matches() const { return matches; }
+	const CCounters& Counters() const { return counters; }
+
+private:
+	const CDictionaries& dictionaries;
+	CDictionaries::CWords words;
+	size_t count;
+	size_t dictionary;
+	size_t wordIndex;
+	CMatches matches;
+	CCounters counters;
+	CPrefixLookups* prefixLookups;
+
+	void addMatch( size_t begin, size_t end, size_t dictionary );
+	bool addWord( const string& word );
+	void dump();
+	bool processWords();
+};
+
+CFinder::CFinder( const CDictionaries& _dictionaries ) :
+	dictionaries( _dictionaries ),
+	prefixLookups( nullptr )
+{
+	Reset();
+}
+
+void CFinder::Reset()
+{
+	words.clear();
+	count = 0;
+	dictionary = 0;
+	wordIndex = 0;
+	matches.clear();
+	counters = CCounters();
+}
+
+void CFinder::Push( const string& word )
+{
+	while( !addWord( word ) ) {
+		if( words.empty() ) {
+			wordIndex++;
+			break;
+		}
+		counters.Backtracks++;
+		if( count > 0 ) {
+			dump();
+		} else {
+			words.erase( words.begin() );
+			wordIndex++;
+		}
+	}
+}
+
+void CFinder::Skip( size_t wordsCount )
+{
+	if( wordsCount == 0 ) {
+		return;
+	}
+
+	while( !words.empty() ) {
+		if( count > 0 ) {
+			dump();
+		} else {
+			words.erase( words.begin() );
+			wordIndex++;
+		}
+	}
+	wordIndex += wordsCount;
+}
+
+void CFinder::Finish()
+{
+	if( count > 0 ) {
+		dump();
+	}
+
+	while( !words.empty() ) {
+		counters.Backtracks++;
+		if( processWords() && count > 0 ) {
+			dump();
+		} else if( !words.empty() ) {
+			words.erase( words.begin() );
+			wordIndex++;
+		}
+	}
+}
+
+void CFinder::addMatch( size_t begin, size_t end, size_t dictionary )
+{
+	matches.emplace_back( begin, end, dictionary );
+}
+
+bool CFinder::addWord( const string& word )
+{
+	const size_t wordIndex = dictionaries.findWord( words.size(), word );
+	if( wordIndex != 0 ) {
+		words.push_back( wordIndex );
+		if( processWords() ) {
+			counters.Shifts++;
+			return true;
+		}
+		words.pop_back();
+	}
+	return false;
+}
+
+void CFinder::dump()
+{
+	if( count == 0 || words.size() < count ) {
+		throw logic_error( "CFinder::dump()" );
+	}
+	addMatch( wordIndex, wordIndex + count, dictionary );
+	words.erase( words.begin(), words.begin() + count );
+	wordIndex += count;
+	count = 0;
+	dictionary = 0;
+}
+
+bool CFinder::processWords()
+{
+	size_t prefixDictionary;
+	const bool found = dictionaries.findPrefix( words, prefixDictionary );
+	if( prefixLookups != nullptr ) {
+		CLookups& lookups = ( *prefixLookups )[words];
+		( found ? lookups.Found : lookups.Missed )++;
+	}
+	if( found ) {
+		if( prefixDictionary > 0 ) {
+			count = words.size();
+			dictionary = prefixDictionary;
+			if( count == dictionaries.depth() ) {
+				dump();
+			}
+		}
+		return true;
+	}
+	return false;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+struct CInterval {
+	size_t Begin;
+	size_t End;
+
+	CInterval() :
+		Begin( numeric_limits<size_t>::max() ),
+		End( 0 )
+	{
+	}
+
+	CInterval( size_t begin, size_t end ) :
+		Begin( begin ),
+		End( end )
+	{
+	}
+
+	bool Defined() const
+	{
+		return ( Begin < End );
+	}
+
+	size_t Length() const
+	{
+		return ( End - Begin );
+	}
+
+	bool HasNoIntersection( const CInterval& another ) const
+	{
+		return ( End <= another.Begin || another.End <= Begin );
+	}
+
+	void Offset( size_t offset )
+	{
+		Begin += offset;
+		End += offset;
+	}
+};
+
+enum TNamedEntityType {
+	NET_None,
+	NET_Org,
+	NET_Person,
+	NET_Location
+};
+
+const char* NamedEntityTypeText( TNamedEntityType type )
+{
+	switch( type ) {
+		case NET_Org:
+			return "Org";
+		case NET_Person:
+			return "Person";
+		case NET_Location:
+			return "Location";
+		default:
+			break;
+	}
+	return "None";
+}
+
+struct CNamedEntity : public CInterval {
+	TNamedEntityType Type;
+
+	CNamedEntity() :
+		Type( NET_None )
+	{
+	}
+
+	bool Defined() const
+	{
+		return ( Type != NET_None && CInterval::Defined() );
+	}
+
+	bool SetType( const string& type )
+	{
+		Type = NET_None;
+		if( type == "Person" ) {
+			Type = NET_Person;
+		} else if( type == "Org" || type == "LocOrg" ) {
+			Type = NET_Org;
+		} else if( type == "Location" ) {
+			Type = NET_Location;
+		}
+		return ( Type != NET_None );
+	}
+};
+
+class CNamedEntities : public vector<CNamedEntity> {
+public:
+	CNamedEntities()
+	{
+	}
+
+	void Read( const string& baseFilename );
+	void Sort();
+	bool Check() const;
+};
+
+void CNamedEntities::Read( const string& baseFilename )
+{
+	clear();
+
+	const string spansFilename = baseFilename + ".spans";
+	const string objectsFilename = baseFilename + ".objects";
+
+	CDocumentInput spansFile( spansFilename );
+	istream& spans = spansFile.Stream();
+	if( !spans.good() ) {
+		throw CException( "File `" + spansFilename + "` not found." );
+	}
+	CDocumentInput objectsFile( objectsFilename );
+	istream& objects = objectsFile.Stream();
+	if( !objects.good() ) {
+		throw CException( "File `" + objectsFilename + "` not found." );
+	}
+
+	// read spans
+	map<size_t, pair<size_t, size_t>> spansBeginEnd;
+	while( spans.good() ) {
+		string ignore;
+		size_t id;
+		size_t offset;
+		size_t length;
+		spans >> id >> ignore >> offset >> length;
+		if( spans.good() ) {
+			spansBeginEnd.insert( make_pair( id, make_pair( offset, offset + length ) ) );
+			spans.ignore( numeric_limits<streamsize>::max(), '\n' );
+		} else if( spans.eof() ) {
+			spans.clear( ios::eofbit );
+		}
+	}
+	if( spans.fail() ) {
+		throw CException( "Bad spans file `" + spansFilename + "` format." );
+	}
+
+	// read objects
+	while( objects.good() ) {
+		objects.ignore( numeric_limits<streamsize>::max(), ' ' );
+		if( objects.eof() ) {
+			objects.clear( ios_base::eofbit );
+			break;
+		}
+
+		string type;
+		objects >> type;
+
+		CNamedEntity entity;
+		if( entity.SetType( type ) ) {
+			while( objects.good() ) {
+				objects.ignore( numeric_limits<streamsize>::max(), ' ' );
+				if( isdigit( objects.peek() ) ) {
+					size_t id;
+					objects >> id;
+					auto span = spansBeginEnd.find( id );
+					if( span == spansBeginEnd.end() ) {
+						objects.setstate( ios::failbit );
+						break;
+					}
+					entity.Begin = min( entity.Begin, span->second.first );
+					entity.End = max( entity.End, span->second.second );
+				} else {
+					break;
+				}
+			}
+			if( entity.Defined() ) {
+				push_back( entity );
+			} else {
+				objects.setstate( ios::failbit );
+			}
+		}
+		if( objects.good() ) {
+			objects.ignore( numeric_limits<streamsize>::max(), '\n' );
+		}
+	}
+	Sort();
+	if( !Check() ) {
+		objects.setstate( ios::failbit );
+	}
+	if( objects.fail() ) {
+		throw CException( "Bad objects file `" + objectsFilename + "` format." );
+	}
+	/*for( const CNamedEntity& entity : *this ) {
+		cout << NamedEntityTypeText( entity.Type ) << " " << entity.Begin << " " << entity.End << endl;
+	}*/
+}
+
+void CNamedEntities::Sort()
+{
+	struct Predicate {
+		bool operator()( const CNamedEntity& ne1, const CNamedEntity& ne2 )
+		{
+			return ( ne1.Begin < ne2.Begin
+				|| ( ne1.Begin == ne2.Begin && ne1.End < ne2.End ) );
+		}
+	};
+	sort( begin(), end(), Predicate() );
+
+	CNamedEntities tmp = move( *this );
+	for( const CNamedEntity& entity : tmp ) {
+		if( empty() || back().HasNoIntersection( entity ) ) {
+			push_back( entity );
+		} else if( back().Length() < entity.Length() ) {
+			back() = entity;
+		}
+	}
+}
+
+bool CNamedEntities::Check() const
+{
+	size_t offset = 0;
+	for( const CNamedEntity& entity : *this ) {
+		if( entity.Begin < offset ) {
+			return false;
+		}
+		offset = entity.End;
+	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+struct CToken : public CInterval {
+	string Text;
+	string Lexem;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Caches of results of processing stages start with a line with the key
+// of the inputs of the stage. Returns whether the first line is the key.
+bool ReadCacheKey( istream& input, const string& key )
+{
+	string inputKey;
+	return ( getline( input, inputKey ) && inputKey == key );
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+class CTokens : public vector<CToken> {
+public:
+	CTokens()
+	{
+	}
+
+	void Parse( const string& stemedFile );
+	// Parse output of mystem, name is used in errors.
+	void Parse( istream& input, const string& name );
+
+	// Load tokens saved with the key, returns false (and no tokens)
+	// if there is no such file or it was saved with another key.
+	bool Load( const string& filename, const string& key );
+	void Save( const string& filename, const string& key ) const;
+	// Read tokens written by Write till the end of input, name is used in errors.
+	void Read( istream& input, const string& name );
+	void Write( ostream& output ) const;
+
+private:
+	static void restorePlainText( string& text );
+};
+
+bool CTokens::Load( const string& filename, const string& key )
+{
+	clear();
+	CDocumentInput inputFile( filename );
+	istream& input = inputFile.Stream();
+	if( !ReadCacheKey( input, key ) ) {
+		return false;
+	}
+	Read( input, filename );
+	return true;
+}
+
+void CTokens::Save( const string& filename, const string& key ) const
+{
+	CDocumentOutput outputFile( filename );
+	ostream& output = outputFile.Stream();
+	output << key << endl;
+	Write( output );
+	outputFile.Close();
+}
+
+void CTokens::Read( istream& input, const string& name )
+{
+	input >> ws;
+	while( input.good() ) {
+		CToken token;
+		input >> token.Begin >> token.End >> ws;
+		getline( input, token.Text, '\t' );
+		getline( input, token.Lexem );
+		if( input.fail() ) {
+			throw CException( "Bad tokens file `" + name + "` format." );
+		}
+		push_back( token );
+		input >> ws;
+	}
+}
+
+void CTokens::Write( ostream& output ) const
+{
+	for( const CToken& token : *this ) {
+		output << token.Begin << "\t" << token.End << "\t"
+			<< token.Text << "\t" << token.Lexem << endl;
+	}
+}
+
+void CTokens::restorePlainText( string& text )
+{
+	size_t from = 0;
+	size_t to = 0;
+	while( from < text.length() ) {
+		if( text[from] == '_' ) {
+			text[to] = ' ';
+		} else if( text[from] == '\\' ) {
+			from++;
+			if( text[from] == 'n' || text[from] == 'r' ) {
+				text[to] = '\n';
+			} else {
+				text[to] = text[from];
+			}
+		} else {
+			text[to] = text[from];
+		}
+		to++;
+		from++;
+	}
+	if( !text.empty() ) {
+		text.erase( to );
+	}
+}
+
+void CTokens::Parse( const string& filename )
+{
+	ifstream input( filename );
+	Parse( input, filename );
+}
+
+void CTokens::Parse( istream& input, const string& filename )
+{
+	clear();
+	const TTextEncoding encoding = TextEncoding;
+	// in characters
+	size_t offset = 0;
+	while( input.good() ) {
+		string line;
+		getline( input, line );
+		if( input.eof() ) {
+			break;
+		}
+		if( !line.empty() && line.back() == '\r' ) {
+			line.pop_back();
+		}
+
+		const size_t pos = line.find( '{' );
+		if( pos == string::npos ) {
+			restorePlainText( line );
+			// in bytes and in characters
+			size_t lineOffset = 0;
+			size_t lineLength = 0;
+			bool isAlphaOrDigit = false;
+			size_t charLength = 0;
+			auto nextChar = [&]() -> bool
+			{
+				if( lineOffset >= line.length() ) {
+					return false;
+				}
+				charLength = NormalizedCharLength( encoding, line, lineOffset, isAlphaOrDigit );
+				if( charLength == 0 ) {
+					throw CException( "Bad file `" + filename + "` encoding." );
+				}
+				return true;
+			};
+			while( nextChar() ) {
+				const char c = line[lineOffset];
+				if( isAlphaOrDigit ) {
+					const size_t beginPos = lineOffset;
+					const size_t beginLength = lineLength;
+					do {
+						lineOffset += charLength;
+						lineLength++;
+					} while( nextChar() && isAlphaOrDigit );
+					CToken token;
+					token.Text = line.substr( beginPos, lineOffset - beginPos );
+					token.Lexem = token.Text;
+					if( token.Lexem.find_first_not_of( "0123456789" ) == string::npos ) {
+						token.Lexem = "#";
+					}
+					token.Begin = offset + beginLength;
+					token.End = offset + lineLength;
+					push_back( token );
+				} else if( c == ' ' || c == '\n' ) {
+					lineOffset++;
+					lineLength++;
+				} else {
+					CToken token;
+					token.Text = line.substr( lineOffset, charLength );
+					token.Lexem = token.Text;
+					token.Begin = offset + lineLength;
+					lineOffset += charLength;
+					lineLength++;
+					token.End = offset + lineLength;
+					push_back( token );
+				}
+			}
+			offset += lineLength;
+		} else {
+			CToken token;
+			token.Text = line.substr( 0, pos );
+			const size_t startPos = pos + 1;
+			const size_t endPos = line.find_first_of( "?|}", startPos );
+			if( endPos == string::npos ) {
+				throw CException( "Bad file `" + filename + "` format." );
+			}
+			token.Lexem = line.substr( startPos, endPos - startPos );
+			token.Begin = offset;
+			offset += TextLength( token.Text, encoding );
+			token.End = offset;
+			push_back( token );
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+const char* InternalNamedEntityTypeText( TNamedEntityType type )
+{
+	switch( type ) {
+		case NET_Org:
+			return "$O";
+		case NET_Person:
+			return "$P";
+		case NET_Location:
+			return "$L";
+		default:
+			break;
+	}
+	throw logic_error( "InternalNamedEntityTypeText" );
+}
+
+void SetNamedEntitiyTokenTypes( const CNamedEntities& namedEntities, CTokens& tokens )
+{
+	CTokens tmp = move( tokens );
+
+	auto token = tmp.cbegin();
+	for( const CNamedEntity& entity : namedEntities ) {
+		if( token == tmp.cend() ) {
+			throw CException( "Objects does not matched with tokens." );
+		}
+
+		while( token != tmp.cend() && entity.HasNoIntersection( *token ) ) {
+			tokens.push_back( *token );
+			++token;
+		}
+		if( token != tmp.cend() ) {
+			tokens.push_back( *token );
+			tokens.back().Lexem = InternalNamedEntityTypeText( entity.Type );
+			for( ++token; token != tmp.cend() && !entity.HasNoIntersection( *token ); ++token ) {
+				tokens.back().Text += " " + token->Text;
+				tokens.back().End = token->End;
+			}
+		}
+	}
+	while( token != tmp.cend() ) {
+		tokens.push_back( *token );
+		++token;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Header of a lemma cache file (see CLemmaCache). It is followed by
+// uint64_t FormOffsets[FormsCount + 1] - offsets of sorted forms in Text,
+// uint64_t LemmaOffsets[FormsCount + 1] - offsets of their lemmas in Text,
+// char Text[TextSize] (in native byte order).
+struct CLemmaCacheHeader {
+	char Magic[8];
+	uint64_t Encoding;
+	uint64_t FormsCount;
+	uint64_t TextSize;
+};
+
+const char LemmaCacheMagic[8] = { 'O', 'C', 'C', 'L', 'E', 'M', 'M', '1' };
+
+// Persistent cache of lemmas of word forms learned from the output of mystem,
+// sentences which forms are all cached are tokenized without mystem.
+// The file is mapped into memory, forms learned by the run are merged into
+// it by Close. A form which has got different lemmas (mystem disambiguates
+// them by context) is ambiguous and is never found. A word joined to another
+// word by a hyphen, a digit or a punctuation mark is not looked up, because
+// mystem may analyze them together.
+class CLemmaCache {
+public:
+	CLemmaCache();
+
+	void Open( const string& filename );
+	bool IsOpen() const { return !filename.empty(); }
+	// Write the cache with learned forms and close it.
+	void Close();
+
+	// Output of mystem made of cached lemmas for the sentences of prepared
+	// text which forms are all cached, other sentences are blank in it.
+	// The rest text contains the other sentences separated by line feeds,
+	// a rest piece is the offset of a sentence in the rest text and
+	// its offset in the text (in characters). If wholeText all sentences are
+	// the rest text when any of them is not cached.
+	void Split( const string& text, bool wholeText, string& output,
+		string& restText, vector<pair<size_t, size_t>>& restPieces );
+	// Learn lemmas of forms from tokens of mystem output.
+	void Learn( const CTokens& tokens );
+
+	size_t FormsCount() const;
+	// Looked up and found words, documents and documents tokenized without mystem.
+	size_t Lookups() const { return lookups; }
+	size_t Hits() const { return hits; }
+	size_t Documents() const { return documents; }
+	size_t CachedDocuments() const { return cachedDocuments; }
+
+private:
+	string filename;
+	CMappedFile file;
+	CLemmaCacheHeader header;
+	const uint64_t* formOffsets;
+	const uint64_t* lemmaOffsets;
+	const char* text;
+	// learned forms, the lemma of ambiguous forms is empty
+	unordered_map<string, string> learned;
+	size_t lookups;
+	size_t hits;
+	size_t documents;
+	size_t cachedDocuments;
+
+	bool findLemma( const string& form, string& lemma ) const;
+	bool findInFile( const string& form, string& lemma ) const;
+	static bool isForm( const string& word );
+};
+
+CLemmaCache::CLemmaCache() :
+	formOffsets( nullptr ),
+	lemmaOffsets( nullptr ),
+	text( nullptr ),
+	lookups( 0 ),
+	hits( 0 ),
+	documents( 0 ),
+	cachedDocuments( 0 )
+{
+	header.FormsCount = 0;
+}
+
+void CLemmaCache::Open( const string& _filename )
+{
+	if( IsOpen() ) {
+		throw logic_error( "CLemmaCache::Open" );
+	}
+	filename = _filename;
+	header.FormsCount = 0;
+	if( !ifstream( filename ).good() ) {
+		return; // a new cache
+	}
+	if( !file.Open( filename ) ) {
+		throw CException( "Cannot map lemma cache `" + filename + "`." );
+	}
+	const string badFormat = "Bad lemma cache `" + filename + "` format.";
+	if( file.Size() < sizeof( header ) ) {
+		throw CException( badFormat );
+	}
+	copy( file.Data(), file.Data() + sizeof( header ), reinterpret_cast<char*>( &header ) );
+	const uint64_t expectedSize = sizeof( header )
+		+ ( header.FormsCount + 1 ) * 2 * sizeof( uint64_t ) + header.TextSize;
+	if( !equal( header.Magic, header.Magic + sizeof( header.Magic ), LemmaCacheMagic )
+		|| expectedSize != file.Size() )
+	{
+		throw CException( badFormat );
+	}
+	if( header.Encoding != static_cast<uint64_t>( TextEncoding ) ) {
+		throw CException( "Lemma cache `" + filename + "` is made"
+			" in another encoding, see --encoding." );
+	}
+	formOffsets = reinterpret_cast<const uint64_t*>( file.Data() + sizeof( header ) );
+	lemmaOffsets = formOffsets + header.FormsCount + 1;
+	text = reinterpret_cast<const char*>( lemmaOffsets + header.FormsCount + 1 );
+}
+
+void CLemmaCache::Close()
+{
+	if( !IsOpen() ) {
+		return;
+	}
+	if( !learned.empty() ) {
+		// merge sorted forms of the file and learned forms
+		vector<pair<string, string>> forms( learned.cbegin(), learned.cend() );
+		sort( forms.begin(), forms.end() );
+		vector<pair<string, string>> merged;
+		merged.reserve( static_cast<size_t>( header.FormsCount ) + forms.size() );
+		auto form = forms.cbegin();
+		for( size_t i = 0; i < header.FormsCount; i++ ) {
+			const size_t offset = static_cast<size_t>( formOffsets[i] );
+			string fileForm( text + offset, static_cast<size_t>( formOffsets[i + 1] ) - offset );
+			for( ; form != forms.cend() && form->first < fileForm; ++form ) {
+				merged.push_back( *form );
+			}
+			if( form != forms.cend() && form->first == fileForm ) {
+				merged.push_back( *form );
+				++form;
+			} else {
+				const size_t lemmaOffset = static_cast<size_t>( lemmaOffsets[i] );
+				merged.emplace_back( move( fileForm ), string( text + lemmaOffset,
+					static_cast<size_t>( lemmaOffsets[i + 1] ) - lemmaOffset ) );
+			}
+		}
+		merged.insert( merged.end(), form, forms.cend() );
+
+		CLemmaCacheHeader newHeader;
+		copy( LemmaCacheMagic, LemmaCacheMagic + sizeof( newHeader.Magic ), newHeader.Magic );
+		newHeader.Encoding = static_cast<uint64_t>( TextEncoding );
+		newHeader.FormsCount = merged.size();
+		newHeader.TextSize = 0;
+		vector<uint64_t> offsets;
+		offsets.reserve( ( merged.size() + 1 ) * 2 );
+		for( const pair<string, string>& entry : merged ) {
+			offsets.push_back( newHeader.TextSize );
+			newHeader.TextSize += entry.first.length();
+		}
+		offsets.push_back( newHeader.TextSize );
+		for( const pair<string, string>& entry : merged ) {
+			offsets.push_back( newHeader.TextSize );
+			newHeader.TextSize += entry.second.length();
+		}
+		offsets.push_back( newHeader.TextSize );
+
+		// the mapped file is replaced after the new one is written
+		const string tempFilename = filename + ".tmp";
+		{
+			ofstream output( tempFilename, ios::out | ios::binary );
+			WriteValue( output, newHeader );
+			output.write( reinterpret_cast<const char*>( offsets.data() ),
+				offsets.size() * sizeof( uint64_t ) );
+			for( const pair<string, string>& entry : merged ) {
+				output << entry.first;
+			}
+			for( const pair<string, string>& entry : merged ) {
+				output << entry.second;
+			}
+			if( !output.good() ) {
+				throw CException( "Cannot write lemma cache `" + tempFilename + "`." );
+			}
+		}
+		file.Close();
+		remove( filename.c_str() );
+		if( rename( tempFilename.c_str(), filename.c_str() ) != 0 ) {
+			throw CException( "Cannot write lemma cache `" + filename + "`." );
+		}
+		header.FormsCount = newHeader.FormsCount;
+	}
+	file.Close();
+	formOffsets = nullptr;
+	lemmaOffsets = nullptr;
+	text = nullptr;
+	learned.clear();
+	filename.clear();
+}
+
+size_t CLemmaCache::FormsCount() const
+{
+	size_t count = static_cast<size_t>( header.FormsCount );
+	for( const pair<const string, string>& entry : learned ) {
+		if( formOffsets == nullptr || FindCompiledWord( formOffsets, text,
+			static_cast<size_t>( header.FormsCount ), entry.first ) == header.FormsCount )
+		{
+			count++;
+		}
+	}
+	return count;
+}
+
+void CLemmaCache::Split( const string& preparedText, const bool wholeText, string& output,
+	string& restText, vector<pair<size_t, size_t>>& restPieces )
+{
+	const TTextEncoding encoding = TextEncoding;
+	output.clear();
+	restText.clear();
+	restPieces.clear();
+	documents++;
+
+	// bytes of non ASCII characters of prepared text are bytes of letters
+	auto isWordByte = [&preparedText]( const size_t offset ) -> bool
+	{
+		return ( offset < preparedText.length()
+			&& ( IsCharAlphaOrDigit( preparedText[offset] )
+				|| static_cast<unsigned char>( preparedText[offset] ) >= 0x80 ) );
+	};
+	// whether the neighbour of a word before or after it
+	// does not join the word to another word
+	static const string punctuation = "!(),.:;?";
+	auto isSeparator = [&]( const size_t offset, const bool before ) -> bool
+	{
+		if( offset >= preparedText.length() ) {
+			return true;
+		}
+		const char c = preparedText[offset];
+		if( c == ' ' || c == '\n' ) {
+			return true;
+		}
+		if( punctuation.find( c ) == string::npos ) {
+			return false;
+		}
+		return before ? ( offset == 0 || !isWordByte( offset - 1 ) ) : !isWordByte( offset + 1 );
+	};
+
+	string sentenceOutput;
+	string form;
+	string lemma;
+	size_t offset = 0;
+	size_t length = 0; // in characters
+	size_t restLength = 0; // in characters
+	bool allCached = true;
+	while( offset < preparedText.length() ) {
+		const size_t sentenceBegin = offset;
+		const size_t sentenceLength = length;
+		const size_t sentenceEnd = SentenceEnd( preparedText, offset );
+
+		bool cached = true;
+		sentenceOutput.clear();
+		while( offset < sentenceEnd ) {
+			bool isAlphaOrDigit = false;
+			size_t charLength = NormalizedCharLength( encoding, preparedText, offset,
+				isAlphaOrDigit );
+			if( charLength == 0 ) {
+				throw CException( "Prepared text is not valid." );
+			}
+			if( !isAlphaOrDigit ) {
+				const char c = preparedText[offset];
+				if( c == ' ' ) {
+					sentenceOutput += '_';
+				} else if( c == '\n' ) {
+					sentenceOutput += "\\n";
+				} else {
+					sentenceOutput.append( preparedText, offset, charLength );
+				}
+				offset += charLength;
+				length++;
+				continue;
+			}
+
+			const size_t wordBegin = offset;
+			do {
+				offset += charLength;
+				length++;
+			} while( offset < preparedText.length()
+				&& ( charLength = NormalizedCharLength( encoding, preparedText, offset,
+					isAlphaOrDigit ) ) > 0 && isAlphaOrDigit );
+			form.assign( preparedText, wordBegin, offset - wordBegin );
+			if( form.find_first_not_of( "0123456789" ) == string::npos ) {
+				// numbers are not analyzed by mystem
+				sentenceOutput += '\n' + form + '\n';
+				continue;
+			}
+			lookups++;
+			const bool separated = ( wordBegin == 0 || isSeparator( wordBegin - 1, true ) )
+				&& isSeparator( offset, false );
+			if( separated && isForm( form ) && findLemma( form, lemma ) ) {
+				hits++;
+				sentenceOutput += '\n' + form + '{' + lemma + "}\n";
+			} else {
+				cached = false;
+			}
+		}
+
+		allCached = allCached && cached;
+		if( cached ) {
+			output += sentenceOutput;
+		} else {
+			output.append( length - sentenceLength, '_' );
+			restPieces.emplace_back( restLength, sentenceLength );
+			restText.append( preparedText, sentenceBegin, sentenceEnd - sentenceBegin );
+			restText += '\n';
+			restLength += length - sentenceLength + 1;
+		}
+	}
+	output += '\n';
+
+	if( allCached ) {
+		cachedDocuments++;
+	} else if( wholeText ) {
+		output.assign( length, '_' );
+		output += '\n';
+		restText = preparedText;
+		restPieces.assign( 1, make_pair( 0, 0 ) );
+	}
+}
+
+void CLemmaCache::Learn( const CTokens& tokens )
+{
+	string lemma;
+	for( const CToken& token : tokens ) {
+		if( token.Lexem.empty() || !isForm( token.Text ) ) {
+			continue;
+		}
+		auto entry = learned.find( token.Text );
+		if( entry != learned.end() ) {
+			if( entry->second != token.Lexem ) {
+				entry->second.clear();
+			}
+		} else if( findInFile( token.Text, lemma ) ) {
+			if( lemma != token.Lexem && !lemma.empty() ) {
+				learned[token.Text] = "";
+			}
+		} else {
+			learned[token.Text] = token.Lexem;
+		}
+	}
+}
+
+bool CLemmaCache::findLemma( const string& form, string& lemma ) const
+{
+	auto entry = learned.find( form );
+	if( entry != learned.cend() ) {
+		lemma = entry->second;
+	} else if( !findInFile( form, lemma ) ) {
+		return false;
+	}
+	return !lemma.empty();
+}
+
+// Whether the form is in the file, the lemma of an ambiguous form is empty.
+bool CLemmaCache::findInFile( const string& form, string& lemma ) const
+{
+	if( formOffsets == nullptr ) {
+		return false;
+	}
+	const size_t formsCount = static_cast<size_t>( header.FormsCount );
+	const size_t index = FindCompiledWord( formOffsets, text, formsCount, form );
+	if( index == formsCount ) {
+		return false;
+	}
+	const size_t offset = static_cast<size_t>( lemmaOffsets[index] );
+	lemma.assign( text + offset, static_cast<size_t>( lemmaOffsets[index + 1] ) - offset );
+	return true;
+}
+
+// Letters of one alphabet, lower case Cyrillic letters are not ASCII.
+bool CLemmaCache::isForm( const string& word )
+{
+	bool ascii = false;
+	bool nonAscii = false;
+	for( const char c : word ) {
+		if( static_cast<unsigned char>( c ) >= 0x80 ) {
+			nonAscii = true;
+		} else if( IsCharAlphaOrDigit( c ) && !isdigit( static_cast<unsigned char>( c ) ) ) {
+			ascii = true;
+		} else {
 			return false;
 		}
-		offset = entity.End;
 	}
-	return true;
+	return ( ascii != nonAscii );
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Timeline of processing in Chrome trace event format (JSON array of events),
+// which is opened by chrome://tracing or Perfetto. Begin and end events
+// of the same thread must be nested. Events are written at once, so
+// the trace of an interrupted run is readable too. Tracing is off until Open.
+class CTrace {
+public:
+	// Microseconds since the start of the program.
+	typedef double TTime;
+
+	CTrace();
+	~CTrace();
+
+	void Open( const string& filename );
+	bool IsOpen() const { return isOpen; }
+	void Close();
+
+	TTime Now() const;
+	// Events of the current thread, begin is Now() by default.
+	void Begin( const string& name, const char* category, TTime time = -1 );
+	void End( const string& name, const char* category );
+
+private:
+	bool isOpen;
+	bool hasEvents;
+	ofstream output;
+	const chrono::steady_clock::time_point start;
+	mutex outputMutex;
+	unordered_map<thread::id, size_t> threadIds;
+
+	void write( char phase, const string& name, const char* category, TTime time );
+};
+
+CTrace::CTrace() :
+	isOpen( false ),
+	hasEvents( false ),
+	start( chrono::steady_clock::now() )
+{
+}
+
+CTrace::~CTrace()
+{
+	Close();
+}
+
+void CTrace::Open( const string& filename )
+{
+	output.open( filename, ios::out | ios::binary );
+	if( !output.good() ) {
+		throw CException( "Cannot write trace `" + filename + "`." );
+	}
+	output << fixed << setprecision( 1 ) << "[";
+	isOpen = true;
+}
+
+void CTrace::Close()
+{
+	if( isOpen ) {
+		output << "\n]\n";
+		output.close();
+		isOpen = false;
+	}
+}
+
+CTrace::TTime CTrace::Now() const
+{
+	return chrono::duration<double, micro>( chrono::steady_clock::now() - start ).count();
+}
+
+void CTrace::Begin( const string& name, const char* category, TTime time )
+{
+	if( isOpen ) {
+		write( 'B', name, category, time < 0 ? Now() : time );
+	}
+}
+
+void CTrace::End( const string& name, const char* category )
+{
+	if( isOpen ) {
+		write( 'E', name, category, Now() );
+	}
+}
+
+void CTrace::write( char phase, const string& name, const char* category, TTime time )
+{
+	lock_guard<mutex> lock( outputMutex );
+	auto threadId = threadIds.insert( make_pair( this_thread::get_id(), threadIds.size() + 1 ) );
+	if( threadId.second ) {
+		output << ( hasEvents ? "," : "" ) << "\n{ \"ph\": \"M\", \"name\": \"thread_name\", \"pid\": 1, \"tid\": "
+			<< threadId.first->second << ", \"args\": { \"name\": \""
+			<< ( threadId.first->second == 1 ? "main" : "worker" ) << "\" } }";
+		hasEvents = true;
+	}
+	output << ",\n{ \"ph\": \"" << phase << "\", \"name\": \"";
+	for( const char c : name ) {
+		if( c == '"' || c == '\\' ) {
+			output << '\\' << c;
+		} else if( static_cast<unsigned char>( c ) >= 32 ) {
+			output << c;
+		}
+	}
+	output << "\", \"cat\": \"" << category << "\", \"pid\": 1, \"tid\": "
+		<< threadId.first->second << ", \"ts\": " << time << " }";
+}
+
+CTrace Trace;
+
+// Begin and end events of a scope.
+class CTraceScope {
+public:
+	CTraceScope( const string& _name, const char* _category ) :
+		name( _name ),
+		category( _category )
+	{
+		Trace.Begin( name, category );
+	}
+	~CTraceScope()
+	{
+		Trace.End( name, category );
+	}
+
+private:
+	const string name;
+	const char* const category;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Minimal number of tokens in a partition processed by a separate thread.
+const size_t MinPartitionSize = 1 << 14;
+
+// Call process( part ) for each part in [0, partsCount), each in a separate thread.
+// The trace shows each part, the wait of a thread to start and the wait
+// of the calling thread for the others.
+template<typename TProcess>
+void ProcessInParallel( const string& name, const size_t partsCount, const TProcess& process )
+{
+	const CTrace::TTime started = Trace.Now();
+	vector<exception_ptr> errors( partsCount );
+	auto processPart = [&]( const size_t part )
+	{
+		if( part > 0 ) {
+			Trace.Begin( "thread start", "wait", started );
+			Trace.End( "thread start", "wait" );
+		}
+		try {
+			CTraceScope scope( name + " " + to_string( part ), "parallel" );
+			process( part );
+		} catch( ... ) {
+			errors[part] = current_exception();
+		}
+	};
+
+	vector<thread> threads;
+	for( size_t part = 1; part < partsCount; part++ ) {
+		threads.emplace_back( processPart, part );
+	}
+	if( partsCount > 0 ) {
+		processPart( 0 );
+	}
+	{
+		CTraceScope scope( "join", "wait" );
+		for( thread& partThread : threads ) {
+			partThread.join();
+		}
+	}
+
+	for( const exception_ptr& error : errors ) {
+		if( error ) {
+			rethrow_exception( error );
+		}
+	}
+}
+
+// Lexem of tokens substituted by a match of the dictionary.
+string DictionaryLexem( size_t dictionary )
+{
+	return "@" + to_string( dictionary );
+}
+
+// Finds matches of several dictionaries in token lexems in one pass.
+// Matches of each dictionaries are exactly the same as a single CFinder finds.
+// Each token lexem is looked up once to get its flags for all dictionaries.
+// Segments of tokens between words absent in the dictionaries, which have
+// no word starting a line or miss a required anchor (e.g. $P for templates),
+// cannot contain a match and are skipped. Tokens which cannot start a line
+// are skipped while CFinder is empty.
+// Optionally matches of substitution dictionaries are replaced by @N lexems
+// before the other dictionaries are matched. Both levels are matched in
+// the same pass: each token (or a whole match) which becomes final in
+// the substitution CFinder is pushed to CFinders of the other dictionaries.
+// The tokens are split into partitions which are processed in parallel.
+// Each partition (except the last) ends with a token which lexem is absent
+// in all dictionaries. CFinder always has an empty state after such token,
+// so the matches of partitions just concatenate into the serial result.
+class CMatcher {
+public:
+	CMatcher();
+
+	// Counters of one Find.
+	struct CCounters {
+		size_t SubstitutionMatches;
+		size_t Matches;
+		CFinder::CCounters SubstitutionFinder;
+		CFinder::CCounters Finders;
+		// lookups of prefixes of each dictionaries (only if profiling)
+		vector<CFinder::CPrefixLookups> Lookups;
+
+		CCounters() :
+			SubstitutionMatches( 0 ),
+			Matches( 0 )
+		{
+		}
+
+		CCounters& operator+=( const CCounters& other )
+		{
+			SubstitutionMatches += other.SubstitutionMatches;
+			Matches += other.Matches;
+			SubstitutionFinder += other.SubstitutionFinder;
+			Finders += other.Finders;
+			Lookups.resize( max( Lookups.size(), other.Lookups.size() ) );
+			for( size_t i = 0; i < other.Lookups.size(); i++ ) {
+				for( const pair<const CDictionaries::CWords, CFinder::CLookups>& prefix
+					: other.Lookups[i] )
+				{
+					CFinder::CLookups& lookups = Lookups[i][prefix.first];
+					lookups.Found += prefix.second.Found;
+					lookups.Missed += prefix.second.Missed;
+				}
+			}
+			return *this;
+		}
+	};
+
+	size_t Size() const { return parts.size(); }
+	// Collect lookups of prefixes of the dictionaries (but not substitutions).
+	void SetProfiling( bool _profiling ) { profiling = _profiling; }
+	void Add( const CDictionaries& dictionaries );
+	void SetSubstitutions( const CDictionaries& dictionaries );
+	bool HasSubstitutions() const;
+	// Matches are found in substituted tokens, substitutedTokens[i] is index of
+	// the first token of the i-th substituted token and the last element is
+	// tokens.size(). Without substitutions substitutedTokens is empty.
+	// Matches of substitutions in tokens are added to substitutionMatches.
+	void Find( const CTokens& tokens, const size_t threadsCount,
+		vector<CFinder::CMatches>& matches, vector<size_t>& substitutedTokens,
+		CCounters* counters = nullptr,
+		CFinder::CMatches* substitutionMatches = nullptr ) const;
+	// The same as Find, but substitutions are the known substitutionMatches,
+	// so only the other dictionaries are matched.
+	void FindSubstituted( const CTokens& tokens,
+		const CFinder::CMatches& substitutionMatches, const size_t threadsCount,
+		vector<CFinder::CMatches>& matches, vector<size_t>& substitutedTokens,
+		CCounters* counters = nullptr ) const;
+	// The last partition bound in [begin, end] of tokens, which is after
+	// a token absent in all dictionaries (begin if there is no such token).
+	// Matches before the bound are not changed by the tokens after it.
+	size_t FinalBound( const CTokens& tokens, size_t begin, size_t end ) const;
+
+private:
+	struct CPart {
+		const CDictionaries* Dictionaries;
+		size_t Shift;
+		size_t Mask;
+		size_t RequiredFlags;
+
+		CPart() :
+			Dictionaries( nullptr ),
+			Shift( 0 ),
+			Mask( 0 ),
+			RequiredFlags( 0 )
+		{
+		}
+
+		size_t Flags( size_t flags ) const { return ( ( flags >> Shift ) & Mask ); }
+	};
+	vector<CPart> parts;
+	CPart substitutions;
+	// lexems @N of substitutions with their flags
+	vector<pair<string, size_t>> substitutionLexems;
+	size_t usedBits;
+	// flags of all in-memory dictionaries, used only if there is more than one
+	unordered_map<string, size_t> wordFlags;
+	// parts which flags are looked up in their dictionaries
+	vector<const CPart*> separateParts;
+	bool profiling;
+
+	size_t flags( const string& word ) const;
+	void find( const CTokens& tokens, const size_t threadsCount, const bool substitute,
+		vector<CFinder::CMatches>& matches, vector<size_t>& substitutedTokens,
+		CCounters* counters, CFinder::CMatches* substitutionMatches ) const;
+	void addPart( CPart& part, const CDictionaries& dictionaries );
+	void addWordFlags( const CPart& part );
+	void findInPartition( const CTokens& tokens, const vector<size_t>& tokenFlags,
+		const CPart& part, size_t begin, size_t end, CFinder::CMatches& matches,
+		CCounters& counters ) const;
+	void findInPartitionWithSubstitutions( const CTokens& tokens,
+		const vector<size_t>& tokenFlags, const vector<const CPart*>& activeParts,
+		size_t begin, size_t end, vector<CFinder::CMatches>& matches,
+		vector<size_t>& substitutedTokens, CFinder::CMatches& substitutionMatches,
+		CCounters& counters ) const;
+};
+
+CMatcher::CMatcher() :
+	usedBits( 0 ),
+	profiling( false )
+{
+}
+
+void CMatcher::Add( const CDictionaries& dictionaries )
+{
+	parts.emplace_back();
+	addPart( parts.back(), dictionaries );
+}
+
+void CMatcher::SetSubstitutions( const CDictionaries& dictionaries )
+{
+	if( substitutions.Dictionaries != nullptr ) {
+		throw logic_error( "CMatcher::SetSubstitutions" );
+	}
+	addPart( substitutions, dictionaries );
+}
+
+size_t CMatcher::flags( const string& word ) const
+{
+	size_t flags = 0;
+	if( !wordFlags.empty() ) {
+		auto combinedFlags = wordFlags.find( word );
+		if( combinedFlags != wordFlags.end() ) {
+			flags = combinedFlags->second;
+		}
+	}
+	for( const CPart* part : separateParts ) {
+		flags |= part->Dictionaries->WordFlags( word ) << part->Shift;
+	}
+	return flags;
+}
+
+void CMatcher::addPart( CPart& part, const CDictionaries& dictionaries )
+{
+	const size_t maxBits = numeric_limits<size_t>::digits;
+	const size_t bits = 2 + dictionaries.anchorGroupLinesCounts.size();
+	if( usedBits + bits > maxBits ) {
+		throw CException( "Too many dictionaries to match in one pass." );
+	}
+	part.Dictionaries = &dictionaries;
+	part.Shift = usedBits;
+	part.Mask = ( bits < maxBits ) ? ( size_t( 1 ) << bits ) - 1 : numeric_limits<size_t>::max();
+	part.RequiredFlags = dictionaries.RequiredFlags();
+	usedBits += bits;
+
+	// compiled dictionaries are never loaded into the combined map
+	vector<const CPart*> allParts;
+	for( const CPart& oneOfParts : parts ) {
+		allParts.push_back( &oneOfParts );
+	}
+	if( substitutions.Dictionaries != nullptr ) {
+		allParts.push_back( &substitutions );
+	}
+	vector<const CPart*> combinedParts;
+	separateParts.clear();
+	for( const CPart* oneOfParts : allParts ) {
+		if( oneOfParts->Dictionaries->IsMapped() ) {
+			separateParts.push_back( oneOfParts );
+		} else {
+			combinedParts.push_back( oneOfParts );
+		}
+	}
+	wordFlags.clear();
+	if( combinedParts.size() == 1 ) {
+		separateParts.push_back( combinedParts.front() );
+	} else {
+		for( const CPart* oneOfParts : combinedParts ) {
+			addWordFlags( *oneOfParts );
+		}
+	}
+
+	substitutionLexems.clear();
+	if( substitutions.Dictionaries != nullptr ) {
+		for( size_t i = 1; i <= substitutions.Dictionaries->maxDictionaryIndex; i++ ) {
+			const string lexem = DictionaryLexem( i );
+			substitutionLexems.emplace_back( lexem, flags( lexem ) );
+		}
+	}
+}
+
+void CMatcher::addWordFlags( const CPart& part )
+{
+	for( const pair<const string, size_t>& word : part.Dictionaries->wordFlags ) {
+		wordFlags[word.first] |= word.second << part.Shift;
+	}
+}
+
+bool CMatcher::HasSubstitutions() const
+{
+	return ( substitutions.Dictionaries != nullptr && !substitutions.Dictionaries->IsEmpty() );
+}
+
+void CMatcher::Find( const CTokens& tokens, const size_t threadsCount,
+	vector<CFinder::CMatches>& matches, vector<size_t>& substitutedTokens,
+	CCounters* counters, CFinder::CMatches* substitutionMatches ) const
+{
+	find( tokens, threadsCount, HasSubstitutions(), matches, substitutedTokens,
+		counters, substitutionMatches );
+}
+
+size_t CMatcher::FinalBound( const CTokens& tokens, size_t begin, size_t end ) const
+{
+	for( ; end > begin; end-- ) {
+		if( flags( tokens[end - 1].Lexem ) == 0 ) {
+			return end;
+		}
+	}
+	return begin;
+}
+
+void CMatcher::FindSubstituted( const CTokens& tokens,
+	const CFinder::CMatches& substitutionMatches, const size_t threadsCount,
+	vector<CFinder::CMatches>& matches, vector<size_t>& substitutedTokens,
+	CCounters* counters ) const
+{
+	// only lexems of substituted tokens are matched
+	CTokens substituted;
+	substitutedTokens.clear();
+	auto match = substitutionMatches.cbegin();
+	for( size_t i = 0; i < tokens.size(); i++ ) {
+		substitutedTokens.push_back( i );
+		substituted.emplace_back();
+		if( match != substitutionMatches.cend() && match->Begin == i ) {
+			if( match->End <= i || match->End > tokens.size() || match->Dictionary == 0
+				|| match->Dictionary > substitutionLexems.size() )
+			{
+				throw logic_error( "CMatcher::FindSubstituted" );
+			}
+			substituted.back().Lexem = substitutionLexems[match->Dictionary - 1].first;
+			i = match->End - 1;
+			++match;
+		} else {
+			substituted.back().Lexem = tokens[i].Lexem;
+		}
+	}
+	if( match != substitutionMatches.cend() ) {
+		throw logic_error( "CMatcher::FindSubstituted" );
+	}
+	substitutedTokens.push_back( tokens.size() );
+
+	vector<size_t> noSubstitutedTokens;
+	find( substituted, threadsCount, false, matches, noSubstitutedTokens, counters, nullptr );
+	if( counters != nullptr ) {
+		counters->SubstitutionMatches += substitutionMatches.size();
+	}
+}
+
+void CMatcher::find( const CTokens& tokens, const size_t threadsCount, const bool substitute,
+	vector<CFinder::CMatches>& matches, vector<size_t>& substitutedTokens,
+	CCounters* counters, CFinder::CMatches* substitutionMatches ) const
+{
+	matches.assign( parts.size(), CFinder::CMatches() );
+	substitutedTokens.clear();
+
+	const size_t partitionSize = max( MinPartitionSize,
+		tokens.size() / max<size_t>( threadsCount, 1 ) + 1 );
+	const size_t chunksCount = ( tokens.size() + partitionSize - 1 ) / partitionSize;
+
+	vector<size_t> tokenFlags( tokens.size() );
+	vector<size_t> chunkFlags( chunksCount, 0 );
+	ProcessInParallel( "flags", chunksCount, [&]( const size_t chunk )
+	{
+		const size_t end = min( tokens.size(), ( chunk + 1 ) * partitionSize );
+		for( size_t i = chunk * partitionSize; i < end; i++ ) {
+			tokenFlags[i] = flags( tokens[i].Lexem );
+			chunkFlags[chunk] |= tokenFlags[i];
+		}
+	} );
+
+	size_t documentFlags = 0;
+	for( const size_t oneChunkFlags : chunkFlags ) {
+		documentFlags |= oneChunkFlags;
+	}
+	if( substitute ) {
+		for( const pair<string, size_t>& lexem : substitutionLexems ) {
+			documentFlags |= lexem.second;
+		}
+	}
+	vector<const CPart*> activeParts;
+	for( const CPart& part : parts ) {
+		if( ( part.Flags( documentFlags ) & part.RequiredFlags ) == part.RequiredFlags ) {
+			activeParts.push_back( &part );
+		}
+	}
+	// substitutions are still matched if their matches are requested
+	if( activeParts.empty() && ( !substitute || substitutionMatches == nullptr ) ) {
+		return;
+	}
+
+	vector<size_t> bounds( 1, 0 );
+	size_t bound = partitionSize;
+	while( bound < tokens.size() ) {
+		while( bound < tokens.size() && tokenFlags[bound - 1] != 0 ) {
+			bound++;
+		}
+		if( bound < tokens.size() ) {
+			bounds.push_back( bound );
+		}
+		bound += partitionSize;
+	}
+	bounds.push_back( tokens.size() );
+
+	const size_t partitionsCount = bounds.size() - 1;
+	vector<vector<CFinder::CMatches>> partitionMatches( partitionsCount );
+	vector<vector<size_t>> partitionSubstitutedTokens( partitionsCount );
+	vector<CFinder::CMatches> partitionSubstitutionMatches( partitionsCount );
+	vector<CCounters> partitionCounters( partitionsCount );
+	ProcessInParallel( "partition", partitionsCount, [&]( const size_t partition )
+	{
+		const size_t begin = bounds[partition];
+		const size_t end = bounds[partition + 1];
+		partitionMatches[partition].resize( parts.size() );
+		if( profiling ) {
+			partitionCounters[partition].Lookups.resize( parts.size() );
+		}
+		if( substitute ) {
+			findInPartitionWithSubstitutions( tokens, tokenFlags, activeParts, begin, end,
+				partitionMatches[partition], partitionSubstitutedTokens[partition],
+				partitionSubstitutionMatches[partition], partitionCounters[partition] );
+		} else {
+			for( const CPart* part : activeParts ) {
+				findInPartition( tokens, tokenFlags, *part, begin, end,
+					partitionMatches[partition][part - parts.data()],
+					partitionCounters[partition] );
+			}
+		}
+	} );
+
+	// merge
+	for( size_t partition = 0; partition < partitionsCount; partition++ ) {
+		const size_t offset = substitute ? substitutedTokens.size() : bounds[partition];
+		for( size_t part = 0; part < parts.size(); part++ ) {
+			for( const CFinder::CMatch& match : partitionMatches[partition][part] ) {
+				matches[part].emplace_back( offset + match.Begin,
+					offset + match.End, match.Dictionary );
+			}
+		}
+		substitutedTokens.insert( substitutedTokens.end(),
+			partitionSubstitutedTokens[partition].cbegin(),
+			partitionSubstitutedTokens[partition].cend() );
+		if( substitutionMatches != nullptr ) {
+			for( const CFinder::CMatch& match : partitionSubstitutionMatches[partition] ) {
+				substitutionMatches->emplace_back( bounds[partition] + match.Begin,
+					bounds[partition] + match.End, match.Dictionary );
+			}
+		}
+		if( counters != nullptr ) {
+			*counters += partitionCounters[partition];
+		}
+	}
+	if( substitute ) {
+		substitutedTokens.push_back( tokens.size() );
+	}
+}
+
+void CMatcher::findInPartition( const CTokens& tokens, const vector<size_t>& tokenFlags,
+	const CPart& part, size_t begin, size_t end, CFinder::CMatches& matches,
+	CCounters& counters ) const
+{
+	CFinder finder( *part.Dictionaries );
+	if( profiling ) {
+		finder.CollectLookups( &counters.Lookups[&part - parts.data()] );
+	}
+	size_t i = begin;
+	while( i < end ) {
+		size_t segmentEnd = i;
+		while( segmentEnd < end && part.Flags( tokenFlags[segmentEnd] ) == 0 ) {
+			segmentEnd++;
+		}
+		finder.Skip( segmentEnd - i );
+		i = segmentEnd;
+
+		size_t segmentFlags = 0;
+		for( ; segmentEnd < end && part.Flags( tokenFlags[segmentEnd] ) != 0; segmentEnd++ ) {
+			segmentFlags |= part.Flags( tokenFlags[segmentEnd] );
+		}
+		if( ( segmentFlags & part.RequiredFlags ) != part.RequiredFlags ) {
+			finder.Skip( segmentEnd - i );
+			i = segmentEnd;
+		}
+		for( ; i < segmentEnd; i++ ) {
+			if( finder.IsEmpty()
+				&& ( part.Flags( tokenFlags[i] ) & CDictionaries::WF_First ) == 0 )
+			{
+				finder.Skip();
+			} else {
+				finder.Push( tokens[i].Lexem );
+			}
+		}
+	}
+	finder.Finish();
+	matches = finder.Matches();
+	counters.Matches += matches.size();
+	counters.Finders += finder.Counters();
+}
+
+void CMatcher::findInPartitionWithSubstitutions( const CTokens& tokens,
+	const vector<size_t>& tokenFlags, const vector<const CPart*>& activeParts,
+	size_t begin, size_t end, vector<CFinder::CMatches>& matches,
+	vector<size_t>& substitutedTokens, CFinder::CMatches& substitutionMatches,
+	CCounters& counters ) const
+{
+	// push word to finder unless it cannot change its matches
+	auto push = []( CFinder& finder, const string& word, const size_t wordFlags )
+	{
+		if( wordFlags == 0
+			|| ( finder.IsEmpty() && ( wordFlags & CDictionaries::WF_First ) == 0 ) )
+		{
+			finder.Skip();
+		} else {
+			finder.Push( word );
+		}
+	};
+
+	CFinder substitutionFinder( *substitutions.Dictionaries );
+	vector<CFinder> finders;
+	for( const CPart* part : activeParts ) {
+		finders.emplace_back( *part->Dictionaries );
+		if( profiling ) {
+			finders.back().CollectLookups( &counters.Lookups[part - parts.data()] );
+		}
+	}
+
+	size_t nextToken = begin;
+	size_t nextMatch = 0;
+	// push tokens which are final in substitution finder to other finders
+	auto pushSubstitutedTokens = [&]( const size_t finalTokensEnd )
+	{
+		const CFinder::CMatches& substitutionMatches = substitutionFinder.Matches();
+		while( nextToken < finalTokensEnd ) {
+			substitutedTokens.push_back( nextToken );
+			const string* lexem = &tokens[nextToken].Lexem;
+			size_t lexemFlags = tokenFlags[nextToken];
+			if( nextMatch < substitutionMatches.size()
+				&& begin + substitutionMatches[nextMatch].Begin == nextToken )
+			{
+				const CFinder::CMatch& match = substitutionMatches[nextMatch];
+				lexem = &substitutionLexems[match.Dictionary - 1].first;
+				lexemFlags = substitutionLexems[match.Dictionary - 1].second;
+				nextToken = begin + match.End;
+				nextMatch++;
+			} else {
+				nextToken++;
+			}
+			for( size_t i = 0; i < activeParts.size(); i++ ) {
+				push( finders[i], *lexem, activeParts[i]->Flags( lexemFlags ) );
+			}
+		}
+	};
+
+	for( size_t i = begin; i < end; i++ ) {
+		push( substitutionFinder, tokens[i].Lexem, substitutions.Flags( tokenFlags[i] ) );
+		pushSubstitutedTokens( begin + substitutionFinder.FinalWordsCount() );
+	}
+	substitutionFinder.Finish();
+	pushSubstitutedTokens( end );
+
+	for( size_t i = 0; i < activeParts.size(); i++ ) {
+		finders[i].Finish();
+		matches[activeParts[i] - parts.data()] = finders[i].Matches();
+		counters.Matches += finders[i].Matches().size();
+		counters.Finders += finders[i].Counters();
+	}
+	substitutionMatches = substitutionFinder.Matches();
+	counters.SubstitutionMatches += substitutionFinder.Matches().size();
+	counters.SubstitutionFinder += substitutionFinder.Counters();
+}
+
+void FindMatches( const CDictionaries& dictionaries, const CTokens& tokens,
+	const size_t threadsCount, CFinder::CMatches& matches )
+{
+	CMatcher matcher;
+	matcher.Add( dictionaries );
+	vector<CFinder::CMatches> allMatches;
+	vector<size_t> substitutedTokens;
+	matcher.Find( tokens, threadsCount, allMatches, substitutedTokens );
+	matches = move( allMatches.front() );
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+vector<string> MakeAllVariants( const string& text )
+{
+	vector<string> variants;
+	const size_t beginPos = text.find( '[' );
+	if( beginPos == string::npos ) {
+		variants.push_back( text );
+		return variants;
+	}
+
+	const size_t endPos = text.find_first_of( ']', beginPos );
+	if( endPos == string::npos ) {
+		return vector<string>(); // error
+	}
+
+	const string prefix = text.substr( 0, beginPos );
+	const string middle = text.substr( beginPos + 1, endPos - ( beginPos + 1 ) );
+	const string suffix = text.substr( endPos + 1 );
+
+	vector<string> middles = SplitString( middle, "|", true /* preserveEmptyStrings */ );
+	if( middles.size() == 1 ) {
+		middles.push_back( "" );
+	}
+	vector<string> suffixes = MakeAllVariants( suffix );
+
+	for( const string& suf : suffixes ) {
+		for( const string& mid : middles ) {
+			variants.push_back( prefix + mid + suf );
+		}
+	}
+	return variants;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+class CUtf8TextFile {
+public:
+	explicit CUtf8TextFile( const string& filename );
+
+	// Number of characters.
+	size_t Length() const { return chars.size(); }
+	string Text( CInterval interval ) const;
+
+private:
+	typedef array<char, 4> CChar;
+	vector<CChar> chars;
+};
+
+CUtf8TextFile::CUtf8TextFile( const string& filename )
+{
+	CDocumentInput inputFile( filename );
+	istream& input = inputFile.Stream();
+	if( !input.good() ) {
+		throw CException( "File `" + filename + "` not found." );
+	}
+
+	do {
+		string line;
+		getline( input, line );
+		if( !line.empty() && line.back() == '\r' ) {
+			line.pop_back();
+		}
+
+		size_t index = 0;
+		for( char c : line ) {
+			const unsigned char uc = static_cast<unsigned char>( c );
+			if( uc >= 128 && uc < 192 ) {
+				chars.back()[++index] = c;
+			} else {
+				index = 0;
+				chars.push_back( { c, '\0', '\0', '\0' } );
+			}
+		}
+		chars.push_back( { '\n', '\0', '\0', '\0' } );
+	} while( input.good() );
+}
+
+string CUtf8TextFile::Text( CInterval interval ) const
+{
+	if( !interval.Defined() ) {
+		throw logic_error( "CUtf8TextFile::Text() undefined interval" );
+	}
+	string text;
+	for( size_t i = interval.Begin; i < interval.End; i++ ) {
+		text.push_back( chars[i][0] );
+		for( size_t j = 1; j < chars[i].size() && chars[i][j] != '\0'; j++ ) {
+			text.push_back( chars[i][j] );
+		}
+	}
+	return text;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+struct COccupation {
+	CInterval Who;
+	CInterval Where;
+	CInterval Job;
+	size_t Variant; // index of the variant of templates, 0 if unknown
+
+	COccupation() :
+		Variant( 0 )
+	{
+	}
+
+	bool Check() const
+	{
+		return Who.Defined() && Where.Defined();
+	}
+	void Write( ostream& output, const CUtf8TextFile& textFle ) const
+	{
+		if( !Check() ) {
+			throw logic_error( "bad occupation" );
+		}
+		output << "Occupation\n";
+		output << "who:" << textFle.Text( Who ) << "\n";
+		if( Where.Defined() ) {
+			output << "where:" << textFle.Text( Where ) << "\n";
+		}
+		if( Job.Defined() ) {
+			output << "job:" << textFle.Text( Job ) << "\n";
+		}
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+class CVariantDefs {
+public:
+	CVariantDefs();
+
+	size_t AddVariant( string& variant );
+	template<typename TTokenIterator>
+	COccupation Occupation( const size_t variantIndex,
+		TTokenIterator firstMatchedToken ) const;
+
+private:
+	vector<COccupation> variants;
+
+	bool addToken( string& token, CInterval interval );
+	bool addInterval( CInterval& dest, CInterval newInterval ) const;
+};
+
+CVariantDefs::CVariantDefs()
+{
+}
+
+bool CVariantDefs::addInterval( CInterval& dest, CInterval interval ) const
+{
+	if( !dest.Defined() ) {
+		dest = interval;
+	} else if( dest.End == interval.Begin ) {
+		dest.End = interval.End;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+bool CVariantDefs::addToken( string& token, CInterval interval )
+{
+	COccupation& occupation = variants.back();
+	if( token == "$P" ) {
+		return addInterval( occupation.Who, interval );
+	}
+
+	if( token == "$O" || token == "$L" ) {
+		return addInterval( occupation.Where, interval );
+	}
+
+	const size_t tildePos = token.find_first_of( "~" );
+	if( tildePos == string::npos ) {
+		return true;
+	}
+	if( tildePos == 0 ) {
+		return false;
+	}
+
+	const string afterTidle = token.substr( tildePos );
+	token = token.substr( 0, tildePos );
+
+	if( afterTidle == "~job" ) {
+		return addInterval( occupation.Job, interval );
+	} else if( afterTidle == "~where" ) {
+		return addInterval( occupation.Where, interval );
+	} else if( afterTidle == "~who" ) {
+		return addInterval( occupation.Who, interval );
+	}
+
+	return ( afterTidle == "~" );
+}
+
+size_t CVariantDefs::AddVariant( string& variant )
+{
+	variants.push_back( COccupation() );
+	vector<string> tokens = SplitString( variant );
+	CInterval interval( 0, 1 );
+	for( string& token : tokens ) {
+		if( !addToken( token, interval ) ) {
+			throw CException( "Invalid format" );
+		}
+		interval.Offset( 1 );
+	}
+	if( !variants.back().Check() ) {
+		throw CException( "Invalid format" );
+	}
+	variant.clear();
+	for( const string& token : tokens ) {
+		variant += token + " ";
+	}
+	return variants.size();
+}
+
+template<typename TTokenIterator>
+COccupation CVariantDefs::Occupation( const size_t variantIndex,
+	TTokenIterator firstMatchedToken ) const
+{
+	COccupation occupation = variants[variantIndex - 1];
+	occupation.Variant = variantIndex;
+	if( occupation.Who.Defined() ) {
+		occupation.Who.Begin = ( firstMatchedToken + occupation.Who.Begin )->Begin;
+		occupation.Who.End = ( firstMatchedToken + occupation.Who.End - 1 )->End;
+	}
+	if( occupation.Where.Defined() ) {
+		occupation.Where.Begin = ( firstMatchedToken + occupation.Where.Begin )->Begin;
+		occupation.Where.End = ( firstMatchedToken + occupation.Where.End - 1 )->End;
+	}
+	if( occupation.Job.Defined() ) {
+		occupation.Job.Begin = ( firstMatchedToken + occupation.Job.Begin )->Begin;
+		occupation.Job.End = ( firstMatchedToken + occupation.Job.End - 1 )->End;
+	}
+	if( !occupation.Check() ) {
+		throw logic_error( "CVariantDefs::Occupation" );
+	}
+	return occupation;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Lines of a templates file and variants of the lines.
+struct CTemplatesSource {
+	vector<string> Lines;
+	// line index and text of each variant
+	vector<pair<size_t, string>> Variants;
+};
+
+void LoadTemplates( const string& templatesFilename, CDictionaries& dictionaries,
+	CVariantDefs& variantDefs, CTemplatesSource* source = nullptr )
+{
+	ifstream templatesFile( templatesFilename );
+	if( !templatesFile.good() ) {
+		throw CException( "Cannot read templates `" + templatesFilename + "`." );
+	}
+	// templates usually contain a person and an organization or a location
+	dictionaries.AddAnchors( { InternalNamedEntityTypeText( NET_Person ) } );
+	dictionaries.AddAnchors( { InternalNamedEntityTypeText( NET_Org ),
+		InternalNamedEntityTypeText( NET_Location ) } );
+	size_t lineNumber = 0;
+	do {
+		string line;
+		++lineNumber;
+		getline( templatesFile, line );
+		if( source != nullptr ) {
+			source->Lines.push_back( line );
+		}
+		NormalizeTemplatesLine( line );
+		vector<string> variants = MakeAllVariants( line );
+		if( variants.empty() ) {
+			throw CException( "Invalid templates `" + templatesFilename + "`"
+				" line " + to_string( lineNumber ) + "." );
+		}
+		if( variants.size() == 1 && variants.front().empty() ) {
+			variants.clear();
+		}
+
+		for( string& variant : variants ) {
+			const size_t index = variantDefs.AddVariant( variant );
+			dictionaries.AddLine( variant, index );
+			if( source != nullptr ) {
+				source->Variants.emplace_back( lineNumber - 1, variant );
+			}
+		}
+	} while( templatesFile.good() );
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+const char* const MystemExeName = "mystem";
+
+string GetMystemPath( const string& exePath )
+{
+	const size_t pos = exePath.find_last_of( "\\/" );
+	if( pos != string::npos ) {
+		return exePath.substr( 0, pos + 1 ) + MystemExeName;
+	}
+	return MystemExeName;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Hash of contents of a stream (64-bit FNV-1a) as a hexadecimal string.
+string StreamHash( istream& input )
+{
+	uint64_t hash = HashBytes( nullptr, 0 );
+	char buffer[1 << 16];
+	while( input.read( buffer, sizeof( buffer ) ) || input.gcount() > 0 ) {
+		hash = HashBytes( buffer, static_cast<size_t>( input.gcount() ), hash );
+	}
+	ostringstream hashText;
+	hashText << hex << setw( 16 ) << setfill( '0' ) << hash;
+	return hashText.str();
+}
+
+string FileHash( const string& filename )
+{
+	ifstream input( filename, ios::in | ios::binary );
+	if( !input.good() ) {
+		throw CException( "Cannot read file `" + filename + "`." );
+	}
+	return StreamHash( input );
+}
+
+// Hash of a file of a document (see CDocumentFiles).
+string DocumentFileHash( const string& filename )
+{
+	CDocumentInput input( filename );
+	if( !input.Stream().good() ) {
+		throw CException( "Cannot read file `" + filename + "`." );
+	}
+	return StreamHash( input.Stream() );
+}
+
+// Key of results of processing files: hashes of their contents.
+string FilesKey( const vector<string>& filenames )
+{
+	string key;
+	for( const string& filename : filenames ) {
+		key += ( key.empty() ? "" : " " ) + FileHash( filename );
+	}
+	return key;
+}
+
+// Cache of tokens of prepared text made by mystem (before named entities
+// are tagged), the key is the hash of the text.
+string MystemTokensCacheFilename( const string& baseFilename )
+{
+	return baseFilename + ".todua-mystem";
+}
+
+// Index of fingerprints of tokenized documents, tokens of a document are
+// reused for its reprints. A fingerprint is the hash of prepared text and
+// MinHash signature of its shingles (runs of ShingleWords words). Documents
+// which signatures have an equal band of BandSize values are candidates
+// to near duplicates, a near duplicate is the most similar candidate with
+// estimated similarity (Jaccard index of shingles) at least
+// NearDuplicateSimilarity. Entries are appended as documents are indexed
+// and the index is rewritten without old entries by Close (like CManifest).
+class CDedupeIndex {
+public:
+	static const size_t SignatureSize = 64;
+	static const size_t BandSize = 2;
+	static const size_t ShingleWords = 4;
+	static constexpr double NearDuplicateSimilarity = 0.5;
+
+	struct CFingerprint {
+		uint64_t TextHash;
+		array<uint64_t, SignatureSize> Signature;
+	};
+
+	enum TMatch {
+		M_None,
+		M_Duplicate,
+		M_NearDuplicate
+	};
+
+	CDedupeIndex();
+
+	void Open( const string& filename );
+	bool IsOpen() const { return !filename.empty(); }
+	void Close();
+
+	static CFingerprint Fingerprint( const string& text );
+	// Tokens of prepared text taken from the cached tokens of an indexed
+	// duplicate or near duplicate, the source is its base filename.
+	// Sentences of a near duplicate which are absent in the source are blank
+	// and are the rest text like in CLemmaCache::Split.
+	TMatch Find( const CFingerprint& fingerprint, const string& text, CTokens& tokens,
+		string& restText, vector<pair<size_t, size_t>>& restPieces, string& source );
+	// Index a document and cache its tokens made by mystem.
+	void Add( const string& baseFilename, const CFingerprint& fingerprint,
+		const CTokens& tokens );
+
+	size_t Documents() const { return documents; }
+	size_t Duplicates() const { return duplicates; }
+	size_t NearDuplicates() const { return nearDuplicates; }
+	// Sentences of near duplicates and the sentences which tokens are reused.
+	size_t Sentences() const { return sentences; }
+	size_t ReusedSentences() const { return reusedSentences; }
+
+private:
+	struct CEntry {
+		string BaseFilename;
+		CFingerprint Fingerprint;
+	};
+
+	string filename;
+	ofstream output;
+	vector<CEntry> entries;
+	unordered_map<string, size_t> entryIndices;
+	// entries by hashes of texts and by bands of signatures,
+	// hashes of replaced entries are not removed
+	unordered_multimap<uint64_t, size_t> textHashes;
+	unordered_multimap<uint64_t, size_t> bands;
+	size_t documents;
+	size_t duplicates;
+	size_t nearDuplicates;
+	size_t sentences;
+	size_t reusedSentences;
+
+	void addEntry( const CEntry& entry );
+	bool reuseSentences( const CEntry& source, const string& text, CTokens& tokens,
+		string& restText, vector<pair<size_t, size_t>>& restPieces );
+	static void writeEntry( ostream& output, const CEntry& entry );
+	static string key( const CFingerprint& fingerprint );
+	static bool hasShingles( const CFingerprint& fingerprint );
+	static uint64_t bandHash( const CFingerprint& fingerprint, size_t band );
+	static double similarity( const CFingerprint& fingerprint1,
+		const CFingerprint& fingerprint2 );
+};
+
+const size_t CDedupeIndex::SignatureSize;
+const size_t CDedupeIndex::BandSize;
+const size_t CDedupeIndex::ShingleWords;
+constexpr double CDedupeIndex::NearDuplicateSimilarity;
+
+CDedupeIndex::CDedupeIndex() :
+	documents( 0 ),
+	duplicates( 0 ),
+	nearDuplicates( 0 ),
+	sentences( 0 ),
+	reusedSentences( 0 )
+{
+}
+
+void CDedupeIndex::Open( const string& _filename )
+{
+	if( IsOpen() ) {
+		throw logic_error( "CDedupeIndex::Open" );
+	}
+	filename = _filename;
+	ifstream input( filename );
+	string line;
+	while( getline( input, line ) ) {
+		if( line.empty() ) {
+			continue;
+		}
+		const size_t tabPos = line.find( '\t' );
+		CEntry entry;
+		entry.BaseFilename = line.substr( 0, tabPos );
+		istringstream values( tabPos == string::npos ? "" : line.substr( tabPos + 1 ) );
+		values >> hex >> entry.Fingerprint.TextHash;
+		for( uint64_t& value : entry.Fingerprint.Signature ) {
+			values >> value;
+		}
+		if( values.fail() ) {
+			throw CException( "Bad dedupe index `" + filename + "` format." );
+		}
+		addEntry( entry );
+	}
+	input.close();
+	output.open( filename, ios::out | ios::app );
+	if( !output.good() ) {
+		throw CException( "Cannot write dedupe index `" + filename + "`." );
+	}
+}
+
+void CDedupeIndex::Close()
+{
+	if( !IsOpen() ) {
+		return;
+	}
+	output.close();
+	output.open( filename, ios::out | ios::trunc );
+	for( const CEntry& entry : entries ) {
+		writeEntry( output, entry );
+	}
+	output.close();
+	if( output.fail() ) {
+		throw CException( "Cannot write dedupe index `" + filename + "`." );
+	}
+	entries.clear();
+	entryIndices.clear();
+	textHashes.clear();
+	bands.clear();
+	filename.clear();
+}
+
+CDedupeIndex::CFingerprint CDedupeIndex::Fingerprint( const string& text )
+{
+	CFingerprint fingerprint;
+	fingerprint.TextHash = HashBytes( text.data(), text.length() );
+	fingerprint.Signature.fill( numeric_limits<uint64_t>::max() );
+
+	// words are runs of letters and digits,
+	// bytes of non ASCII characters of prepared text are bytes of letters
+	vector<uint64_t> wordHashes;
+	size_t offset = 0;
+	while( offset < text.length() ) {
+		const size_t wordBegin = offset;
+		while( offset < text.length() && ( IsCharAlphaOrDigit( text[offset] )
+			|| static_cast<unsigned char>( text[offset] ) >= 0x80 ) )
+		{
+			offset++;
+		}
+		if( offset > wordBegin ) {
+			wordHashes.push_back( HashBytes( text.data() + wordBegin, offset - wordBegin ) );
+		} else {
+			offset++;
+		}
+	}
+
+	// hash functions of the signature are the hash of a shingle
+	// mixed with different constants (the finalizer of splitmix64)
+	const size_t shingleWords = min( ShingleWords, wordHashes.size() );
+	for( size_t i = 0; i + shingleWords <= wordHashes.size() && shingleWords > 0; i++ ) {
+		const uint64_t shingleHash = HashBytes( reinterpret_cast<const char*>( &wordHashes[i] ),
+			shingleWords * sizeof( uint64_t ) );
+		for( size_t j = 0; j < SignatureSize; j++ ) {
+			uint64_t value = shingleHash + ( j + 1 ) * 0x9E3779B97F4A7C15ULL;
+			value = ( value ^ ( value >> 30 ) ) * 0xBF58476D1CE4E5B9ULL;
+			value = ( value ^ ( value >> 27 ) ) * 0x94D049BB133111EBULL;
+			value ^= value >> 31;
+			fingerprint.Signature[j] = min( fingerprint.Signature[j], value );
+		}
+	}
+	return fingerprint;
+}
+
+CDedupeIndex::TMatch CDedupeIndex::Find( const CFingerprint& fingerprint, const string& text,
+	CTokens& tokens, string& restText, vector<pair<size_t, size_t>>& restPieces,
+	string& source )
+{
+	tokens.clear();
+	restText.clear();
+	restPieces.clear();
+	source.clear();
+	documents++;
+
+	auto hashEntries = textHashes.equal_range( fingerprint.TextHash );
+	for( auto index = hashEntries.first; index != hashEntries.second; ++index ) {
+		const CEntry& entry = entries[index->second];
+		if( entry.Fingerprint.TextHash == fingerprint.TextHash
+			&& tokens.Load( MystemTokensCacheFilename( entry.BaseFilename ), key( fingerprint ) ) )
+		{
+			source = entry.BaseFilename;
+			duplicates++;
+			return M_Duplicate;
+		}
+	}
+
+	if( !hasShingles( fingerprint ) ) {
+		return M_None;
+	}
+	// candidates from the most similar, a candidate may be changed since
+	// it was indexed, then the next one is tried
+	vector<pair<double, size_t>> candidates;
+	for( size_t band = 0; band < SignatureSize / BandSize; band++ ) {
+		auto bandEntries = bands.equal_range( bandHash( fingerprint, band ) );
+		for( auto index = bandEntries.first; index != bandEntries.second; ++index ) {
+			const double candidateSimilarity =
+				similarity( fingerprint, entries[index->second].Fingerprint );
+			if( candidateSimilarity >= NearDuplicateSimilarity ) {
+				candidates.emplace_back( -candidateSimilarity, index->second );
+			}
+		}
+	}
+	sort( candidates.begin(), candidates.end() );
+	candidates.erase( unique( candidates.begin(), candidates.end() ), candidates.end() );
+	for( const pair<double, size_t>& candidate : candidates ) {
+		const CEntry& entry = entries[candidate.second];
+		if( reuseSentences( entry, text, tokens, restText, restPieces ) ) {
+			source = entry.BaseFilename;
+			nearDuplicates++;
+			return M_NearDuplicate;
+		}
+	}
+	return M_None;
+}
+
+void CDedupeIndex::Add( const string& baseFilename, const CFingerprint& fingerprint,
+	const CTokens& tokens )
+{
+	tokens.Save( MystemTokensCacheFilename( baseFilename ), key( fingerprint ) );
+	CEntry entry;
+	entry.BaseFilename = baseFilename;
+	entry.Fingerprint = fingerprint;
+	addEntry( entry );
+	writeEntry( output, entry );
+}
+
+void CDedupeIndex::addEntry( const CEntry& entry )
+{
+	auto entryIndex = entryIndices.find( entry.BaseFilename );
+	size_t index = entries.size();
+	if( entryIndex != entryIndices.end() ) {
+		index = entryIndex->second;
+		entries[index] = entry;
+	} else {
+		entryIndices[entry.BaseFilename] = index;
+		entries.push_back( entry );
+	}
+	textHashes.emplace( entry.Fingerprint.TextHash, index );
+	if( hasShingles( entry.Fingerprint ) ) {
+		for( size_t band = 0; band < SignatureSize / BandSize; band++ ) {
+			bands.emplace( bandHash( entry.Fingerprint, band ), index );
+		}
+	}
+}
+
+// Tokens of the sentences of the text which are sentences of the source
+// are its cached tokens, other sentences are the rest text.
+// Returns false if the source is changed since it was indexed.
+bool CDedupeIndex::reuseSentences( const CEntry& source, const string& text, CTokens& tokens,
+	string& restText, vector<pair<size_t, size_t>>& restPieces )
+{
+	const string sourceFilename = source.BaseFilename + ".txt";
+	CTokens sourceTokens;
+	if( !DocumentFiles.Exists( sourceFilename )
+		|| !sourceTokens.Load( MystemTokensCacheFilename( source.BaseFilename ),
+			key( source.Fingerprint ) ) )
+	{
+		return false;
+	}
+	const string sourceText = PrepareText( sourceFilename );
+	if( HashBytes( sourceText.data(), sourceText.length() ) != source.Fingerprint.TextHash ) {
+		return false;
+	}
+
+	// offsets of sentences of the source in characters
+	unordered_map<string, size_t> sourceSentences;
+	string sentence;
+	size_t length = 0;
+	for( size_t offset = 0; offset < sourceText.length(); ) {
+		const size_t sentenceEnd = SentenceEnd( sourceText, offset );
+		sentence.assign( sourceText, offset, sentenceEnd - offset );
+		sourceSentences.emplace( sentence, length );
+		length += TextLength( sentence );
+		offset = sentenceEnd;
+	}
+
+	tokens.clear();
+	restText.clear();
+	restPieces.clear();
+	length = 0;
+	size_t restLength = 0;
+	for( size_t offset = 0; offset < text.length(); ) {
+		const size_t sentenceEnd = SentenceEnd( text, offset );
+		sentence.assign( text, offset, sentenceEnd - offset );
+		const size_t sentenceLength = TextLength( sentence );
+		sentences++;
+		bool reused = false;
+		auto sourceSentence = sourceSentences.find( sentence );
+		if( sourceSentence != sourceSentences.end() ) {
+			// tokens of the sentence must not cross its bounds
+			const size_t begin = sourceSentence->second;
+			const size_t end = begin + sentenceLength;
+			auto first = lower_bound( sourceTokens.cbegin(), sourceTokens.cend(), begin,
+				[]( const CToken& token, const size_t offset )
+			{
+				return token.Begin < offset;
+			} );
+			auto last = first;
+			while( last != sourceTokens.cend() && last->End <= end ) {
+				++last;
+			}
+			if( last == sourceTokens.cend() || last->Begin >= end ) {
+				for( ; first != last; ++first ) {
+					tokens.push_back( *first );
+					tokens.back().Begin = first->Begin - begin + length;
+					tokens.back().End = first->End - begin + length;
+				}
+				reused = true;
+			}
+		}
+		if( reused ) {
+			reusedSentences++;
+		} else {
+			restPieces.emplace_back( restLength, length );
+			restText += sentence;
+			restText += '\n';
+			restLength += sentenceLength + 1;
+		}
+		length += sentenceLength;
+		offset = sentenceEnd;
+	}
+	return true;
+}
+
+void CDedupeIndex::writeEntry( ostream& output, const CEntry& entry )
+{
+	output << entry.BaseFilename << "\t" << key( entry.Fingerprint ) << hex;
+	for( const uint64_t value : entry.Fingerprint.Signature ) {
+		output << " " << value;
+	}
+	output << dec << "\n";
+	output.flush();
+}
+
+// Key of cached tokens: the hash of the text.
+string CDedupeIndex::key( const CFingerprint& fingerprint )
+{
+	ostringstream hashText;
+	hashText << hex << setw( 16 ) << setfill( '0' ) << fingerprint.TextHash;
+	return hashText.str();
+}
+
+// Signature of a text without words has no shingles.
+bool CDedupeIndex::hasShingles( const CFingerprint& fingerprint )
+{
+	return ( fingerprint.Signature[0] != numeric_limits<uint64_t>::max() );
+}
+
+uint64_t CDedupeIndex::bandHash( const CFingerprint& fingerprint, size_t band )
+{
+	const uint64_t hash = HashBytes( reinterpret_cast<const char*>( &band ), sizeof( band ) );
+	return HashBytes( reinterpret_cast<const char*>( &fingerprint.Signature[band * BandSize] ),
+		BandSize * sizeof( uint64_t ), hash );
+}
+
+double CDedupeIndex::similarity( const CFingerprint& fingerprint1,
+	const CFingerprint& fingerprint2 )
+{
+	size_t equalValues = 0;
+	for( size_t i = 0; i < SignatureSize; i++ ) {
+		if( fingerprint1.Signature[i] == fingerprint2.Signature[i] ) {
+			equalValues++;
+		}
+	}
+	return static_cast<double>( equalValues ) / SignatureSize;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Budget of a document (see --document-time and --document-size): a text
+// larger than the maximal size is not analyzed by mystem and mystem is
+// killed at the deadline, then the budget is overrun and the words of the
+// text are taken without lemmas. The budget starts with each document.
+class CDocumentBudget {
+public:
+	CDocumentBudget( size_t _timeMilliseconds, size_t _maxTextSize, bool _skipOverrun ) :
+		timeMilliseconds( _timeMilliseconds ),
+		maxTextSize( _maxTextSize ),
+		skipOverrun( _skipOverrun ),
+		overrunsCount( 0 )
+	{
+	}
+
+	bool IsLimited() const { return ( timeMilliseconds > 0 || maxTextSize > 0 ); }
+	// Whether results of documents over budget are not written.
+	bool SkipOverrun() const { return skipOverrun; }
+
+	void Start();
+	// Milliseconds till the deadline or 0 if the time is not limited,
+	// returns false and overruns the budget if the deadline has passed.
+	bool TimeLeft( size_t& milliseconds );
+	// Returns false and overruns the budget if the text is too large.
+	bool Fits( size_t textSize );
+	void Overrun( const string& reason );
+
+	bool IsOverrun() const { return !reason.empty(); }
+	const string& Reason() const { return reason; }
+	size_t OverrunsCount() const { return overrunsCount; }
+
+private:
+	const size_t timeMilliseconds;
+	const size_t maxTextSize;
+	const bool skipOverrun;
+	chrono::steady_clock::time_point deadline;
+	string reason;
+	size_t overrunsCount;
+};
+
+void CDocumentBudget::Start()
+{
+	deadline = chrono::steady_clock::now() + chrono::milliseconds( timeMilliseconds );
+	reason.clear();
+}
+
+bool CDocumentBudget::TimeLeft( size_t& milliseconds )
+{
+	milliseconds = 0;
+	if( timeMilliseconds == 0 ) {
+		return true;
+	}
+	const auto left = chrono::duration_cast<chrono::milliseconds>(
+		deadline - chrono::steady_clock::now() ).count();
+	if( left <= 0 ) {
+		Overrun( "the time is out before mystem" );
+		return false;
+	}
+	milliseconds = static_cast<size_t>( left );
+	return true;
+}
+
+bool CDocumentBudget::Fits( size_t textSize )
+{
+	if( maxTextSize > 0 && textSize > maxTextSize ) {
+		Overrun( "the text of " + to_string( textSize ) + " bytes is too large for mystem" );
+		return false;
+	}
+	return true;
+}
+
+void CDocumentBudget::Overrun( const string& _reason )
+{
+	if( reason.empty() ) {
+		overrunsCount++;
+		reason = _reason;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Morphological analyzer, runs mystem or replays its recorded output.
+// Recorded outputs are files HASH.mystem of a directory, where HASH is
+// the hash of the analyzed text, so the documents can be processed
+// without mystem and without its timing noise.
+class CMystem {
+public:
+	enum TMode {
+		M_Run, // run mystem
+		M_Record, // run mystem and record its output
+		M_Replay // replay recorded output
+	};
+
+	explicit CMystem( const string& mystemPath = MystemExeName );
+
+	void SetRecordings( TMode mode, const string& recordingsDirectory );
+	// Delay of each replay to imitate the time of mystem.
+	void SetReplayLatency( size_t milliseconds ) { replayLatency = milliseconds; }
+	// Lemmas of cached forms are taken from the cache instead of mystem
+	// (see ParseTokens), if wholeText a text with forms which are not cached
+	// is analyzed by mystem as a whole to keep the context of all sentences.
+	void SetLemmaCache( CLemmaCache* _lemmaCache, bool wholeText )
+	{
+		lemmaCache = _lemmaCache;
+		lemmaCacheWholeText = wholeText;
+	}
+	CLemmaCache* LemmaCache() const { return lemmaCache; }
+	bool LemmaCacheWholeText() const { return lemmaCacheWholeText; }
+	// Tokens of duplicates and near duplicates of indexed documents
+	// are reused (see ParseTokens).
+	void SetDedupeIndex( CDedupeIndex* _dedupeIndex ) { dedupeIndex = _dedupeIndex; }
+	CDedupeIndex* DedupeIndex() const { return dedupeIndex; }
+	// Mystem is killed at the deadline of the budget of a document.
+	void SetBudget( CDocumentBudget* _budget ) { budget = _budget; }
+	CDocumentBudget* Budget() const { return budget; }
+
+	// Analyze prepared text, returns the name of a file with the output
+	// or an empty string if the budget of the document is overrun.
+	string Analyze( const string& textFilename, const string& outputFilename ) const;
+	// Record `output` of mystem for prepared text.
+	void Record( const string& textFilename, const string& output ) const;
+
+private:
+	const string mystemPath;
+	TMode mode;
+	string recordingsDirectory;
+	size_t replayLatency;
+	CLemmaCache* lemmaCache;
+	bool lemmaCacheWholeText;
+	CDedupeIndex* dedupeIndex;
+	CDocumentBudget* budget;
+
+	string recordingFilename( const string& textFilename ) const;
+};
+
+CMystem::CMystem( const string& _mystemPath ) :
+	mystemPath( _mystemPath ),
+	mode( M_Run ),
+	replayLatency( 0 ),
+	lemmaCache( nullptr ),
+	lemmaCacheWholeText( false ),
+	dedupeIndex( nullptr ),
+	budget( nullptr )
+{
+}
+
+void CMystem::SetRecordings( TMode _mode, const string& _recordingsDirectory )
+{
+	mode = _mode;
+	recordingsDirectory = _recordingsDirectory;
+}
+
+string CMystem::Analyze( const string& textFilename, const string& outputFilename ) const
+{
+	size_t timeout = 0;
+	if( budget != nullptr && !budget->TimeLeft( timeout ) ) {
+		return "";
+	}
+	const string killedReason = "mystem is killed at the deadline";
+	if( mode == M_Replay ) {
+		const string filename = recordingFilename( textFilename );
+		if( !ifstream( filename ).good() ) {
+			throw CException( "Recorded output of `mystem` `" + filename + "` not found." );
+		}
+		CTraceScope scope( "mystem (replayed)", "mystem" );
+		if( timeout > 0 && replayLatency > timeout ) {
+			this_thread::sleep_for( chrono::milliseconds( timeout ) );
+			budget->Overrun( killedReason );
+			return "";
+		}
+		this_thread::sleep_for( chrono::milliseconds( replayLatency ) );
+		return filename;
+	}
+
+	const string mystem = "\"" + mystemPath + "\" -ncwd --eng-gr -e "
+		+ ( TextEncoding == TE_Utf8 ? "utf-8 " : "cp1251 " )
+		+ textFilename + " " + outputFilename;
+	{
+		// lifetime of the child process
+		CTraceScope scope( "mystem", "mystem" );
+		if( timeout == 0 ) {
+			if( !System( mystem ) ) {
+				throw CException( "Cannot run `mystem`." );
+			}
+		} else {
+			bool timedOut = false;
+			if( !RunChildProcess( mystem, timeout, timedOut ) ) {
+				if( !timedOut ) {
+					throw CException( "Cannot run `mystem`." );
+				}
+				budget->Overrun( killedReason );
+				return "";
+			}
+		}
+	}
+	if( mode == M_Record ) {
+		const string filename = recordingFilename( textFilename );
+		ifstream output( outputFilename, ios::in | ios::binary );
+		ofstream recording( filename, ios::out | ios::binary );
+		recording << output.rdbuf();
+		if( !recording.good() ) {
+			throw CException( "Cannot write recorded output of `mystem` `" + filename + "`." );
+		}
+	}
+	return outputFilename;
+}
+
+void CMystem::Record( const string& textFilename, const string& output ) const
+{
+	const string filename = recordingFilename( textFilename );
+	ofstream recording( filename, ios::out | ios::binary );
+	recording << output;
+	if( !recording.good() ) {
+		throw CException( "Cannot write recorded output of `mystem` `" + filename + "`." );
+	}
+}
+
+string CMystem::recordingFilename( const string& textFilename ) const
+{
+	return recordingsDirectory + "/" + FileHash( textFilename ) + ".mystem";
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Size of a file in bytes, 0 if the file cannot be read.
+size_t FileSize( const string& filename )
+{
+	ifstream file( filename, ios::in | ios::binary | ios::ate );
+	const streamoff size = file.good() ? static_cast<streamoff>( file.tellg() ) : 0;
+	return static_cast<size_t>( max<streamoff>( size, 0 ) );
+}
+
+// Size of a file of a document (see CDocumentFiles).
+size_t DocumentFileSize( const string& filename )
+{
+	if( !DocumentFiles.IsPacked() ) {
+		shared_ptr<const string> contents;
+		if( DocumentFiles.FindAsync( filename, contents ) ) {
+			return ( contents != nullptr ) ? contents->size() : 0;
+		}
+		if( ifstream( filename ).good() ) {
+			return FileSize( filename );
+		}
+		// the size modulo 2^32 ends a gzip file
+		ifstream compressed( filename + ".gz", ios::in | ios::binary );
+		unsigned char sizeBytes[4] = {};
+		compressed.seekg( -4, ios::end );
+		compressed.read( reinterpret_cast<char*>( sizeBytes ), sizeof( sizeBytes ) );
+		return static_cast<size_t>( sizeBytes[0] | sizeBytes[1] << 8 | sizeBytes[2] << 16
+			| static_cast<uint32_t>( sizeBytes[3] ) << 24 );
+	}
+	const char* data = nullptr;
+	size_t size = 0;
+	string buffer;
+	return DocumentFiles.Find( filename, data, size, buffer ) ? size : 0;
+}
+
+// JSON string literal of a UTF-8 text.
+string JsonString( const string& text )
+{
+	string result = "\"";
+	for( const char c : text ) {
+		if( c == '"' || c == '\\' ) {
+			result += '\\';
+			result += c;
+		} else if( static_cast<unsigned char>( c ) < 32 ) {
+			ostringstream code;
+			code << "\\u" << hex << setw( 4 ) << setfill( '0' ) << static_cast<int>( c );
+			result += code.str();
+		} else {
+			result += c;
+		}
+	}
+	return result + "\"";
+}
+
+// Wall and CPU time of processing stages and counters of documents.
+// Time of a stage lasts from the call of Stage till the next call of Stage
+// or EndDocument. CPU time includes all threads and child processes.
+// The report contains each document, totals and percentiles of wall time
+// of documents and their stages.
+class CStatistics {
+public:
+	enum TStage {
+		S_Prepare,
+		S_Dedupe,
+		S_LemmaCache,
+		S_Mystem,
+		S_Parse,
+		S_EntitiesRead,
+		S_EntitiesTagging,
+		S_TokensCache,
+		S_Match, // dictionaries and templates in one pass
+		S_Write,
+		S_Count
+	};
+	enum TCounter {
+		C_Bytes,
+		C_Tokens,
+		C_Entities,
+		C_DictionaryHits,
+		C_TemplateMatches,
+		C_Occupations,
+		C_DictionaryShifts,
+		C_DictionaryBacktracks,
+		C_TemplateShifts,
+		C_TemplateBacktracks,
+		C_MystemBytes,
+		C_LemmaCacheLookups,
+		C_LemmaCacheHits,
+		C_Duplicates,
+		C_NearDuplicates,
+		C_ReusedTokens,
+		C_OverBudget,
+		C_Count
+	};
+
+	CStatistics();
+
+	// Loading of templates and dictionaries before the documents.
+	void BeginLoading();
+	void EndLoading();
+
+	void BeginDocument( const string& name );
+	void Stage( TStage stage );
+	void Add( TCounter counter, size_t value );
+	void EndDocument();
+
+	void Write( const string& filename ) const;
+
+private:
+	// Time and memory of a stage, a document or the loading.
+	struct CMeasure {
+		double Wall;
+		double Cpu;
+		size_t Allocations;
+		size_t PeakLiveBytes; // live heap bytes of the process
+		size_t LiveBytes; // at the end
+		size_t PeakRss; // of the process up to the end
+
+		CMeasure() :
+			Wall( 0 ),
+			Cpu( 0 ),
+			Allocations( 0 ),
+			PeakLiveBytes( 0 ),
+			LiveBytes( 0 ),
+			PeakRss( 0 )
+		{
+		}
+
+		// Accumulate a later measure.
+		CMeasure& operator+=( const CMeasure& measure );
+	};
+	struct CDocument {
+		string Name;
+		CMeasure Measure;
+		array<CMeasure, S_Count> Stages;
+		array<size_t, C_Count> Counters;
+
+		CDocument()
+		{
+			Counters.fill( 0 );
+		}
+	};
+	// Starts a new peak of live bytes.
+	struct CMeasurePoint {
+		chrono::steady_clock::time_point Wall;
+		double Cpu;
+		size_t Allocations;
+
+		CMeasurePoint();
+
+		CMeasure Finish() const;
+	};
+
+	CMeasure loading;
+	vector<CDocument> documents;
+	CMeasurePoint start; // of the loading or the document
+	CMeasurePoint stageStart;
+	TStage stage;
+
+	void finishStage();
+	static void writeMeasure( ostream& output, const CMeasure& measure );
+	static void writeCounters( ostream& output, const array<size_t, C_Count>& counters );
+	static void writePercentiles( ostream& output, vector<double> values );
+	static const char* stageName( TStage stage );
+	static const char* counterName( TCounter counter );
+};
+
+CStatistics::CMeasure& CStatistics::CMeasure::operator+=( const CMeasure& measure )
+{
+	Wall += measure.Wall;
+	Cpu += measure.Cpu;
+	Allocations += measure.Allocations;
+	PeakLiveBytes = max( PeakLiveBytes, measure.PeakLiveBytes );
+	LiveBytes = measure.LiveBytes;
+	PeakRss = max( PeakRss, measure.PeakRss );
+	return *this;
+}
+
+CStatistics::CMeasurePoint::CMeasurePoint() :
+	Wall( chrono::steady_clock::now() ),
+	Cpu( ProcessCpuTime() ),
+	Allocations( AllocationCounters().Allocations )
+{
+	ResetPeakLiveBytes();
+}
+
+CStatistics::CMeasure CStatistics::CMeasurePoint::Finish() const
+{
+	const CAllocationCounters counters = AllocationCounters();
+	CMeasure measure;
+	measure.Wall = chrono::duration<double>( chrono::steady_clock::now() - Wall ).count();
+	measure.Cpu = ProcessCpuTime() - Cpu;
+	measure.Allocations = counters.Allocations - Allocations;
+	measure.PeakLiveBytes = counters.PeakLiveBytes;
+	measure.LiveBytes = counters.LiveBytes;
+	measure.PeakRss = PeakResidentSetSize();
+	return measure;
+}
+
+CStatistics::CStatistics() :
+	stage( S_Count )
+{
+}
+
+void CStatistics::BeginLoading()
+{
+	Trace.Begin( "loading", "loading" );
+	start = CMeasurePoint();
+}
+
+void CStatistics::EndLoading()
+{
+	loading = start.Finish();
+	Trace.End( "loading", "loading" );
+}
+
+void CStatistics::BeginDocument( const string& name )
+{
+	Trace.Begin( name, "document" );
+	documents.emplace_back();
+	documents.back().Name = name;
+	start = CMeasurePoint();
+	stage = S_Count;
+}
+
+void CStatistics::Stage( TStage newStage )
+{
+	finishStage();
+	stage = newStage;
+	Trace.Begin( stageName( stage ), "stage" );
+	stageStart = CMeasurePoint();
+}
+
+void CStatistics::Add( TCounter counter, size_t value )
+{
+	if( documents.empty() ) {
+		throw logic_error( "CStatistics::Add" );
+	}
+	documents.back().Counters[counter] += value;
+}
+
+void CStatistics::EndDocument()
+{
+	finishStage();
+	CDocument& document = documents.back();
+	// peaks of live bytes were restarted by the stages
+	size_t peakLiveBytes = AllocationCounters().PeakLiveBytes;
+	for( const CMeasure& stageMeasure : document.Stages ) {
+		peakLiveBytes = max( peakLiveBytes, stageMeasure.PeakLiveBytes );
+	}
+	document.Measure = start.Finish();
+	document.Measure.PeakLiveBytes = max( document.Measure.PeakLiveBytes, peakLiveBytes );
+	Trace.End( document.Name, "document" );
+}
+
+void CStatistics::finishStage()
+{
+	if( stage != S_Count ) {
+		documents.back().Stages[stage] += stageStart.Finish();
+		Trace.End( stageName( stage ), "stage" );
+		stage = S_Count;
+	}
+}
+
+void CStatistics::Write( const string& filename ) const
+{
+	ofstream output( filename );
+	output << fixed << setprecision( 6 );
+	output << "{\n\t\"loading\": ";
+	writeMeasure( output, loading );
+	output << ",\n\t\"documents\": [";
+	CDocument total;
+	for( size_t i = 0; i < documents.size(); i++ ) {
+		const CDocument& document = documents[i];
+		output << ( i > 0 ? "," : "" ) << "\n\t\t{ \"name\": " << JsonString( document.Name )
+			<< ", \"time\": ";
+		writeMeasure( output, document.Measure );
+		output << ", \"stages\": {";
+		for( size_t s = 0; s < S_Count; s++ ) {
+			output << ( s > 0 ? ", " : " " ) << "\"" << stageName( TStage( s ) ) << "\": ";
+			writeMeasure( output, document.Stages[s] );
+			total.Stages[s] += document.Stages[s];
+		}
+		output << " }, \"counters\": ";
+		writeCounters( output, document.Counters );
+		output << " }";
+		total.Measure += document.Measure;
+		for( size_t c = 0; c < C_Count; c++ ) {
+			total.Counters[c] += document.Counters[c];
+		}
+	}
+	output << "\n\t],\n\t\"total\": { \"documents\": " << documents.size() << ", \"time\": ";
+	writeMeasure( output, total.Measure );
+	output << ", \"stages\": {";
+	for( size_t s = 0; s < S_Count; s++ ) {
+		output << ( s > 0 ? ", " : " " ) << "\"" << stageName( TStage( s ) ) << "\": ";
+		writeMeasure( output, total.Stages[s] );
+	}
+	output << " }, \"counters\": ";
+	writeCounters( output, total.Counters );
+	output << " },\n\t\"percentiles\": {\n\t\t\"document\": ";
+	vector<double> values;
+	for( const CDocument& document : documents ) {
+		values.push_back( document.Measure.Wall );
+	}
+	writePercentiles( output, values );
+	for( size_t s = 0; s < S_Count; s++ ) {
+		values.clear();
+		for( const CDocument& document : documents ) {
+			values.push_back( document.Stages[s].Wall );
+		}
+		output << ",\n\t\t\"" << stageName( TStage( s ) ) << "\": ";
+		writePercentiles( output, values );
+	}
+	output << "\n\t}\n}\n";
+	if( !output.good() ) {
+		throw CException( "Cannot write statistics `" + filename + "`." );
+	}
+}
+
+void CStatistics::writeMeasure( ostream& output, const CMeasure& measure )
+{
+	output << "{ \"wall\": " << measure.Wall << ", \"cpu\": " << measure.Cpu
+		<< ", \"allocations\": " << measure.Allocations
+		<< ", \"peak_live_bytes\": " << measure.PeakLiveBytes
+		<< ", \"live_bytes\": " << measure.LiveBytes
+		<< ", \"peak_rss_bytes\": " << measure.PeakRss << " }";
+}
+
+void CStatistics::writeCounters( ostream& output, const array<size_t, C_Count>& counters )
+{
+	output << "{";
+	for( size_t c = 0; c < C_Count; c++ ) {
+		output << ( c > 0 ? ", " : " " ) << "\"" << counterName( TCounter( c ) ) << "\": "
+			<< counters[c];
+	}
+	output << " }";
+}
+
+// Nearest-rank percentiles of wall time.
+void CStatistics::writePercentiles( ostream& output, vector<double> values )
+{
+	sort( values.begin(), values.end() );
+	auto percentile = [&values]( size_t percent )
+	{
+		if( values.empty() ) {
+			return 0.0;
+		}
+		const size_t rank = ( percent * values.size() + 99 ) / 100;
+		return values[max<size_t>( rank, 1 ) - 1];
+	};
+	output << "{ \"p50\": " << percentile( 50 ) << ", \"p90\": " << percentile( 90 )
+		<< ", \"p99\": " << percentile( 99 ) << ", \"max\": " << percentile( 100 ) << " }";
+}
+
+const char* CStatistics::stageName( TStage stage )
+{
+	switch( stage ) {
+		case S_Prepare:
+			return "prepare";
+		case S_Dedupe:
+			return "dedupe";
+		case S_LemmaCache:
+			return "lemma_cache";
+		case S_Mystem:
+			return "mystem";
+		case S_Parse:
+			return "parse";
+		case S_EntitiesRead:
+			return "entities_read";
+		case S_EntitiesTagging:
+			return "entities_tagging";
+		case S_TokensCache:
+			return "tokens_cache";
+		case S_Match:
+			return "match";
+		case S_Write:
+			return "write";
+		default:
+			break;
+	}
+	throw logic_error( "CStatistics::stageName" );
+}
+
+const char* CStatistics::counterName( TCounter counter )
+{
+	switch( counter ) {
+		case C_Bytes:
+			return "bytes";
+		case C_Tokens:
+			return "tokens";
+		case C_Entities:
+			return "entities";
+		case C_DictionaryHits:
+			return "dictionary_hits";
+		case C_TemplateMatches:
+			return "template_matches";
+		case C_Occupations:
+			return "occupations";
+		case C_DictionaryShifts:
+			return "dictionary_shifts";
+		case C_DictionaryBacktracks:
+			return "dictionary_backtracks";
+		case C_TemplateShifts:
+			return "template_shifts";
+		case C_TemplateBacktracks:
+			return "template_backtracks";
+		case C_MystemBytes:
+			return "mystem_bytes";
+		case C_LemmaCacheLookups:
+			return "lemma_cache_lookups";
+		case C_LemmaCacheHits:
+			return "lemma_cache_hits";
+		case C_Duplicates:
+			return "duplicates";
+		case C_NearDuplicates:
+			return "near_duplicates";
+		case C_ReusedTokens:
+			return "reused_tokens";
+		case C_OverBudget:
+			return "over_budget";
+		default:
+			break;
+	}
+	throw logic_error( "CStatistics::counterName" );
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Move tokens of the rest text of CLemmaCache::Split to their offsets
+// in the text and merge them into the tokens of the text.
+void MergeRestTokens( CTokens& restTokens, const vector<pair<size_t, size_t>>& restPieces,
+	CTokens& tokens )
+{
+	auto piece = restPieces.cbegin();
+	for( CToken& token : restTokens ) {
+		while( next( piece ) != restPieces.cend() && next( piece )->first <= token.Begin ) {
+			++piece;
+		}
+		token.Begin = token.Begin - piece->first + piece->second;
+		token.End = token.End - piece->first + piece->second;
+	}
+	CTokens cachedTokens = move( tokens );
+	tokens.clear();
+	tokens.reserve( cachedTokens.size() + restTokens.size() );
+	merge( make_move_iterator( cachedTokens.begin() ), make_move_iterator( cachedTokens.end() ),
+		make_move_iterator( restTokens.begin() ), make_move_iterator( restTokens.end() ),
+		back_inserter( tokens ), []( const CToken& token1, const CToken& token2 )
+	{
+		return token1.Begin < token2.Begin;
+	} );
+}
+
+// Output of mystem for prepared text without analysis, which is parsed
+// to the words of the text without lemmas.
+string RawMystemOutput( const string& text )
+{
+	string output;
+	for( const char c : text ) {
+		if( c == ' ' ) {
+			output += '_';
+		} else if( c == '\n' ) {
+			output += "\\n";
+		} else {
+			output += c;
+		}
+	}
+	return output + '\n';
+}
+
+// Tokens of prepared text made by mystem, if the budget of the document
+// is overrun they are words without lemmas and false is returned.
+bool AnalyzeTextByMystem( const string& text, const string& name, CTokens& tokens,
+	const CMystem& mystem, CStatistics& statistics )
+{
+	// processes of several hosts may share the directory (see --shard)
+	static const string tempFilename = "temp-" + ProcessUniqueName();
+	const string tempFilename1 = tempFilename + "-1.txt";
+	const string tempFilename2 = tempFilename + "-2.txt";
+	string outputFilename;
+	if( mystem.Budget() == nullptr || mystem.Budget()->Fits( text.length() ) ) {
+		{
+			ofstream textFile( tempFilename1, ios::out | ios::binary );
+			textFile << text;
+		}
+		statistics.Add( CStatistics::C_MystemBytes, text.length() );
+		statistics.Stage( CStatistics::S_Mystem );
+		outputFilename = mystem.Analyze( tempFilename1, tempFilename2 );
+	}
+
+	// extract tokens
+	statistics.Stage( CStatistics::S_Parse );
+	if( outputFilename.empty() ) {
+		istringstream rawOutput( RawMystemOutput( text ) );
+		tokens.Parse( rawOutput, name );
+	} else {
+		tokens.Parse( outputFilename );
+	}
+	remove( tempFilename1.c_str() );
+	remove( tempFilename2.c_str() );
+	return !outputFilename.empty();
+}
+
+// Tokens of prepared text made by mystem or by the lemma cache,
+// name is used in errors.
+void AnalyzeText( const string& text, const string& name, CTokens& tokens,
+	const CMystem& mystem, CStatistics& statistics )
+{
+	CLemmaCache* const lemmaCache = mystem.LemmaCache();
+	if( lemmaCache == nullptr ) {
+		AnalyzeTextByMystem( text, name, tokens, mystem, statistics );
+	} else {
+		// only sentences with forms which are not cached are analyzed by mystem
+		statistics.Stage( CStatistics::S_LemmaCache );
+		const size_t lookups = lemmaCache->Lookups();
+		const size_t hits = lemmaCache->Hits();
+		string cachedOutput;
+		string restText;
+		vector<pair<size_t, size_t>> restPieces;
+		lemmaCache->Split( text, mystem.LemmaCacheWholeText(), cachedOutput,
+			restText, restPieces );
+		statistics.Add( CStatistics::C_LemmaCacheLookups, lemmaCache->Lookups() - lookups );
+		statistics.Add( CStatistics::C_LemmaCacheHits, lemmaCache->Hits() - hits );
+		statistics.Stage( CStatistics::S_Parse );
+		istringstream cachedOutputStream( cachedOutput );
+		tokens.Parse( cachedOutputStream, name );
+
+		if( !restText.empty() ) {
+			CTokens restTokens;
+			const bool analyzed = AnalyzeTextByMystem( restText, name, restTokens, mystem,
+				statistics );
+			statistics.Stage( CStatistics::S_LemmaCache );
+			if( analyzed ) {
+				lemmaCache->Learn( restTokens );
+			}
+			MergeRestTokens( restTokens, restPieces, tokens );
+		}
+	}
+}
+
+// Tokens of a document made by mystem. Tokens of a duplicate of a document
+// of the dedupe index are its tokens, only sentences of a near duplicate
+// which are absent in the indexed document are analyzed. Returns the base
+// filename of the duplicate or an empty string.
+string ParseTokens( const string& baseFilename, CTokens& tokens, const CMystem& mystem,
+	CStatistics& statistics )
+{
+	statistics.Stage( CStatistics::S_Prepare );
+	const string text = PrepareText( baseFilename + ".txt" );
+	CDedupeIndex* const dedupeIndex = mystem.DedupeIndex();
+	if( dedupeIndex == nullptr ) {
+		AnalyzeText( text, baseFilename + ".txt", tokens, mystem, statistics );
+		return "";
+	}
+
+	statistics.Stage( CStatistics::S_Dedupe );
+	const CDedupeIndex::CFingerprint fingerprint = CDedupeIndex::Fingerprint( text );
+	string restText;
+	vector<pair<size_t, size_t>> restPieces;
+	string source;
+	const CDedupeIndex::TMatch match = dedupeIndex->Find( fingerprint, text, tokens,
+		restText, restPieces, source );
+	if( match == CDedupeIndex::M_None ) {
+		AnalyzeText( text, baseFilename + ".txt", tokens, mystem, statistics );
+	} else {
+		statistics.Add( match == CDedupeIndex::M_Duplicate ? CStatistics::C_Duplicates
+			: CStatistics::C_NearDuplicates, 1 );
+		statistics.Add( CStatistics::C_ReusedTokens, tokens.size() );
+		if( !restText.empty() ) {
+			CTokens restTokens;
+			AnalyzeText( restText, baseFilename + ".txt", restTokens, mystem, statistics );
+			statistics.Stage( CStatistics::S_Dedupe );
+			MergeRestTokens( restTokens, restPieces, tokens );
+		}
+	}
+	statistics.Stage( CStatistics::S_Dedupe );
+	if( mystem.Budget() == nullptr || !mystem.Budget()->IsOverrun() ) {
+		dedupeIndex->Add( baseFilename, fingerprint, tokens );
+	}
+	return ( match == CDedupeIndex::M_Duplicate ) ? source : "";
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+class COccupations : public vector<COccupation> {
+public:
+	void Fill( const CTokens& tokens, const CVariantDefs& variantDefs,
+		const CFinder::CMatches& matches, const vector<size_t>& substitutedTokens );
+	void Write( const string& filename, const CUtf8TextFile& sourceFile ) const;
+};
+
+void COccupations::Fill( const CTokens& tokens, const CVariantDefs& variantDefs,
+	const CFinder::CMatches& matches, const vector<size_t>& substitutedTokens )
+{
+	clear();
+	vector<CInterval> matchedTokens;
+	for( const CFinder::CMatch& match : matches ) {
+		// add occupation
+		if( substitutedTokens.empty() ) {
+			push_back( variantDefs.Occupation( match.Dictionary, tokens.cbegin() + match.Begin ) );
+		} else {
+			matchedTokens.clear();
+			for( size_t i = match.Begin; i < match.End; i++ ) {
+				matchedTokens.emplace_back( tokens[substitutedTokens[i]].Begin,
+					tokens[substitutedTokens[i + 1] - 1].End );
+			}
+			push_back( variantDefs.Occupation( match.Dictionary, matchedTokens.cbegin() ) );
+		}
+	}
+}
+
+void COccupations::Write( const string& filename, const CUtf8TextFile& sourceFile ) const
+{
+	CDocumentOutput outputFile( filename );
+	ostream& output = outputFile.Stream();
+	for( const COccupation& occupation : *this ) {
+		occupation.Write( output, sourceFile );
+		output << "\n";
+	}
+	outputFile.Close();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Destination of occupations of documents (see --output): files .task3 (and
+// files of --templates) of each document or one stream of records of all
+// documents, which is written to a file or to stdout ("-") in large chunks
+// in the order of documents.
+// A JSON Lines record is an occupation with the document (its base filename),
+// the set of templates, the variant and fields with character offsets
+// in the text and the text. The binary stream starts with BinaryMagic
+// or BinaryTextMagic and each record is a set of templates of a document:
+// the document, the set and the number of occupations, then for each
+// occupation the variant and the begin and the end of who, where and job
+// (0 and 0 if the field is empty). Strings are a 32-bit size and bytes,
+// numbers are 32-bit little-endian. With BinaryTextMagic texts of who,
+// where and job follow the offsets of each occupation.
+class COccupationsSink {
+public:
+	enum TFormat {
+		F_Task3,
+		F_JsonLines,
+		F_Binary,
+		F_BinaryText
+	};
+	static TFormat ParseFormat( const string& name );
+	static const char* const BinaryMagic;
+	static const char* const BinaryTextMagic;
+
+	COccupationsSink( TFormat format, const string& filename );
+	~COccupationsSink() { flush(); }
+
+	bool IsStdout() const { return ( format != F_Task3 && filename == "-" ); }
+	TFormat Format() const { return format; }
+
+	void Write( const string& baseFilename, const string& setName,
+		const COccupations& occupations, const CUtf8TextFile& sourceFile );
+	// Write buffered records.
+	void Close();
+
+private:
+	// Size of chunks of streams.
+	static const size_t BufferSize = 1 << 20;
+
+	const TFormat format;
+	const string filename;
+	ofstream file;
+	ostream* output;
+	ostringstream buffer;
+
+	void writeJsonField( const char* name, const CInterval& interval,
+		const CUtf8TextFile& sourceFile );
+	void writeBinaryString( const string& text );
+	void writeBinaryNumber( size_t number );
+	void flush();
+};
+
+const char* const COccupationsSink::BinaryMagic = "OCCREC01";
+const char* const COccupationsSink::BinaryTextMagic = "OCCRECT1";
+
+COccupationsSink::TFormat COccupationsSink::ParseFormat( const string& name )
+{
+	if( name == "task3" ) {
+		return F_Task3;
+	} else if( name == "jsonl" ) {
+		return F_JsonLines;
+	} else if( name == "binary" ) {
+		return F_Binary;
+	} else if( name == "binary-text" ) {
+		return F_BinaryText;
+	}
+	throw CException( "Unknown output format `" + name + "`." );
+}
+
+COccupationsSink::COccupationsSink( TFormat _format, const string& _filename ) :
+	format( _format ),
+	filename( _filename ),
+	output( nullptr )
+{
+	if( format == F_Task3 ) {
+		return;
+	}
+	if( filename == "-" ) {
+#ifdef _WIN32
+		_setmode( _fileno( stdout ), _O_BINARY );
+#endif
+		output = &cout;
+	} else {
+		file.open( filename, ios::out | ios::binary );
+		if( !file.good() ) {
+			throw CException( "Cannot write file `" + filename + "`." );
+		}
+		output = &file;
+	}
+	if( format == F_Binary ) {
+		buffer << BinaryMagic;
+	} else if( format == F_BinaryText ) {
+		buffer << BinaryTextMagic;
+	}
+}
+
+void COccupationsSink::Write( const string& baseFilename, const string& setName,
+	const COccupations& occupations, const CUtf8TextFile& sourceFile )
+{
+	switch( format ) {
+		case F_Task3:
+			occupations.Write( baseFilename + "." + setName, sourceFile );
+			return;
+		case F_JsonLines:
+			for( const COccupation& occupation : occupations ) {
+				buffer << "{ \"document\": " << JsonString( baseFilename )
+					<< ", \"set\": " << JsonString( setName )
+					<< ", \"variant\": " << occupation.Variant;
+				writeJsonField( "who", occupation.Who, sourceFile );
+				writeJsonField( "where", occupation.Where, sourceFile );
+				writeJsonField( "job", occupation.Job, sourceFile );
+				buffer << " }\n";
+			}
+			break;
+		case F_Binary:
+		case F_BinaryText:
+			writeBinaryString( baseFilename );
+			writeBinaryString( setName );
+			writeBinaryNumber( occupations.size() );
+			for( const COccupation& occupation : occupations ) {
+				writeBinaryNumber( occupation.Variant );
+				for( const CInterval* field : { &occupation.Who, &occupation.Where, &occupation.Job } ) {
+					writeBinaryNumber( field->Defined() ? field->Begin : 0 );
+					writeBinaryNumber( field->Defined() ? field->End : 0 );
+				}
+				if( format == F_BinaryText ) {
+					for( const CInterval* field : { &occupation.Who, &occupation.Where, &occupation.Job } ) {
+						writeBinaryString( field->Defined() ? sourceFile.Text( *field ) : "" );
+					}
+				}
+			}
+			break;
+		default:
+			throw logic_error( "COccupationsSink::Write" );
+	}
+	if( static_cast<size_t>( buffer.tellp() ) >= BufferSize ) {
+		flush();
+	}
+}
+
+void COccupationsSink::Close()
+{
+	flush();
+	if( output != nullptr && !output->flush().good() ) {
+		throw CException( "Cannot write file `" + filename + "`." );
+	}
+}
+
+void COccupationsSink::writeJsonField( const char* name, const CInterval& interval,
+	const CUtf8TextFile& sourceFile )
+{
+	buffer << ", \"" << name << "\": ";
+	if( interval.Defined() ) {
+		buffer << "{ \"begin\": " << interval.Begin << ", \"end\": " << interval.End
+			<< ", \"text\": " << JsonString( sourceFile.Text( interval ) ) << " }";
+	} else {
+		buffer << "null";
+	}
+}
+
+void COccupationsSink::writeBinaryString( const string& text )
+{
+	writeBinaryNumber( text.size() );
+	buffer << text;
+}
+
+void COccupationsSink::writeBinaryNumber( size_t number )
+{
+	const uint32_t value = static_cast<uint32_t>( number );
+	const char bytes[4] = { static_cast<char>( value ), static_cast<char>( value >> 8 ),
+		static_cast<char>( value >> 16 ), static_cast<char>( value >> 24 ) };
+	buffer.write( bytes, sizeof( bytes ) );
+}
+
+void COccupationsSink::flush()
+{
+	if( output != nullptr ) {
+		const string chunk = buffer.str();
+		output->write( chunk.data(), chunk.size() );
+		buffer.str( "" );
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Profile of templates: matches, prefix matches and lookups of prefixes
+// of each variant of templates and of each line of templates files.
+// A lookup of a prefix by CFinder is attributed to all variants starting with
+// the prefix (or with the prefix without the last word if it was missed):
+// each of them gets a prefix match if the prefix is found and is shorter than
+// the variant, and an equal share of the lookup.
+class CTemplatesProfile {
+public:
+	enum TSortColumn {
+		SC_Matches,
+		SC_PrefixMatches,
+		SC_Lookups
+	};
+
+	CTemplatesProfile() :
+		lookupsCount( 0 )
+	{
+	}
+
+	static TSortColumn ParseSortColumn( const string& name );
+
+	void AddSet( const string& name, const CTemplatesSource& source,
+		const CDictionaries& templates );
+	void AddMatches( size_t set, const CFinder::CMatches& matches,
+		const CFinder::CPrefixLookups& lookups );
+	// Write report in TSV sorted by the column in descending order.
+	void Write( const string& filename, TSortColumn sortColumn ) const;
+
+private:
+	struct CCounts {
+		size_t Matches;
+		size_t PrefixMatches;
+		double Lookups;
+
+		CCounts() :
+			Matches( 0 ),
+			PrefixMatches( 0 ),
+			Lookups( 0 )
+		{
+		}
+	};
+	struct CSet {
+		string Name;
+		const CTemplatesSource* Source;
+		vector<size_t> VariantsLengths;
+		// variants starting with a prefix
+		unordered_map<CDictionaries::CWords, vector<size_t>> PrefixVariants;
+		vector<CCounts> Variants;
+	};
+	vector<CSet> sets;
+	size_t lookupsCount;
+};
+
+CTemplatesProfile::TSortColumn CTemplatesProfile::ParseSortColumn( const string& name )
+{
+	if( name == "matches" ) {
+		return SC_Matches;
+	} else if( name == "prefix_matches" ) {
+		return SC_PrefixMatches;
+	} else if( name == "lookups" ) {
+		return SC_Lookups;
+	}
+	throw CException( "Unknown profile column `" + name + "`." );
+}
+
+void CTemplatesProfile::AddSet( const string& name, const CTemplatesSource& source,
+	const CDictionaries& templates )
+{
+	sets.emplace_back();
+	CSet& set = sets.back();
+	set.Name = name;
+	set.Source = &source;
+	set.Variants.resize( source.Variants.size() );
+	for( size_t variant = 0; variant < source.Variants.size(); variant++ ) {
+		const CDictionaries::CWords words = templates.Words( source.Variants[variant].second );
+		set.VariantsLengths.push_back( words.size() );
+		for( size_t length = 1; length <= words.size(); length++ ) {
+			set.PrefixVariants[words.substr( 0, length )].push_back( variant );
+		}
+	}
+}
+
+void CTemplatesProfile::AddMatches( size_t setIndex, const CFinder::CMatches& matches,
+	const CFinder::CPrefixLookups& lookups )
+{
+	CSet& set = sets[setIndex];
+	for( const CFinder::CMatch& match : matches ) {
+		set.Variants[match.Dictionary - 1].Matches++;
+	}
+	for( const pair<const CDictionaries::CWords, CFinder::CLookups>& prefix : lookups ) {
+		lookupsCount += prefix.second.Found + prefix.second.Missed;
+		auto found = set.PrefixVariants.find( prefix.first );
+		if( found != set.PrefixVariants.end() ) {
+			for( const size_t variant : found->second ) {
+				CCounts& counts = set.Variants[variant];
+				if( prefix.first.length() < set.VariantsLengths[variant] ) {
+					counts.PrefixMatches += prefix.second.Found;
+				}
+				counts.Lookups += static_cast<double>( prefix.second.Found ) / found->second.size();
+			}
+		}
+		auto missed = set.PrefixVariants.find(
+			prefix.first.substr( 0, prefix.first.length() - 1 ) );
+		if( prefix.second.Missed > 0 && missed != set.PrefixVariants.end() ) {
+			for( const size_t variant : missed->second ) {
+				set.Variants[variant].Lookups +=
+					static_cast<double>( prefix.second.Missed ) / missed->second.size();
+			}
+		}
+	}
+}
+
+void CTemplatesProfile::Write( const string& filename, TSortColumn sortColumn ) const
+{
+	struct CRow {
+		size_t Set;
+		size_t Line;
+		size_t Variant; // 0 for a line
+		CCounts Counts;
+	};
+	vector<CRow> rows;
+	for( size_t setIndex = 0; setIndex < sets.size(); setIndex++ ) {
+		const CSet& set = sets[setIndex];
+		vector<CRow> lineRows( set.Source->Lines.size() );
+		for( size_t line = 0; line < lineRows.size(); line++ ) {
+			lineRows[line].Set = setIndex;
+			lineRows[line].Line = line;
+			lineRows[line].Variant = 0;
+		}
+		for( size_t variant = 0; variant < set.Variants.size(); variant++ ) {
+			const CCounts& counts = set.Variants[variant];
+			const size_t line = set.Source->Variants[variant].first;
+			rows.push_back( CRow{ setIndex, line, variant + 1, counts } );
+			lineRows[line].Counts.Matches += counts.Matches;
+			lineRows[line].Counts.PrefixMatches += counts.PrefixMatches;
+			lineRows[line].Counts.Lookups += counts.Lookups;
+		}
+		for( const CRow& row : lineRows ) {
+			if( !set.Source->Lines[row.Line].empty() ) {
+				rows.push_back( row );
+			}
+		}
+	}
+
+	auto value = [sortColumn]( const CRow& row )
+	{
+		switch( sortColumn ) {
+			case SC_Matches:
+				return static_cast<double>( row.Counts.Matches );
+			case SC_PrefixMatches:
+				return static_cast<double>( row.Counts.PrefixMatches );
+			case SC_Lookups:
+				break;
+		}
+		return row.Counts.Lookups;
+	};
+	stable_sort( rows.begin(), rows.end(), [&value]( const CRow& row1, const CRow& row2 )
+	{
+		return value( row1 ) > value( row2 );
+	} );
+
+	ofstream output( filename );
+	output << "set\tline\tvariant\tmatches\tprefix_matches\tlookups\tlookups_share\ttemplate\n";
+	for( const CRow& row : rows ) {
+		const CSet& set = sets[row.Set];
+		output << set.Name << "\t" << row.Line + 1 << "\t";
+		if( row.Variant == 0 ) {
+			output << "-";
+		} else {
+			output << row.Variant;
+		}
+		output << "\t" << row.Counts.Matches << "\t" << row.Counts.PrefixMatches
+			<< "\t" << fixed << setprecision( 1 ) << row.Counts.Lookups
+			<< "\t" << setprecision( 6 )
+			<< ( lookupsCount > 0 ? row.Counts.Lookups / lookupsCount : 0.0 ) << "\t";
+		if( row.Variant == 0 ) {
+			output << set.Source->Lines[row.Line];
+		} else {
+			string variant = set.Source->Variants[row.Variant - 1].second;
+			variant.erase( variant.find_last_not_of( ' ' ) + 1 );
+			output << ( TextEncoding == TE_Utf8 ? variant : ConvertWindows1251ToUtf8( variant ) );
+		}
+		output << "\n";
+	}
+	if( !output.good() ) {
+		throw CException( "Cannot write templates profile `" + filename + "`." );
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Independent named sets of templates matched over the same tokens in one pass.
+// Occupations of each set are written to the file with the set name extension.
+class CTemplateSets {
+public:
+	CTemplateSets()
+	{
+	}
+
+	size_t Size() const { return sets.size(); }
+	const string& Name( size_t index ) const { return sets[index].Name; }
+	const CTemplatesSource& Source( size_t index ) const { return sets[index].Source; }
+	void Add( const string& name, const string& templatesFilename );
+	// Dictionaries which matches are substituted by @N lexems before templates,
+	// the key identifies the dictionaries in caches of their matches.
+	void SetDictionaries( const CDictionaries& dictionaries, const string& key = "" );
+	bool HasDictionaries() const { return matcher.HasSubstitutions(); }
+	const string& DictionariesKey() const { return dictionariesKey; }
+	// Add all sets to the profile, Fill collects lookups for it.
+	void StartProfile( CTemplatesProfile& profile );
+	// Matches of the dictionaries are added to substitutionMatches.
+	void Fill( const CTokens& tokens, const size_t threadsCount,
+		vector<COccupations>& occupations, CMatcher::CCounters* counters = nullptr,
+		CTemplatesProfile* profile = nullptr,
+		CFinder::CMatches* substitutionMatches = nullptr ) const;
+	// Fill with known matches of the dictionaries, see CMatcher::FindSubstituted.
+	void FillSubstituted( const CTokens& tokens, const CFinder::CMatches& substitutionMatches,
+		const size_t threadsCount, vector<COccupations>& occupations,
+		CMatcher::CCounters* counters = nullptr, CTemplatesProfile* profile = nullptr ) const;
+	// See CMatcher::FinalBound.
+	size_t FinalBound( const CTokens& tokens, size_t begin, size_t end ) const
+	{
+		return matcher.FinalBound( tokens, begin, end );
+	}
+
+private:
+	struct CTemplateSet {
+		string Name;
+		CDictionaries Templates;
+		CVariantDefs VariantDefs;
+		CTemplatesSource Source;
+	};
+	// deque keeps addresses of templates used by matcher
+	deque<CTemplateSet> sets;
+	CMatcher matcher;
+	string dictionariesKey;
+
+	void fill( const CTokens& tokens, const vector<CFinder::CMatches>& matches,
+		const vector<size_t>& substitutedTokens, const CMatcher::CCounters& findCounters,
+		vector<COccupations>& occupations, CMatcher::CCounters* counters,
+		CTemplatesProfile* profile ) const;
+};
+
+void CTemplateSets::Add( const string& name, const string& templatesFilename )
+{
+	if( name.empty() || name.find_first_of( "\\/.:" ) != string::npos ) {
+		throw CException( "Invalid templates name `" + name + "`." );
+	}
+	// the first set is the main one, its occupations are written to .task3,
+	// other sets must not overwrite files of documents and caches
+	const char* const reservedNames[] = { "txt", "spans", "objects", "facts", "task3" };
+	if( !sets.empty() && ( name.compare( 0, 6, "todua-" ) == 0
+		|| find( begin( reservedNames ), end( reservedNames ), name ) != end( reservedNames ) ) )
+	{
+		throw CException( "Templates name `" + name + "` is reserved for files of documents." );
+	}
+	for( const CTemplateSet& templateSet : sets ) {
+		if( templateSet.Name == name ) {
+			throw CException( "Duplicate templates name `" + name + "`." );
+		}
+	}
+
+	sets.emplace_back();
+	sets.back().Name = name;
+	LoadTemplates( templatesFilename, sets.back().Templates,
+		sets.back().VariantDefs, &sets.back().Source );
+	SetUpMatcher( sets.back().Templates, "templates `" + templatesFilename + "`" );
+	matcher.Add( sets.back().Templates );
+}
+
+void CTemplateSets::SetDictionaries( const CDictionaries& dictionaries, const string& key )
+{
+	matcher.SetSubstitutions( dictionaries );
+	dictionariesKey = key;
+}
+
+void CTemplateSets::StartProfile( CTemplatesProfile& profile )
+{
+	for( const CTemplateSet& set : sets ) {
+		profile.AddSet( set.Name, set.Source, set.Templates );
+	}
+	matcher.SetProfiling( true );
+}
+
+void CTemplateSets::Fill( const CTokens& tokens, const size_t threadsCount,
+	vector<COccupations>& occupations, CMatcher::CCounters* counters,
+	CTemplatesProfile* profile, CFinder::CMatches* substitutionMatches ) const
+{
+	vector<CFinder::CMatches> matches;
+	vector<size_t> substitutedTokens;
+	CMatcher::CCounters findCounters;
+	matcher.Find( tokens, threadsCount, matches, substitutedTokens, &findCounters,
+		substitutionMatches );
+	fill( tokens, matches, substitutedTokens, findCounters, occupations, counters, profile );
+}
+
+void CTemplateSets::FillSubstituted( const CTokens& tokens,
+	const CFinder::CMatches& substitutionMatches, const size_t threadsCount,
+	vector<COccupations>& occupations, CMatcher::CCounters* counters,
+	CTemplatesProfile* profile ) const
+{
+	vector<CFinder::CMatches> matches;
+	vector<size_t> substitutedTokens;
+	CMatcher::CCounters findCounters;
+	matcher.FindSubstituted( tokens, substitutionMatches, threadsCount,
+		matches, substitutedTokens, &findCounters );
+	fill( tokens, matches, substitutedTokens, findCounters, occupations, counters, profile );
+}
+
+void CTemplateSets::fill( const CTokens& tokens, const vector<CFinder::CMatches>& matches,
+	const vector<size_t>& substitutedTokens, const CMatcher::CCounters& findCounters,
+	vector<COccupations>& occupations, CMatcher::CCounters* counters,
+	CTemplatesProfile* profile ) const
+{
+	if( counters != nullptr ) {
+		*counters += findCounters;
+	}
+
+	occupations.resize( sets.size() );
+	for( size_t i = 0; i < sets.size(); i++ ) {
+		occupations[i].Fill( tokens, sets[i].VariantDefs, matches[i], substitutedTokens );
+		if( profile != nullptr ) {
+			profile->AddMatches( i, matches[i], i < findCounters.Lookups.size()
+				? findCounters.Lookups[i] : CFinder::CPrefixLookups() );
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Evaluation of extracted occupations against gold Occupation facts of
+// factRuEval-2016 (BASE.facts) by the rules of its scorer t3_eval.py.
+// A gold field may have several values: texts of referenced objects and
+// spans (objN, spanN of .objects and .spans) and alternatives of the text
+// after them divided by `|`. Values are compared as written, only runs of
+// white space are collapsed. A pair of facts has two scores: the share of
+// matched fields among the fields of the extracted fact (TP1) and among
+// the fields of the gold fact (TP2). Pairs are taken one-to-one with
+// the maximum sum of scores. Precision is the sum of TP1 divided by
+// the number of extracted facts, recall is the sum of TP2 divided by
+// the number of gold facts.
+class CEvaluation {
+public:
+	struct CScore {
+		// variant of templates of the extracted fact
+		size_t Variant;
+		double Tp1;
+		double Tp2;
+	};
+	// Scores of a document.
+	struct CDocument {
+		size_t GoldFacts;
+		// scores of each extracted fact
+		vector<CScore> Facts;
+
+		CDocument() :
+			GoldFacts( 0 )
+		{
+		}
+	};
+
+	explicit CEvaluation( const CTemplatesSource& source );
+
+	// Can be called by several threads.
+	static CDocument Evaluate( const string& baseFilename, const COccupations& occupations );
+
+	void Add( const CDocument& document );
+	// Write totals and scores of each line of templates.
+	void Write( ostream& output ) const;
+
+private:
+	enum TField {
+		F_Who,
+		F_Where,
+		F_Job,
+		F_Count
+	};
+	// values of each field, no values if the field is absent
+	typedef array<vector<string>, F_Count> CFact;
+	struct CLine {
+		size_t Facts;
+		double Tp1;
+		double Tp2;
+	};
+
+	const CTemplatesSource& source;
+	size_t documentsCount;
+	size_t goldFacts;
+	// extracted facts and sums of their scores of each line of templates
+	vector<CLine> lines;
+
+	static vector<CFact> readGold( const string& baseFilename, const CUtf8TextFile& text );
+	static size_t fieldsCount( const CFact& fact );
+	static size_t matchedFields( const CFact& gold, const CFact& extracted );
+	static vector<size_t> assignment( const vector<vector<double>>& weights );
+	static string normalize( const string& text );
+	static void writeScores( ostream& output, const CLine& line, size_t goldFacts );
+};
+
+CEvaluation::CEvaluation( const CTemplatesSource& _source ) :
+	source( _source ),
+	documentsCount( 0 ),
+	goldFacts( 0 ),
+	lines( source.Lines.size(), CLine{ 0, 0.0, 0.0 } )
+{
+}
+
+CEvaluation::CDocument CEvaluation::Evaluate( const string& baseFilename,
+	const COccupations& occupations )
+{
+	const CUtf8TextFile text( baseFilename + ".txt" );
+	const vector<CFact> gold = readGold( baseFilename, text );
+	vector<CFact> extracted;
+	for( const COccupation& occupation : occupations ) {
+		CFact fact;
+		fact[F_Who].push_back( normalize( text.Text( occupation.Who ) ) );
+		if( occupation.Where.Defined() ) {
+			fact[F_Where].push_back( normalize( text.Text( occupation.Where ) ) );
+		}
+		if( occupation.Job.Defined() ) {
+			fact[F_Job].push_back( normalize( text.Text( occupation.Job ) ) );
+		}
+		extracted.push_back( fact );
+	}
+
+	CDocument document;
+	document.GoldFacts = gold.size();
+	vector<vector<double>> tp1( extracted.size(), vector<double>( gold.size(), 0.0 ) );
+	vector<vector<double>> tp2 = tp1;
+	vector<vector<double>> weights = tp1;
+	for( size_t e = 0; e < extracted.size(); e++ ) {
+		for( size_t g = 0; g < gold.size(); g++ ) {
+			const size_t matched = matchedFields( gold[g], extracted[e] );
+			if( matched > 0 ) {
+				tp1[e][g] = static_cast<double>( matched ) / fieldsCount( extracted[e] );
+				tp2[e][g] = static_cast<double>( matched ) / fieldsCount( gold[g] );
+				weights[e][g] = tp1[e][g] + tp2[e][g];
+			}
+		}
+	}
+	const vector<size_t> pairs = assignment( weights );
+	for( size_t e = 0; e < extracted.size(); e++ ) {
+		const size_t g = pairs[e];
+		const bool matched = ( g < gold.size() );
+		document.Facts.push_back( CScore{ occupations[e].Variant,
+			matched ? tp1[e][g] : 0.0, matched ? tp2[e][g] : 0.0 } );
+	}
+	return document;
+}
+
+void CEvaluation::Add( const CDocument& document )
+{
+	documentsCount++;
+	goldFacts += document.GoldFacts;
+	for( const CScore& fact : document.Facts ) {
+		if( fact.Variant == 0 || fact.Variant > source.Variants.size() ) {
+			throw logic_error( "CEvaluation::Add" );
+		}
+		CLine& line = lines[source.Variants[fact.Variant - 1].first];
+		line.Facts++;
+		line.Tp1 += fact.Tp1;
+		line.Tp2 += fact.Tp2;
+	}
+}
+
+void CEvaluation::Write( ostream& output ) const
+{
+	CLine total{ 0, 0.0, 0.0 };
+	for( const CLine& line : lines ) {
+		total.Facts += line.Facts;
+		total.Tp1 += line.Tp1;
+		total.Tp2 += line.Tp2;
+	}
+	output << "documents: " << documentsCount << endl;
+	output << "type\tP\tR\tF1\tTP1\tTP2\tIn Std.\tIn Test." << endl;
+	output << "overall\t";
+	writeScores( output, total, goldFacts );
+	output << endl << endl;
+	output << "line\tP\tR\tF1\tTP1\tTP2\tIn Std.\tIn Test.\ttemplate" << endl;
+	for( size_t line = 0; line < lines.size(); line++ ) {
+		if( !source.Lines[line].empty() ) {
+			output << line + 1 << "\t";
+			writeScores( output, lines[line], goldFacts );
+			output << "\t" << source.Lines[line] << endl;
+		}
+	}
+}
+
+void CEvaluation::writeScores( ostream& output, const CLine& line, size_t goldFactsCount )
+{
+	const double precision = ( line.Facts > 0 ) ? line.Tp1 / line.Facts : 0;
+	const double recall = ( goldFactsCount > 0 ) ? line.Tp2 / goldFactsCount : 0;
+	const double f1 = ( precision + recall > 0 )
+		? 2 * precision * recall / ( precision + recall ) : 0;
+	output << fixed << setprecision( 4 ) << precision << "\t" << recall << "\t" << f1
+		<< setprecision( 2 ) << "\t" << line.Tp1 << "\t" << line.Tp2
+		<< "\t" << goldFactsCount << "\t" << line.Facts;
+}
+
+vector<CEvaluation::CFact> CEvaluation::readGold( const string& baseFilename,
+	const CUtf8TextFile& text )
+{
+	const string spansFilename = baseFilename + ".spans";
+	const string objectsFilename = baseFilename + ".objects";
+	const string factsFilename = baseFilename + ".facts";
+	CDocumentInput spansFile( spansFilename );
+	istream& spans = spansFile.Stream();
+	if( !spans.good() ) {
+		throw CException( "File `" + spansFilename + "` not found." );
+	}
+	CDocumentInput objectsFile( objectsFilename );
+	istream& objects = objectsFile.Stream();
+	if( !objects.good() ) {
+		throw CException( "File `" + objectsFilename + "` not found." );
+	}
+	CDocumentInput factsFile( factsFilename );
+	istream& facts = factsFile.Stream();
+	if( !facts.good() ) {
+		throw CException( "File `" + factsFilename + "` not found." );
+	}
+
+	// intervals of spans and objects by references spanN and objN
+	unordered_map<string, CInterval> references;
+	string line;
+	while( getline( spans, line ) ) {
+		istringstream fields( line );
+		string id;
+		string ignore;
+		size_t offset;
+		size_t length;
+		if( fields >> id >> ignore >> offset >> length && offset + length <= text.Length() ) {
+			references["span" + id] = CInterval( offset, offset + length );
+		}
+	}
+	while( getline( objects, line ) ) {
+		istringstream fields( line );
+		string id;
+		string type;
+		string spanId;
+		CInterval interval;
+		fields >> id >> type;
+		while( fields >> spanId && isdigit( static_cast<unsigned char>( spanId[0] ) ) ) {
+			auto span = references.find( "span" + spanId );
+			if( span != references.end() ) {
+				interval.Begin = min( interval.Begin, span->second.Begin );
+				interval.End = max( interval.End, span->second.End );
+			}
+		}
+		if( interval.Defined() ) {
+			references["obj" + id] = interval;
+		}
+	}
+
+	// facts: `ID TYPE` followed by lines `FIELD [REFERENCE].. [TEXT [| TEXT]..]`
+	vector<CFact> gold;
+	bool isOccupation = false;
+	while( getline( facts, line ) ) {
+		istringstream fields( line );
+		string name;
+		if( !( fields >> name ) ) {
+			continue;
+		}
+		if( isdigit( static_cast<unsigned char>( name[0] ) ) ) {
+			string type;
+			fields >> type;
+			isOccupation = ( type == "Occupation" );
+			if( isOccupation ) {
+				gold.emplace_back();
+			}
+			continue;
+		}
+		TField field = F_Count;
+		if( name == "Who" ) {
+			field = F_Who;
+		} else if( name == "Where" ) {
+			field = F_Where;
+		} else if( name == "Position" || name == "Job" ) {
+			field = F_Job;
+		}
+		if( !isOccupation || field == F_Count ) {
+			continue;
+		}
+
+		vector<string>& values = gold.back()[field];
+		string word;
+		string rest;
+		while( fields >> word ) {
+			const size_t digitsPos = word.compare( 0, 3, "obj" ) == 0 ? 3
+				: ( word.compare( 0, 4, "span" ) == 0 ? 4 : string::npos );
+			if( rest.empty() && digitsPos < word.length()
+				&& isdigit( static_cast<unsigned char>( word[digitsPos] ) ) )
+			{
+				auto reference = references.find( word );
+				if( reference != references.end() ) {
+					values.push_back( normalize( text.Text( reference->second ) ) );
+				}
+			} else {
+				rest += word + " ";
+			}
+		}
+		istringstream alternatives( rest );
+		string alternative;
+		while( getline( alternatives, alternative, '|' ) ) {
+			alternative = normalize( alternative );
+			if( !alternative.empty() ) {
+				values.push_back( alternative );
+			}
+		}
+	}
+	return gold;
+}
+
+size_t CEvaluation::fieldsCount( const CFact& fact )
+{
+	return count_if( fact.cbegin(), fact.cend(), []( const vector<string>& values )
+	{
+		return !values.empty();
+	} );
+}
+
+// Fields of the extracted fact which value is one of the gold values.
+size_t CEvaluation::matchedFields( const CFact& gold, const CFact& extracted )
+{
+	size_t matched = 0;
+	for( size_t field = 0; field < F_Count; field++ ) {
+		for( const string& value : extracted[field] ) {
+			if( find( gold[field].cbegin(), gold[field].cend(), value ) != gold[field].cend() ) {
+				matched++;
+				break;
+			}
+		}
+	}
+	return matched;
+}
+
+// Column of each row of the weights (or the number of columns if the row
+// is not paired) with the maximum sum of weights, the Hungarian algorithm.
+vector<size_t> CEvaluation::assignment( const vector<vector<double>>& weights )
+{
+	const size_t rows = weights.size();
+	const size_t columns = rows > 0 ? weights.front().size() : 0;
+	const size_t n = max( rows, columns );
+	auto cost = [&]( size_t row, size_t column ) -> double
+	{
+		return ( row <= rows && column <= columns ) ? -weights[row - 1][column - 1] : 0.0;
+	};
+	const double infinity = numeric_limits<double>::infinity();
+	// potentials and the row of each column, the rows and columns are 1..n
+	vector<double> u( n + 1, 0.0 );
+	vector<double> v( n + 1, 0.0 );
+	vector<size_t> rowOf( n + 1, 0 );
+	vector<size_t> way( n + 1, 0 );
+	for( size_t row = 1; row <= n; row++ ) {
+		rowOf[0] = row;
+		size_t column = 0;
+		vector<double> minV( n + 1, infinity );
+		vector<bool> used( n + 1, false );
+		do {
+			used[column] = true;
+			const size_t currentRow = rowOf[column];
+			double delta = infinity;
+			size_t nextColumn = 0;
+			for( size_t j = 1; j <= n; j++ ) {
+				if( !used[j] ) {
+					const double reduced = cost( currentRow, j ) - u[currentRow] - v[j];
+					if( reduced < minV[j] ) {
+						minV[j] = reduced;
+						way[j] = column;
+					}
+					if( minV[j] < delta ) {
+						delta = minV[j];
+						nextColumn = j;
+					}
+				}
+			}
+			for( size_t j = 0; j <= n; j++ ) {
+				if( used[j] ) {
+					u[rowOf[j]] += delta;
+					v[j] -= delta;
+				} else {
+					minV[j] -= delta;
+				}
+			}
+			column = nextColumn;
+		} while( rowOf[column] != 0 );
+		do {
+			const size_t previousColumn = way[column];
+			rowOf[column] = rowOf[previousColumn];
+			column = previousColumn;
+		} while( column != 0 );
+	}
+	vector<size_t> columnOf( rows, columns );
+	for( size_t column = 1; column <= columns; column++ ) {
+		if( rowOf[column] <= rows ) {
+			columnOf[rowOf[column] - 1] = column - 1;
+		}
+	}
+	return columnOf;
+}
+
+// Text with runs of white space replaced by single spaces and trimmed.
+string CEvaluation::normalize( const string& text )
+{
+	string normalized;
+	for( const char c : text ) {
+		if( !isspace( static_cast<unsigned char>( c ) ) ) {
+			normalized += c;
+		} else if( !normalized.empty() && normalized.back() != ' ' ) {
+			normalized += ' ';
+		}
+	}
+	if( !normalized.empty() && normalized.back() == ' ' ) {
+		normalized.pop_back();
+	}
+	return normalized;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 
-struct CToken : public CInterval {
-	string Text;
-	string Lexem;
+// Name of the list of documents in a corpus directory.
+const char* const CorpusListFilename = "corpus.list";
+
+// Text and mystem output of a text which lemmas are the same as words.
+string FakeMystemOutput( string text )
+{
+	TextReplace( text, ReplacementsCP1251 );
+	string output;
+	size_t offset = 0;
+	while( offset < text.length() ) {
+		const bool isWord = IsCharAlphaOrDigit( text[offset] ) && !isdigit( text[offset] );
+		size_t end = offset;
+		while( end < text.length() && ( IsCharAlphaOrDigit( text[end] )
+			&& !isdigit( text[end] ) ) == isWord )
+		{
+			end++;
+		}
+		const string part = text.substr( offset, end - offset );
+		if( isWord ) {
+			output += part + "{" + part + "}\n";
+		} else {
+			for( char c : part ) {
+				if( c == ' ' ) {
+					output += '_';
+				} else if( c == '\n' ) {
+					output += "\\n";
+				} else {
+					output += c;
+				}
+			}
+			output += '\n';
+		}
+		offset = end;
+	}
+	return output;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Generates a synthetic corpus: documents in the input format (.txt, .spans,
+// .objects) with recorded output of mystem (see CMystem), so the documents
+// can be processed without mystem. Sentences consist of random pseudo-Russian words,
+// some of them contain a person, a line of a dictionary and an organization.
+class CCorpusGenerator {
+public:
+	explicit CCorpusGenerator( size_t seed );
+
+	// Lines of the dictionary are inserted in sentences with entities.
+	void AddDictionary( const string& dictionaryFilename );
+	// Writes documents DIRECTORY/NNNNNN.* and their list DIRECTORY/corpus.list.
+	void Generate( const string& directory, size_t documentsCount,
+		size_t documentSize, size_t entitiesPercent );
+
+private:
+	mt19937 random;
+	vector<string> vocabulary;
+	vector<string> phrases;
+	// current document, its text is in CP1251
+	string text;
+	ostringstream spans;
+	ostringstream objects;
+	size_t spansCount;
+	size_t objectsCount;
+
+	size_t randomIndex( size_t count );
+	string randomWord();
+	void addSpace();
+	void addEntity( const char* type, size_t wordsCount );
+	void addSentence( bool withEntities );
+	void writeDocument( const string& baseFilename, const CMystem& mystem ) const;
 };
 
+CCorpusGenerator::CCorpusGenerator( size_t seed ) :
+	random( static_cast<mt19937::result_type>( seed ) ),
+	spansCount( 0 ),
+	objectsCount( 0 )
+{
+	const size_t VocabularySize = 4096;
+	for( size_t i = 0; i < VocabularySize; i++ ) {
+		vocabulary.push_back( randomWord() );
+	}
+}
+
+void CCorpusGenerator::AddDictionary( const string& dictionaryFilename )
+{
+	ifstream dictionaryFile( dictionaryFilename );
+	if( !dictionaryFile.good() ) {
+		throw CException( "Cannot read dictionary `" + dictionaryFilename + "`." );
+	}
+	string line;
+	while( dictionaryFile.good() ) {
+		getline( dictionaryFile, line );
+		NormalizeDictionaryLine( line, TE_Cp1251 );
+		const vector<string> words = SplitString( line );
+		if( !words.empty() ) {
+			string phrase;
+			for( const string& word : words ) {
+				phrase += ( phrase.empty() ? "" : " " ) + word;
+			}
+			phrases.push_back( phrase );
+		}
+	}
+}
+
+void CCorpusGenerator::Generate( const string& directory, size_t documentsCount,
+	size_t documentSize, size_t entitiesPercent )
+{
+	const string listFilename = directory + "/" + CorpusListFilename;
+	ofstream list( listFilename );
+	CMystem mystem;
+	mystem.SetRecordings( CMystem::M_Record, directory );
+	for( size_t document = 1; document <= documentsCount; document++ ) {
+		text.clear();
+		spans.str( "" );
+		objects.str( "" );
+		spansCount = 0;
+		objectsCount = 0;
+		while( text.length() < documentSize ) {
+			addSentence( randomIndex( 100 ) < entitiesPercent );
+			text += ( randomIndex( 4 ) == 0 ) ? '\n' : ' ';
+		}
+		text += '\n';
+
+		ostringstream baseFilename;
+		baseFilename << setw( 6 ) << setfill( '0' ) << document;
+		writeDocument( directory + "/" + baseFilename.str(), mystem );
+		list << baseFilename.str() << endl;
+	}
+	if( !list.good() ) {
+		throw CException( "Cannot write `" + listFilename + "`." );
+	}
+}
+
+size_t CCorpusGenerator::randomIndex( size_t count )
+{
+	return uniform_int_distribution<size_t>( 0, count - 1 )( random );
+}
+
+string CCorpusGenerator::randomWord()
+{
+	// lower case CP1251 consonants and vowels
+	static const char consonants[] = "\xE1\xE2\xE3\xE4\xE6\xE7\xEA\xEB\xEC\xED"
+		"\xEF\xF0\xF1\xF2\xF4\xF5\xF6\xF7\xF8";
+	static const char vowels[] = "\xE0\xE5\xE8\xEE\xF3\xFB\xFE\xFF";
+	string word;
+	const size_t syllablesCount = 1 + randomIndex( 4 );
+	for( size_t i = 0; i < syllablesCount; i++ ) {
+		word += consonants[randomIndex( sizeof( consonants ) - 1 )];
+		word += vowels[randomIndex( sizeof( vowels ) - 1 )];
+	}
+	return word;
+}
+
+void CCorpusGenerator::addEntity( const char* type, size_t wordsCount )
+{
+	objects << ++objectsCount << " " << type;
+	for( size_t i = 0; i < wordsCount; i++ ) {
+		addSpace();
+		string word = vocabulary[randomIndex( vocabulary.size() )];
+		word[0] = static_cast<char>( word[0] - 32 ); // upper case
+		spans << ++spansCount << " _ " << text.length() << " " << word.length() << endl;
+		objects << " " << spansCount;
+		text += word;
+	}
+	objects << " #" << endl;
+}
+
+void CCorpusGenerator::addSentence( bool withEntities )
+{
+	// P - person, O - organization, D - line of a dictionary
+	static const char* const facts[] = { "P , D O", "O D P", "D O , P", "P ( D O )", "P - D O" };
+	const size_t wordsCount = 4 + randomIndex( 12 );
+	const size_t factPosition = withEntities ? randomIndex( wordsCount ) : wordsCount;
+	for( size_t i = 0; i < wordsCount; i++ ) {
+		if( i == factPosition ) {
+			const char* const fact = facts[randomIndex( sizeof( facts ) / sizeof( facts[0] ) )];
+			for( const string& part : SplitString( fact ) ) {
+				addSpace();
+				if( part == "P" ) {
+					addEntity( "Person", 2 );
+				} else if( part == "O" ) {
+					addEntity( "Org", 1 + randomIndex( 2 ) );
+				} else if( part != "D" ) {
+					text += part;
+				} else if( !phrases.empty() ) {
+					text += phrases[randomIndex( phrases.size() )];
+				}
+			}
+		}
+		addSpace();
+		text += vocabulary[randomIndex( vocabulary.size() )];
+	}
+	text += '.';
+}
+
+void CCorpusGenerator::addSpace()
+{
+	if( !text.empty() && text.back() != ' ' && text.back() != '\n' ) {
+		text += ' ';
+	}
+}
+
+void CCorpusGenerator::writeDocument( const string& baseFilename, const CMystem& mystem ) const
+{
+	ofstream textFile( baseFilename + ".txt", ios::out | ios::binary );
+	textFile << ConvertWindows1251ToUtf8( text );
+	ofstream spansFile( baseFilename + ".spans", ios::out | ios::binary );
+	spansFile << spans.str();
+	ofstream objectsFile( baseFilename + ".objects", ios::out | ios::binary );
+	objectsFile << objects.str();
+	if( !textFile.good() || !spansFile.good() || !objectsFile.good() ) {
+		throw CException( "Cannot write document `" + baseFilename + "`." );
+	}
+	textFile.close();
+
+	// the output is recorded for both encodings (see --encoding)
+	const string preparedFilename = baseFilename + ".prepared";
+	const string output = FakeMystemOutput( text + '\n' );
+	PrepareTextFile( baseFilename + ".txt", preparedFilename, TE_Cp1251 );
+	mystem.Record( preparedFilename, output );
+	PrepareTextFile( baseFilename + ".txt", preparedFilename, TE_Utf8 );
+	mystem.Record( preparedFilename, ConvertWindows1251ToUtf8( output ) );
+	remove( preparedFilename.c_str() );
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 
-class CTokens : public vector<CToken> {
+// Measures throughput of the processing stages on a corpus written by
+// CCorpusGenerator. Single stages are run over all documents of the corpus
+// (the documents are prepared in memory before), and the whole processing
+// is run document by document with replayed output of mystem.
+// Throughput is reported in megabytes of UTF-8 text and documents per second.
+class CBenchmark {
 public:
-	CTokens()
+	CBenchmark( const string& corpusDirectory, size_t iterations, size_t mystemLatency );
+
+	void Run( const string& templatesFilename,
+		CDictionaries& dictionaries, size_t threadsCount );
+
+private:
+	struct CDocument {
+		string BaseFilename;
+		string MystemOutputFilename;
+		string Text;
+		string NormalizedText;
+		CTokens Tokens;
+		vector<string> SubstitutedLexems;
+	};
+
+	const size_t iterations;
+	CMystem mystem;
+	vector<CDocument> documents;
+	size_t textSize;
+
+	template<typename TStage>
+	void measure( const string& name, size_t bytes, size_t documentsCount,
+		const TStage& stage ) const;
+	template<typename TDocumentStage>
+	void measureDocuments( const string& name, const TDocumentStage& stage );
+	template<typename TPushLexems>
+	void measureGenerated( const string& name, CDictionaries& dictionaries,
+		const TPushLexems& pushLexems );
+};
+
+CBenchmark::CBenchmark( const string& corpusDirectory, size_t _iterations,
+	size_t mystemLatency ) :
+	iterations( max<size_t>( _iterations, 1 ) ),
+	textSize( 0 )
+{
+	mystem.SetRecordings( CMystem::M_Replay, corpusDirectory );
+	mystem.SetReplayLatency( mystemLatency );
+	const string listFilename = corpusDirectory + "/" + CorpusListFilename;
+	ifstream list( listFilename );
+	if( !list.good() ) {
+		throw CException( "Cannot read corpus list `" + listFilename + "`." );
+	}
+	string name;
+	while( list >> name ) {
+		documents.emplace_back();
+		documents.back().BaseFilename = corpusDirectory + "/" + name;
+		ifstream textFile( documents.back().BaseFilename + ".txt", ios::in | ios::binary );
+		if( !textFile.good() ) {
+			throw CException( "Cannot read text file `"
+				+ documents.back().BaseFilename + ".txt`." );
+		}
+		ostringstream text;
+		text << textFile.rdbuf();
+		documents.back().Text = text.str();
+		textSize += documents.back().Text.length();
+
+		const string preparedFilename = documents.back().BaseFilename + ".prepared";
+		PrepareTextFile( documents.back().BaseFilename + ".txt", preparedFilename );
+		documents.back().MystemOutputFilename = mystem.Analyze( preparedFilename, "" );
+		remove( preparedFilename.c_str() );
+	}
+	if( documents.empty() ) {
+		throw CException( "Corpus `" + corpusDirectory + "` is empty." );
+	}
+}
+
+void CBenchmark::Run( const string& templatesFilename,
+	CDictionaries& dictionaries, size_t threadsCount )
+{
+	cout << "documents: " << documents.size()
+		<< ", text: " << textSize << " bytes"
+		<< ", iterations: " << iterations << endl;
+	cout << left << setw( 36 ) << "stage" << right << setw( 12 ) << "seconds"
+		<< setw( 12 ) << "MB/s" << setw( 12 ) << "docs/s"
+		<< setw( 12 ) << "allocs" << setw( 12 ) << "peak MB" << endl;
+
+	if( TextEncoding == TE_Utf8 ) {
+		measureDocuments( "NormalizeUtf8Text", [&]( CDocument& document )
+		{
+			document.NormalizedText = document.Text;
+			NormalizeUtf8Text( document.NormalizedText );
+		} );
+	} else {
+		measureDocuments( "ConvertUtf8ToWindows1251", [&]( CDocument& document )
+		{
+			document.NormalizedText = document.Text;
+			ConvertUtf8ToWindows1251( document.NormalizedText, ' ' );
+		} );
+		measureDocuments( "TextReplace", [&]( CDocument& document )
+		{
+			TextReplace( document.NormalizedText, ReplacementsCP1251 );
+		} );
+	}
+	measureDocuments( "CTokens::Parse", [&]( CDocument& document )
+	{
+		document.Tokens.Parse( document.MystemOutputFilename );
+	} );
+	CNamedEntities namedEntities;
+	measureDocuments( "CNamedEntities::Read", [&]( CDocument& document )
+	{
+		namedEntities.Read( document.BaseFilename );
+	} );
+	for( CDocument& document : documents ) {
+		namedEntities.Read( document.BaseFilename );
+		SetNamedEntitiyTokenTypes( namedEntities, document.Tokens );
+
+		CFinder::CMatches matches;
+		FindMatches( dictionaries, document.Tokens, 1, matches );
+		document.SubstitutedLexems.clear();
+		auto match = matches.cbegin();
+		for( size_t i = 0; i < document.Tokens.size(); i++ ) {
+			if( match != matches.cend() && match->Begin == i ) {
+				document.SubstitutedLexems.push_back( DictionaryLexem( match->Dictionary ) );
+				i = match->End - 1;
+				++match;
+			} else {
+				document.SubstitutedLexems.push_back( document.Tokens[i].Lexem );
+			}
+		}
+	}
+	CFinder dictionariesFinder( dictionaries );
+	measureDocuments( "CFinder (dictionaries)", [&]( CDocument& document )
+	{
+		dictionariesFinder.Reset();
+		for( const CToken& token : document.Tokens ) {
+			dictionariesFinder.Push( token.Lexem );
+		}
+		dictionariesFinder.Finish();
+	} );
+	measureGenerated( "dictionaries", dictionaries,
+		[]( const CDocument& document, CFinder& finder )
 	{
+		for( const CToken& token : document.Tokens ) {
+			finder.Push( token.Lexem );
+		}
+	} );
+	CDictionaries templates;
+	CVariantDefs variantDefs;
+	LoadTemplates( templatesFilename, templates, variantDefs );
+	SetUpMatcher( templates, "templates `" + templatesFilename + "`" );
+	CFinder templatesFinder( templates );
+	measureDocuments( "CFinder (templates)", [&]( CDocument& document )
+	{
+		templatesFinder.Reset();
+		for( const string& lexem : document.SubstitutedLexems ) {
+			templatesFinder.Push( lexem );
+		}
+		templatesFinder.Finish();
+	} );
+	measureGenerated( "templates", templates,
+		[]( const CDocument& document, CFinder& finder )
+	{
+		for( const string& lexem : document.SubstitutedLexems ) {
+			finder.Push( lexem );
+		}
+	} );
+
+	vector<string> templateLines;
+	size_t templatesSize = 0;
+	ifstream templatesFile( templatesFilename );
+	string line;
+	while( getline( templatesFile, line ) ) {
+		NormalizeTemplatesLine( line );
+		templatesSize += line.length();
+		templateLines.push_back( line );
 	}
+	measure( "MakeAllVariants", templatesSize, 0, [&]()
+	{
+		for( const string& templateLine : templateLines ) {
+			MakeAllVariants( templateLine );
+		}
+	} );
 
-	void Parse( const string& stemedFile );
+	measureDocuments( "CUtf8TextFile", [&]( CDocument& document )
+	{
+		CUtf8TextFile( document.BaseFilename + ".txt" );
+	} );
+	measureDocuments( "CUtf8TextFile::Text", [&]( CDocument& document )
+	{
+		CUtf8TextFile sourceFile( document.BaseFilename + ".txt" );
+		for( const CToken& token : document.Tokens ) {
+			sourceFile.Text( token );
+		}
+	} );
+
+	CTemplateSets templateSets;
+	templateSets.Add( "task3", templatesFilename );
+	templateSets.SetDictionaries( dictionaries );
+	measureDocuments( "whole processing (replayed mystem)", [&]( CDocument& document )
+	{
+		CTokens tokens;
+		const string preparedFilename = document.BaseFilename + ".prepared";
+		PrepareTextFile( document.BaseFilename + ".txt", preparedFilename );
+		tokens.Parse( mystem.Analyze( preparedFilename, "" ) );
+		CNamedEntities documentNamedEntities;
+		documentNamedEntities.Read( document.BaseFilename );
+		SetNamedEntitiyTokenTypes( documentNamedEntities, tokens );
+		vector<COccupations> occupations;
+		templateSets.Fill( tokens, threadsCount, occupations );
+		CUtf8TextFile sourceFile( document.BaseFilename + ".txt" );
+		occupations.front().Write( document.BaseFilename + ".task3", sourceFile );
+	} );
+	for( const CDocument& document : documents ) {
+		remove( ( document.BaseFilename + ".prepared" ).c_str() );
+	}
+}
+
+template<typename TStage>
+void CBenchmark::measure( const string& name, size_t bytes, size_t documentsCount,
+	const TStage& stage ) const
+{
+	ResetPeakLiveBytes();
+	const CAllocationCounters startCounters = AllocationCounters();
+	const auto start = chrono::steady_clock::now();
+	for( size_t i = 0; i < iterations; i++ ) {
+		stage();
+	}
+	const double seconds = chrono::duration<double>( chrono::steady_clock::now() - start ).count();
+	const double processedSeconds = max( seconds, 1e-9 ) / iterations;
+	const CAllocationCounters counters = AllocationCounters();
+
+	cout << left << setw( 36 ) << name << right << fixed << setprecision( 3 )
+		<< setw( 12 ) << seconds << setprecision( 1 )
+		<< setw( 12 ) << bytes / processedSeconds / ( 1 << 20 );
+	if( documentsCount > 0 ) {
+		cout << setw( 12 ) << documentsCount / processedSeconds;
+	} else {
+		cout << setw( 12 ) << "-";
+	}
+	// allocations of one run and the peak of heap above the live bytes before the stage
+	cout << setw( 12 ) << ( counters.Allocations - startCounters.Allocations ) / iterations
+		<< setw( 12 ) << ( counters.PeakLiveBytes - startCounters.LiveBytes ) / double( 1 << 20 )
+		<< endl;
+}
+
+template<typename TDocumentStage>
+void CBenchmark::measureDocuments( const string& name, const TDocumentStage& stage )
+{
+	measure( name, textSize, documents.size(), [&]()
+	{
+		for( CDocument& document : documents ) {
+			stage( document );
+		}
+	} );
+}
+
+// Texts on which CFinder backs up and retries: a line is broken off after
+// several words by another line, which begins with the last read word,
+// so the match of the first line fails and the second line is found
+// in the words shifted to the beginning.
+vector<string> BacktrackingProbes( const CDictionaries& dictionaries )
+{
+	const size_t MaxProbes = 10000;
+	const size_t MaxProbesPerPrefix = 4;
+	const vector<string> lines = dictionaries.Lines();
+	unordered_map<string, vector<const string*>> linesByFirstWord;
+	for( const string& line : lines ) {
+		linesByFirstWord[line.substr( 0, line.find( ' ' ) )].push_back( &line );
+	}
+	vector<string> probes;
+	for( const string& line : lines ) {
+		const vector<string> words = SplitString( line );
+		string prefix;
+		for( size_t i = 1; i < words.size(); i++ ) {
+			prefix += ( prefix.empty() ? "" : " " ) + words[i - 1];
+			auto nextLines = linesByFirstWord.find( words[i] );
+			if( nextLines == linesByFirstWord.end() ) {
+				continue;
+			}
+			for( size_t j = 0; j < min( nextLines->second.size(), MaxProbesPerPrefix ); j++ ) {
+				if( probes.size() == MaxProbes ) {
+					return probes;
+				}
+				probes.push_back( prefix + " " + *nextLines->second[j] );
+			}
+		}
+	}
+	return probes;
+}
+
+// Matches of the same words of the same dictionaries.
+bool SameMatches( const CFinder::CMatches& matches1, const CFinder::CMatches& matches2 )
+{
+	return ( matches1.size() == matches2.size()
+		&& equal( matches1.cbegin(), matches1.cend(), matches2.cbegin(),
+		[]( const CFinder::CMatch& match1, const CFinder::CMatch& match2 )
+	{
+		return ( match1.Begin == match2.Begin && match1.End == match2.End
+			&& match1.Dictionary == match2.Dictionary );
+	} ) );
+}
+
+// If the matcher of the dictionaries is generated (see generate-matcher), check
+// that it finds the same matches in each document and in backtracking probes
+// as the interpreted one and measure it. The dictionaries are left as the run
+// uses them.
+template<typename TPushLexems>
+void CBenchmark::measureGenerated( const string& name, CDictionaries& dictionaries,
+	const TPushLexems& pushLexems )
+{
+	CFinder finder( dictionaries );
+	auto find = [&]( const CDocument& document ) -> const CFinder::CMatches&
+	{
+		finder.Reset();
+		pushLexems( document, finder );
+		finder.Finish();
+		return finder.Matches();
+	};
+	auto findProbe = [&]( const string& probe ) -> const CFinder::CMatches&
+	{
+		finder.Reset();
+		for( const string& lexem : SplitString( probe ) ) {
+			finder.Push( lexem );
+		}
+		finder.Finish();
+		return finder.Matches();
+	};
+	dictionaries.UseGenerated( false );
+	vector<CFinder::CMatches> interpretedMatches;
+	for( const CDocument& document : documents ) {
+		interpretedMatches.push_back( find( document ) );
+	}
+	const vector<string> probes = BacktrackingProbes( dictionaries );
+	vector<CFinder::CMatches> interpretedProbeMatches;
+	for( const string& probe : probes ) {
+		interpretedProbeMatches.push_back( findProbe( probe ) );
+	}
+	if( dictionaries.UseGenerated() ) {
+		for( size_t i = 0; i < documents.size(); i++ ) {
+			if( !SameMatches( find( documents[i] ), interpretedMatches[i] ) ) {
+				throw CException( "Generated matcher of " + name + " differs from"
+					" the interpreted one in `" + documents[i].BaseFilename + "`." );
+			}
+		}
+		for( size_t i = 0; i < probes.size(); i++ ) {
+			if( !SameMatches( findProbe( probes[i] ), interpretedProbeMatches[i] ) ) {
+				throw CException( "Generated matcher of " + name + " differs from"
+					" the interpreted one in `" + ( TextEncoding == TE_Utf8 ? probes[i]
+					: ConvertWindows1251ToUtf8( probes[i] ) ) + "`." );
+			}
+		}
+		measureDocuments( "CFinder (" + name + ", generated)", [&]( CDocument& document )
+		{
+			find( document );
+		} );
+	}
+	dictionaries.UseGenerated( UseGeneratedMatchers );
+}
 
-	void Load( const string& filename );
-	void Save( const string& filename ) const;
+///////////////////////////////////////////////////////////////////////////////
+
+const char* const UsageText =
+	"Usage: occup [OPTIONS].. BASE_FILENAME TEMPLATES_FILENAME [DICTIONARIES]..\n"
+	"       occup [OPTIONS].. --batch LIST_FILENAME TEMPLATES_FILENAME [DICTIONARIES]..\n"
+	"       occup [OPTIONS].. build-dictionaries COMPILED_FILENAME DICTIONARIES..\n"
+	"       occup [OPTIONS].. generate-matcher SOURCE_FILENAME TEMPLATES_FILENAME"
+	" [DICTIONARIES]..\n"
+	"       occup [OPTIONS].. generate-corpus DIRECTORY [DICTIONARIES]..\n"
+	"       occup [OPTIONS].. benchmark DIRECTORY TEMPLATES_FILENAME [DICTIONARIES]..\n"
+	"       occup [OPTIONS].. eval LIST_FILENAME TEMPLATES_FILENAME [DICTIONARIES]..\n"
+	"       occup [OPTIONS].. tokenize LIST_FILENAME\n"
+	"       occup [OPTIONS].. extract LIST_FILENAME TEMPLATES_FILENAME [DICTIONARIES]..\n"
+	"       occup [OPTIONS].. import-pack PACK_FILENAME LIST_FILENAME\n"
+	"       occup [OPTIONS].. export-pack PACK_FILENAME\n"
+	"Options:\n"
+	"  --threads=N  number of threads used to match a document, by eval"
+	" to evaluate documents (default: number of processors)\n"
+	"  --templates=NAME:TEMPLATES_FILENAME  additional templates,"
+	" their occupations are written to BASE_FILENAME.NAME\n"
+	"  --memory=MB  memory used to sort dictionaries by build-dictionaries"
+	" (default: 256)\n"
+	"  --documents=N  number of documents generated by generate-corpus (default: 100)\n"
+	"  --size=KB  size of text of a generated document (default: 32)\n"
+	"  --entities=PERCENT  sentences with a person and an organization"
+	" in generated documents (default: 10)\n"
+	"  --seed=N  seed of random numbers of generate-corpus (default: 1)\n"
+	"  --iterations=N  number of runs of each benchmark stage (default: 5)\n"
+	"  --mystem=MODE  run (default) runs mystem, record:DIRECTORY also records"
+	" its output to DIRECTORY, replay:DIRECTORY replays recorded output\n"
+	"  --mystem-latency=MS  delay of each replayed output of mystem (default: 0)\n"
+	"  --batch  process documents which base filenames are lines of LIST_FILENAME\n"
+	"  --stats=FILENAME  write time of processing stages and counters"
+	" of documents in JSON\n"
+	"  --profile=FILENAME  write matches, prefix matches and lookups"
+	" of each template line and variant in TSV\n"
+	"  --profile-sort=COLUMN  sort the profile by matches, prefix_matches"
+	" or lookups (default)\n"
+	"  --trace=FILENAME  write timeline of documents, stages, mystem and threads"
+	" in Chrome trace event format\n"
+	"  --manifest=FILENAME  skip documents which inputs are unchanged since"
+	" they were processed with the manifest\n"
+	"  --shard=I/N  process only documents of a list which base filenames hash"
+	" to I modulo N (0 <= I < N)\n"
+	"  --encoding=ENCODING  encoding of texts for mystem, dictionaries and templates:"
+	" cp1251 (default) or utf-8\n"
+	"  --lemma-cache=FILENAME  take lemmas of known word forms from the cache"
+	" and analyze only sentences with unknown forms by mystem\n"
+	"  --lemma-cache-context  analyze a whole document with unknown forms by mystem\n"
+	"  --dedupe=FILENAME  reuse tokens of documents indexed in FILENAME"
+	" for their duplicates and near duplicates\n"
+	"  --compress-caches  write caches of documents compressed by gzip\n"
+	"  --pack=FILENAME  read documents from the pack FILENAME, write caches"
+	" to FILENAME.cache and results to FILENAME.out\n"
+	"  --output=FORMAT[:FILENAME]  write occupations as task3 files (by default),"
+	" or as jsonl, binary or binary-text records of all documents to FILENAME"
+	" or stdout (-)\n"
+	"  --document-time=MILLISECONDS  kill mystem at the deadline of a document\n"
+	"  --document-size=KB  do not analyze larger texts of documents by mystem\n"
+	"  --over-budget=degrade|skip  take words of documents over budget without lemmas"
+	" (by default) or skip them\n"
+	"  --async-io=N  read files of N next documents of lists in advance by N threads"
+	" and write files in background\n"
+	"  --incremental  analyze only text appended to documents since the previous run"
+	" and write only new final occupations to streams of records\n"
+	"  --matcher=MATCHER  match templates and dictionaries by interpreted (default)"
+	" or generated matchers (see generate-matcher)\n"
+	"DICTIONARIES are text files or one file built by build-dictionaries.\n"
+	"Example: occup Book_100 Templates.txt ListWork.txt ListOccupation.txt";
+
+struct COptions {
+	size_t Threads;
+	// additional templates: name and filename
+	vector<pair<string, string>> Templates;
+	// memory limit of build-dictionaries in bytes
+	size_t MemoryLimit;
+	// generate-corpus options
+	size_t Documents;
+	size_t DocumentSize;
+	size_t EntitiesPercent;
+	size_t Seed;
+	// benchmark options
+	size_t Iterations;
+	CMystem::TMode MystemMode;
+	string MystemRecordings;
+	size_t MystemLatency;
+	// the first argument is a file with a list of base filenames
+	bool Batch;
+	string StatisticsFilename;
+	string ProfileFilename;
+	string ProfileSort;
+	string TraceFilename;
+	string ManifestFilename;
+	// documents of lists with hash of base filename Shard modulo ShardsCount
+	size_t Shard;
+	size_t ShardsCount;
+	TTextEncoding Encoding;
+	string LemmaCacheFilename;
+	bool LemmaCacheContext;
+	string DedupeFilename;
+	string PackFilename;
+	bool CompressCaches;
+	// formats and filenames of outputs of occupations, task3 files if empty
+	vector<pair<string, string>> Outputs;
+	// budget of a document, 0 if unlimited
+	size_t DocumentTimeBudget;
+	size_t DocumentSizeBudget;
+	bool SkipOverBudget;
+	// number of documents read ahead, 0 for synchronous I/O
+	size_t AsyncIo;
+	bool Incremental;
+	bool GeneratedMatchers;
+	vector<string> Arguments;
+
+	COptions();
+
+	void Parse( int argc, const char* argv[] );
 
 private:
-	static void restorePlainText( string& text );
+	static size_t parseNumber( const string& option, const string& value );
 };
 
-void CTokens::Load( const string& filename )
+COptions::COptions() :
+	Threads( max<size_t>( thread::hardware_concurrency(), 1 ) ),
+	MemoryLimit( 256 << 20 ),
+	Documents( 100 ),
+	DocumentSize( 32 << 10 ),
+	EntitiesPercent( 10 ),
+	Seed( 1 ),
+	Iterations( 5 ),
+	MystemMode( CMystem::M_Run ),
+	MystemLatency( 0 ),
+	Batch( false ),
+	ProfileSort( "lookups" ),
+	Shard( 0 ),
+	ShardsCount( 1 ),
+	Encoding( TE_Cp1251 ),
+	LemmaCacheContext( false ),
+	CompressCaches( false ),
+	DocumentTimeBudget( 0 ),
+	DocumentSizeBudget( 0 ),
+	SkipOverBudget( false ),
+	AsyncIo( 0 ),
+	Incremental( false ),
+	GeneratedMatchers( false )
+{
+}
+
+void COptions::Parse( int argc, const char* argv[] )
+{
+	Arguments.clear();
+	for( int arg = 1; arg < argc; arg++ ) {
+		const string argument = argv[arg];
+		if( argument.compare( 0, 2, "--" ) != 0 ) {
+			Arguments.push_back( argument );
+			continue;
+		}
+
+		const size_t equalPos = argument.find( '=' );
+		const string option = argument.substr( 0, equalPos );
+		const string value = ( equalPos == string::npos ) ? "" : argument.substr( equalPos + 1 );
+		if( option == "--threads" ) {
+			Threads = max<size_t>( parseNumber( option, value ), 1 );
+		} else if( option == "--templates" ) {
+			const size_t colonPos = value.find( ':' );
+			if( colonPos == string::npos ) {
+				throw CException( "Option `" + option + "` requires NAME:TEMPLATES_FILENAME." );
+			}
+			Templates.emplace_back( value.substr( 0, colonPos ), value.substr( colonPos + 1 ) );
+		} else if( option == "--memory" ) {
+			MemoryLimit = max<size_t>( parseNumber( option, value ), 1 ) << 20;
+		} else if( option == "--documents" ) {
+			Documents = parseNumber( option, value );
+		} else if( option == "--size" ) {
+			DocumentSize = parseNumber( option, value ) << 10;
+		} else if( option == "--entities" ) {
+			EntitiesPercent = min<size_t>( parseNumber( option, value ), 100 );
+		} else if( option == "--seed" ) {
+			Seed = parseNumber( option, value );
+		} else if( option == "--iterations" ) {
+			Iterations = max<size_t>( parseNumber( option, value ), 1 );
+		} else if( option == "--mystem" ) {
+			const size_t colonPos = value.find( ':' );
+			const string mode = value.substr( 0, colonPos );
+			MystemRecordings = ( colonPos == string::npos ) ? "" : value.substr( colonPos + 1 );
+			if( mode == "run" && colonPos == string::npos ) {
+				MystemMode = CMystem::M_Run;
+			} else if( mode == "record" && !MystemRecordings.empty() ) {
+				MystemMode = CMystem::M_Record;
+			} else if( mode == "replay" && !MystemRecordings.empty() ) {
+				MystemMode = CMystem::M_Replay;
+			} else {
+				throw CException( "Option `" + option
+					+ "` requires run, record:DIRECTORY or replay:DIRECTORY." );
+			}
+		} else if( option == "--mystem-latency" ) {
+			MystemLatency = parseNumber( option, value );
+		} else if( option == "--batch" && equalPos == string::npos ) {
+			Batch = true;
+		} else if( option == "--stats" && !value.empty() ) {
+			StatisticsFilename = value;
+		} else if( option == "--profile" && !value.empty() ) {
+			ProfileFilename = value;
+		} else if( option == "--trace" && !value.empty() ) {
+			TraceFilename = value;
+		} else if( option == "--manifest" && !value.empty() ) {
+			ManifestFilename = value;
+		} else if( option == "--shard" ) {
+			const size_t slashPos = value.find( '/' );
+			if( slashPos == string::npos ) {
+				throw CException( "Option `" + option + "` requires I/N." );
+			}
+			Shard = parseNumber( option, value.substr( 0, slashPos ) );
+			ShardsCount = parseNumber( option, value.substr( slashPos + 1 ) );
+			if( Shard >= ShardsCount ) {
+				throw CException( "Option `" + option + "` requires I/N where 0 <= I < N." );
+			}
+		} else if( option == "--encoding" ) {
+			if( value == "cp1251" ) {
+				Encoding = TE_Cp1251;
+			} else if( value == "utf-8" ) {
+				Encoding = TE_Utf8;
+			} else {
+				throw CException( "Option `" + option + "` requires cp1251 or utf-8." );
+			}
+		} else if( option == "--lemma-cache" && !value.empty() ) {
+			LemmaCacheFilename = value;
+		} else if( option == "--lemma-cache-context" && equalPos == string::npos ) {
+			LemmaCacheContext = true;
+		} else if( option == "--dedupe" && !value.empty() ) {
+			DedupeFilename = value;
+		} else if( option == "--compress-caches" && equalPos == string::npos ) {
+			CompressCaches = true;
+		} else if( option == "--incremental" && equalPos == string::npos ) {
+			Incremental = true;
+		} else if( option == "--matcher" ) {
+			if( value == "interpreted" ) {
+				GeneratedMatchers = false;
+			} else if( value == "generated" ) {
+				GeneratedMatchers = true;
+			} else {
+				throw CException( "Option `" + option + "` requires interpreted or generated." );
+			}
+		} else if( option == "--pack" && !value.empty() ) {
+			PackFilename = value;
+		} else if( option == "--output" ) {
+			const size_t colonPos = value.find( ':' );
+			const string format = value.substr( 0, colonPos );
+			const string filename = ( colonPos == string::npos ) ? "-" : value.substr( colonPos + 1 );
+			if( COccupationsSink::ParseFormat( format ) == COccupationsSink::F_Task3
+				&& colonPos != string::npos )
+			{
+				throw CException( "Option `" + option + "` writes task3 files near documents." );
+			}
+			// records of several streams of one file would be interleaved
+			const bool isTask3 = ( COccupationsSink::ParseFormat( format ) == COccupationsSink::F_Task3 );
+			for( const pair<string, string>& output : Outputs ) {
+				const bool isOutputTask3 =
+					( COccupationsSink::ParseFormat( output.first ) == COccupationsSink::F_Task3 );
+				if( isTask3 && isOutputTask3 ) {
+					throw CException( "Option `" + option + "` writes task3 files twice." );
+				}
+				if( !isTask3 && !isOutputTask3 && output.second == filename ) {
+					throw CException( "Option `" + option + "` writes two streams to "
+						+ ( filename == "-" ? string( "stdout" ) : "`" + filename + "`" ) + "." );
+				}
+			}
+			Outputs.emplace_back( format, filename );
+		} else if( option == "--document-time" ) {
+			DocumentTimeBudget = parseNumber( option, value );
+		} else if( option == "--document-size" ) {
+			DocumentSizeBudget = parseNumber( option, value ) << 10;
+		} else if( option == "--over-budget" ) {
+			if( value == "degrade" ) {
+				SkipOverBudget = false;
+			} else if( value == "skip" ) {
+				SkipOverBudget = true;
+			} else {
+				throw CException( "Option `" + option + "` requires degrade or skip." );
+			}
+		} else if( option == "--async-io" ) {
+			AsyncIo = parseNumber( option, value );
+		} else if( option == "--profile-sort" ) {
+			CTemplatesProfile::ParseSortColumn( value );
+			ProfileSort = value;
+		} else {
+			throw CException( "Unknown option `" + option + "`.\n" + UsageText );
+		}
+	}
+
+	size_t minArgumentsCount = 2;
+	if( !Arguments.empty() ) {
+		if( Arguments[0] == "build-dictionaries" || Arguments[0] == "benchmark"
+			|| Arguments[0] == "eval" || Arguments[0] == "extract"
+			|| Arguments[0] == "import-pack" || Arguments[0] == "generate-matcher" )
+		{
+			minArgumentsCount = 3;
+		}
+	}
+	if( Arguments.size() < minArgumentsCount ) {
+		throw CException( string( "Too few arguments.\n" ) + UsageText );
+	}
+	// streams are rewritten by each run, they would miss up to date documents
+	if( !ManifestFilename.empty() ) {
+		for( const pair<string, string>& output : Outputs ) {
+			if( COccupationsSink::ParseFormat( output.first ) != COccupationsSink::F_Task3 ) {
+				throw CException( "Option `--manifest` cannot be used with `--output="
+					+ output.first + "`, only task3 files are kept for skipped documents." );
+			}
+		}
+	}
+}
+
+size_t COptions::parseNumber( const string& option, const string& value )
 {
-	clear();
-	ifstream input( filename );
-	while( input.good() ) {
-		CToken token;
-		input >> token.Begin >> token.End >> ws;
-		getline( input, token.Text, '\t' );
-		getline( input, token.Lexem );
-		if( input.fail() ) {
-			throw CException( "Bad todua-tokens file `" + filename + "` format." );
-		}
-		push_back( token );
-		input >> ws;
+	if( value.empty() || value.find_first_not_of( "0123456789" ) != string::npos ) {
+		throw CException( "Option `" + option + "` requires a number." );
 	}
+	return stoul( value );
 }
 
-void CTokens::Save( const string& filename ) const
+///////////////////////////////////////////////////////////////////////////////
+
+void BuildDictionaries( const COptions& options )
 {
-	ofstream output( filename );
-	for( const CToken& token : *this ) {
-		output << token.Begin << "\t" << token.End << "\t"
-			<< token.Text << "\t" << token.Lexem << endl;
+	CDictionariesBuilder builder( options.Arguments[1], options.MemoryLimit );
+	for( size_t arg = 2; arg < options.Arguments.size(); arg++ ) {
+		builder.AddFile( options.Arguments[arg], arg - 1 );
 	}
+	builder.Build();
 }
 
-void CTokens::restorePlainText( string& text )
+// Dictionaries are text files or one compiled file.
+void LoadDictionaries( const COptions& options, size_t firstArgument,
+	CDictionaries& dictionaries )
 {
-	size_t from = 0;
-	size_t to = 0;
-	while( from < text.length() ) {
-		if( text[from] == '_' ) {
-			text[to] = ' ';
-		} else if( text[from] == '\\' ) {
-			from++;
-			if( text[from] == 'n' || text[from] == 'r' ) {
-				text[to] = '\n';
-			} else {
-				text[to] = text[from];
+	for( size_t arg = firstArgument; arg < options.Arguments.size(); arg++ ) {
+		if( CDictionaries::IsCompiledFile( options.Arguments[arg] ) ) {
+			if( options.Arguments.size() != firstArgument + 1 ) {
+				throw CException( "Compiled dictionaries `" + options.Arguments[arg]
+					+ "` cannot be used with other dictionaries." );
 			}
+			dictionaries.Open( options.Arguments[arg] );
 		} else {
-			text[to] = text[from];
+			dictionaries.AddFile( options.Arguments[arg], arg - firstArgument + 1 );
 		}
-		to++;
-		from++;
-	}
-	if( !text.empty() ) {
-		text.erase( to );
 	}
 }
 
-void CTokens::Parse( const string& filename )
+// Key of the dictionaries of arguments for caches of their matches.
+string DictionariesKey( const COptions& options, size_t firstArgument )
 {
-	clear();
-	ifstream input( filename );
-	size_t offset = 0;
-	while( input.good() ) {
-		string line;
-		getline( input, line );
-		if( input.eof() ) {
-			break;
-		}
-		if( !line.empty() && line.back() == '\r' ) {
-			line.pop_back();
-		}
+	return FilesKey( vector<string>( options.Arguments.cbegin() + firstArgument,
+		options.Arguments.cend() ) );
+}
 
-		const size_t pos = line.find( '{' );
-		if( pos == string::npos ) {
-			restorePlainText( line );
-			size_t lineOffset = 0;
-			while( lineOffset < line.length() ) {
-				char c = line[lineOffset];
-				if( IsCharAlphaOrDigit( c ) ) {
-					const size_t beginPos = lineOffset;
-					while( lineOffset < line.length() && IsCharAlphaOrDigit( line[lineOffset] ) ) {
-						lineOffset++;
-					}
-					CToken token;
-					token.Text = line.substr( beginPos, lineOffset - beginPos );
-					token.Lexem = token.Text;
-					if( token.Lexem.find_first_not_of( "0123456789" ) == string::npos ) {
-						token.Lexem = "#";
-					}
-					token.Begin = offset + beginPos;
-					token.End = offset + lineOffset;
-					push_back( token );
-				} else if( c == ' ' || c == '\n' ) {
-					lineOffset++;
-					continue;
-				} else {
-					CToken token;
-					token.Text = string( 1, c );
-					token.Lexem = token.Text;
-					token.Begin = offset + lineOffset;
-					lineOffset++;
-					token.End = offset + lineOffset;
-					push_back( token );
-				}
-			}
-			offset += lineOffset;
-		} else {
-			CToken token;
-			token.Text = line.substr( 0, pos );
-			const size_t startPos = pos + 1;
-			const size_t endPos = line.find_first_of( "?|}", startPos );
-			if( endPos == string::npos ) {
-				throw CException( "Bad file `" + filename + "` format." );
-			}
-			token.Lexem = line.substr( startPos, endPos - startPos );
-			token.Begin = offset;
-			offset += token.Text.length();
-			token.End = offset;
-			push_back( token );
-		}
+// Write C++ code of matchers of templates (and --templates) and dictionaries,
+// which replaces generatedmatcher.cpp, so the rebuilt program matches them
+// with --matcher=generated. The encoding must be the one of the runs.
+void GenerateMatcher( const COptions& options )
+{
+	vector<pair<string, string>> templatesFilenames( 1,
+		make_pair( "task3", options.Arguments[2] ) );
+	templatesFilenames.insert( templatesFilenames.end(), options.Templates.cbegin(),
+		options.Templates.cend() );
+	deque<CDictionaries> dictionaries;
+	vector<string> names;
+	for( const pair<string, string>& templates : templatesFilenames ) {
+		dictionaries.emplace_back();
+		CVariantDefs variantDefs;
+		LoadTemplates( templates.second, dictionaries.back(), variantDefs );
+		names.push_back( "templates " + templates.first + " `" + templates.second + "`" );
+	}
+	dictionaries.emplace_back();
+	LoadDictionaries( options, 3, dictionaries.back() );
+	names.push_back( "dictionaries" );
+	if( dictionaries.back().IsEmpty() ) {
+		dictionaries.pop_back();
+		names.pop_back();
 	}
-}
 
-///////////////////////////////////////////////////////////////////////////////
+	const string& filename = options.Arguments[1];
+	ofstream output( filename, ios::out | ios::binary );
+	output << "// Generated by `occup generate-matcher`"
+		<< ( TextEncoding == TE_Utf8 ? " --encoding=utf-8" : "" )
+		<< ", do not edit.\n\n#include <cstring>\n\n#include \"generatedmatcher.h\"\n\n"
+		<< "namespace {\n\n";
+	for( size_t i = 0; i < dictionaries.size(); i++ ) {
+		output << "// " << names[i] << "\n";
+		dictionaries[i].WriteGenerated( output, to_string( i ) );
+	}
+	output << "} // namespace\n\n";
+	output << "const CGeneratedDictionaries* const GeneratedDictionaries[] = {\n";
+	for( size_t i = 0; i < dictionaries.size(); i++ ) {
+		output << "\t&Generated" << i << ",\n";
+	}
+	output << "};\nconst size_t GeneratedDictionariesCount = " << dictionaries.size() << ";\n";
+	output.close();
+	if( output.fail() ) {
+		throw CException( "Cannot write generated matcher `" + filename + "`." );
+	}
+}
 
-const char* InternalNamedEntityTypeText( TNamedEntityType type )
+void GenerateCorpus( const COptions& options )
 {
-	switch( type ) {
-		case NET_Org:
-			return "$O";
-		case NET_Person:
-			return "$P";
-		case NET_Location:
-			return "$L";
-		default:
-			break;
+	CCorpusGenerator generator( options.Seed );
+	for( size_t arg = 2; arg < options.Arguments.size(); arg++ ) {
+		generator.AddDictionary( options.Arguments[arg] );
 	}
-	throw logic_error( "InternalNamedEntityTypeText" );
+	generator.Generate( options.Arguments[1], options.Documents,
+		options.DocumentSize, options.EntitiesPercent );
 }
 
-void SetNamedEntitiyTokenTypes( const CNamedEntities& namedEntities, CTokens& tokens )
+void RunBenchmark( const COptions& options )
 {
-	CTokens tmp = move( tokens );
+	CDictionaries dictionaries;
+	LoadDictionaries( options, 3, dictionaries );
+	SetUpMatcher( dictionaries, "dictionaries" );
+	CBenchmark benchmark( options.Arguments[1], options.Iterations, options.MystemLatency );
+	benchmark.Run( options.Arguments[2], dictionaries, options.Threads );
+}
 
-	auto token = tmp.cbegin();
-	for( const CNamedEntity& entity : namedEntities ) {
-		if( token == tmp.cend() ) {
-			throw CException( "Objects does not matched with tokens." );
-		}
+// Cached results of processing stages of a document are resumed from the last
+// stage which inputs have not changed: entity-tagged tokens (.todua-tokens),
+// which depend on .txt, .spans, .objects and the encoding, and matches of dictionaries
+// in the tokens (.todua-substitutions), which also depend on the dictionaries.
+string TokensCacheFilename( const string& baseFilename )
+{
+	return baseFilename + ".todua-tokens";
+}
 
-		while( token != tmp.cend() && entity.HasNoIntersection( *token ) ) {
-			tokens.push_back( *token );
-			++token;
-		}
-		if( token != tmp.cend() ) {
-			tokens.push_back( *token );
-			tokens.back().Lexem = InternalNamedEntityTypeText( entity.Type );
-			for( ++token; token != tmp.cend() && !entity.HasNoIntersection( *token ); ++token ) {
-				tokens.back().Text += " " + token->Text;
-				tokens.back().End = token->End;
-			}
+string SubstitutionsCacheFilename( const string& baseFilename )
+{
+	return baseFilename + ".todua-substitutions";
+}
+
+// State of a growing document (see CIncrementalState).
+string IncrementalStateFilename( const string& baseFilename )
+{
+	return baseFilename + ".todua-incremental";
+}
+
+string TokensKey( const string& baseFilename )
+{
+	const string key = DocumentFileHash( baseFilename + ".txt" )
+		+ " " + DocumentFileHash( baseFilename + ".spans" )
+		+ " " + DocumentFileHash( baseFilename + ".objects" );
+	return ( TextEncoding == TE_Utf8 ) ? key + " utf-8" : key;
+}
+
+// Returns false (and no matches) if there is no cache with the key.
+bool LoadSubstitutions( const string& filename, const string& key, size_t tokensCount,
+	CFinder::CMatches& matches )
+{
+	matches.clear();
+	CDocumentInput inputFile( filename );
+	istream& input = inputFile.Stream();
+	if( !ReadCacheKey( input, key ) ) {
+		return false;
+	}
+	size_t begin;
+	size_t end;
+	size_t dictionary;
+	size_t offset = 0;
+	while( input >> begin >> end >> dictionary ) {
+		if( begin < offset || end <= begin || end > tokensCount || dictionary == 0 ) {
+			input.setstate( ios::badbit );
+			break;
 		}
+		matches.emplace_back( begin, end, dictionary );
+		offset = end;
 	}
-	while( token != tmp.cend() ) {
-		tokens.push_back( *token );
-		++token;
+	if( !input.eof() ) {
+		throw CException( "Bad todua-substitutions file `" + filename + "` format." );
 	}
+	return true;
 }
 
-///////////////////////////////////////////////////////////////////////////////
+void SaveSubstitutions( const string& filename, const string& key,
+	const CFinder::CMatches& matches )
+{
+	CDocumentOutput outputFile( filename );
+	ostream& output = outputFile.Stream();
+	output << key << endl;
+	for( const CFinder::CMatch& match : matches ) {
+		output << match.Begin << "\t" << match.End << "\t" << match.Dictionary << endl;
+	}
+	outputFile.Close();
+}
 
-void ProcessTokensByDictionaries( const CDictionaries& dictionaries, CTokens& tokens )
+// Cached matches of dictionaries of a duplicate which tokens (with named
+// entities) are the same are copied with the tokens key of the document.
+void ReuseSubstitutions( const string& duplicateBaseFilename, const string& baseFilename,
+	const string& tokensKey, const CTokens& tokens )
 {
-	if( dictionaries.IsEmpty() ) {
+	if( duplicateBaseFilename == baseFilename ) {
 		return;
 	}
+	for( const char* const extension : { ".txt", ".spans", ".objects" } ) {
+		if( !DocumentFiles.Exists( duplicateBaseFilename + extension ) ) {
+			return;
+		}
+	}
+	const string duplicateTokensKey = TokensKey( duplicateBaseFilename );
+	CTokens duplicateTokens;
+	if( !duplicateTokens.Load( TokensCacheFilename( duplicateBaseFilename ), duplicateTokensKey )
+		|| duplicateTokens.size() != tokens.size()
+		|| !equal( tokens.cbegin(), tokens.cend(), duplicateTokens.cbegin(),
+			[]( const CToken& token1, const CToken& token2 )
+		{
+			return ( token1.Begin == token2.Begin && token1.End == token2.End
+				&& token1.Text == token2.Text && token1.Lexem == token2.Lexem );
+		} ) )
+	{
+		return;
+	}
+	// the key is the tokens key and the key of dictionaries
+	CDocumentInput inputFile( SubstitutionsCacheFilename( duplicateBaseFilename ) );
+	istream& input = inputFile.Stream();
+	string key;
+	if( !getline( input, key ) || key.compare( 0, duplicateTokensKey.length() + 1,
+		duplicateTokensKey + " " ) != 0 )
+	{
+		return;
+	}
+	CDocumentOutput outputFile( SubstitutionsCacheFilename( baseFilename ) );
+	ostream& output = outputFile.Stream();
+	output << tokensKey << key.substr( duplicateTokensKey.length() ) << endl;
+	output << input.rdbuf();
+	outputFile.Close();
+}
 
-	CTokens tmp = move( tokens );
-
-	CFinder finder( dictionaries );
-	for( const CToken& token : tmp ) {
-		finder.Push( token.Lexem );
+// Returns false with a warning if the budget of a document is overrun.
+bool CheckBudget( const string& baseFilename, const CDocumentBudget* budget,
+	CStatistics& statistics )
+{
+	if( budget != nullptr && budget->IsOverrun() ) {
+		statistics.Add( CStatistics::C_OverBudget, 1 );
+		cerr << "Warning: `" << baseFilename << "` is over budget: " << budget->Reason()
+			<< ( budget->SkipOverrun() ? ", its results are not written."
+				: ", its words are taken without lemmas." ) << endl;
+		return false;
 	}
-	finder.Finish();
+	return true;
+}
 
-	size_t tokenIndex = 0;
-	for( const CFinder::CMatch& match : finder.Matches() ) {
-		for( ; tokenIndex <= match.Begin; tokenIndex++ ) {
-			tokens.push_back( tmp[tokenIndex] );
+// Load cached tokens of a document or make them by mystem and named entities.
+// Without mystem the tokens must be cached. Returns false if the budget
+// of the document is overrun, then the tokens are not cached.
+bool PrepareTokens( const string& baseFilename, const string& tokensKey, CTokens& tokens,
+	const CMystem* mystem, CStatistics& statistics )
+{
+	const string toduaTokensFilename = TokensCacheFilename( baseFilename );
+	statistics.Stage( CStatistics::S_TokensCache );
+	if( !tokens.Load( toduaTokensFilename, tokensKey ) ) {
+		if( mystem == nullptr ) {
+			throw CException( "Tokens of `" + baseFilename + "` are not cached"
+				" or its inputs are changed, run tokenize." );
+		}
+		CDocumentBudget* const budget = mystem->Budget();
+		if( budget != nullptr ) {
+			budget->Start();
+		}
+		const string duplicateBaseFilename = ParseTokens( baseFilename, tokens, *mystem, statistics );
+
+		// extract named entities
+		statistics.Stage( CStatistics::S_EntitiesRead );
+		CNamedEntities namedEntities;
+		namedEntities.Read( baseFilename );
+		statistics.Add( CStatistics::C_Entities, namedEntities.size() );
+
+		// set named entity type for tokens
+		statistics.Stage( CStatistics::S_EntitiesTagging );
+		SetNamedEntitiyTokenTypes( namedEntities, tokens );
+
+		if( !CheckBudget( baseFilename, budget, statistics ) ) {
+			return false;
 		}
-		tokens.back().Lexem = "@" + to_string( match.Dictionary );
-		for( ; tokenIndex < match.End; tokenIndex++ ) {
-			tokens.back().Text += " " + tmp[tokenIndex].Text;
-			tokens.back().End = tmp[tokenIndex].End;
+
+		// dump token for future executions.
+		statistics.Stage( CStatistics::S_TokensCache );
+		if( !duplicateBaseFilename.empty() ) {
+			ReuseSubstitutions( duplicateBaseFilename, baseFilename, tokensKey, tokens );
 		}
+		tokens.Save( toduaTokensFilename, tokensKey );
 	}
-	for( ; tokenIndex < tmp.size(); tokenIndex++ ) {
-		tokens.push_back( tmp[tokenIndex] );
+	return true;
+}
+
+// Fill occupations of a document, matches of the dictionaries are loaded from
+// the cache if it is valid, otherwise they are matched and cached
+// unless the tokens are not cached.
+void MatchTokens( const string& baseFilename, const string& tokensKey, const CTokens& tokens,
+	const CTemplateSets& templateSets, const size_t threadsCount,
+	vector<COccupations>& occupations, CMatcher::CCounters* counters = nullptr,
+	CTemplatesProfile* profile = nullptr, const bool tokensCached = true )
+{
+	if( !templateSets.HasDictionaries() ) {
+		templateSets.Fill( tokens, threadsCount, occupations, counters, profile );
+		return;
+	}
+	const string filename = SubstitutionsCacheFilename( baseFilename );
+	const string key = tokensKey + " " + templateSets.DictionariesKey();
+	CFinder::CMatches substitutionMatches;
+	if( tokensCached && LoadSubstitutions( filename, key, tokens.size(), substitutionMatches ) ) {
+		templateSets.FillSubstituted( tokens, substitutionMatches, threadsCount,
+			occupations, counters, profile );
+	} else {
+		templateSets.Fill( tokens, threadsCount, occupations, counters, profile,
+			&substitutionMatches );
+		if( tokensCached ) {
+			SaveSubstitutions( filename, key, substitutionMatches );
+		}
 	}
 }
 
-///////////////////////////////////////////////////////////////////////////////
+void AddMatchCounters( const CMatcher::CCounters& counters, CStatistics& statistics )
+{
+	statistics.Add( CStatistics::C_DictionaryHits, counters.SubstitutionMatches );
+	statistics.Add( CStatistics::C_TemplateMatches, counters.Matches );
+	statistics.Add( CStatistics::C_DictionaryShifts, counters.SubstitutionFinder.Shifts );
+	statistics.Add( CStatistics::C_DictionaryBacktracks, counters.SubstitutionFinder.Backtracks );
+	statistics.Add( CStatistics::C_TemplateShifts, counters.Finders.Shifts );
+	statistics.Add( CStatistics::C_TemplateBacktracks, counters.Finders.Backtracks );
+}
 
-vector<string> MakeAllVariants( const string& text )
+// Returns false if the budget of the document is overrun, then its results
+// are written only if the budget does not skip them.
+bool ExtractDocumentOccupations( const string& baseFilename, const string& tokensKey,
+	const CTemplateSets& templateSets, const CMystem* mystem, const size_t threadsCount,
+	deque<COccupationsSink>& sinks, CStatistics& statistics, CTemplatesProfile* profile )
 {
-	vector<string> variants;
-	const size_t beginPos = text.find( '[' );
-	if( beginPos == string::npos ) {
-		variants.push_back( text );
-		return variants;
-	}
+	statistics.BeginDocument( baseFilename );
+	statistics.Add( CStatistics::C_Bytes, DocumentFileSize( baseFilename + ".txt" ) );
 
-	const size_t endPos = text.find_first_of( ']', beginPos );
-	if( endPos == string::npos ) {
-		return vector<string>(); // error
+	CTokens tokens;
+	const bool withinBudget = PrepareTokens( baseFilename, tokensKey, tokens, mystem, statistics );
+	if( !withinBudget && mystem->Budget()->SkipOverrun() ) {
+		statistics.EndDocument();
+		return false;
 	}
 
-	const string prefix = text.substr( 0, beginPos );
-	const string middle = text.substr( beginPos + 1, endPos - ( beginPos + 1 ) );
-	const string suffix = text.substr( endPos + 1 );
+	// Normalize by dictionaries and write result
+	statistics.Add( CStatistics::C_Tokens, tokens.size() );
+	statistics.Stage( CStatistics::S_Match );
+	vector<COccupations> occupations;
+	CMatcher::CCounters counters;
+	MatchTokens( baseFilename, tokensKey, tokens, templateSets, threadsCount,
+		occupations, &counters, profile, withinBudget );
+	AddMatchCounters( counters, statistics );
 
-	vector<string> middles = SplitString( middle, "|", true /* preserveEmptyStrings */ );
-	if( middles.size() == 1 ) {
-		middles.push_back( "" );
+	statistics.Stage( CStatistics::S_Write );
+	CUtf8TextFile sourceFile( baseFilename + ".txt" );
+	for( size_t i = 0; i < templateSets.Size(); i++ ) {
+		for( COccupationsSink& sink : sinks ) {
+			sink.Write( baseFilename, templateSets.Name( i ), occupations[i], sourceFile );
+		}
+		statistics.Add( CStatistics::C_Occupations, occupations[i].size() );
 	}
-	vector<string> suffixes = MakeAllVariants( suffix );
+	statistics.EndDocument();
+	return withinBudget;
+}
 
-	for( const string& suf : suffixes ) {
-		for( const string& mid : middles ) {
-			variants.push_back( prefix + mid + suf );
-		}
+// Hash of lexems and offsets of tokens [begin, end) continued from the hash
+// of the previous tokens.
+uint64_t HashTokens( const CTokens& tokens, size_t begin, size_t end, uint64_t hash )
+{
+	for( size_t i = begin; i < end; i++ ) {
+		const CToken& token = tokens[i];
+		hash = HashBytes( reinterpret_cast<const char*>( &token.Begin ), sizeof( token.Begin ), hash );
+		hash = HashBytes( reinterpret_cast<const char*>( &token.End ), sizeof( token.End ), hash );
+		hash = HashBytes( token.Lexem.c_str(), token.Lexem.length() + 1, hash );
 	}
-	return variants;
+	return hash;
 }
 
-///////////////////////////////////////////////////////////////////////////////
+// End of the stable prefix of prepared text which is only appended:
+// the end of the last sentence before the last line, which may be continued,
+// but not before the end of the previous prefix.
+size_t StableTextEnd( const string& text, const size_t previousEnd )
+{
+	const size_t lastLinePos = ( text.length() < 2 ) ? string::npos
+		: text.rfind( '\n', text.length() - 2 );
+	const size_t lastLineBegin = ( lastLinePos == string::npos ) ? 0 : lastLinePos + 1;
+	size_t end = previousEnd;
+	for( size_t offset = SentenceEnd( text, previousEnd ); offset <= lastLineBegin
+		&& offset > end; offset = SentenceEnd( text, offset ) )
+	{
+		end = offset;
+	}
+	return end;
+}
 
-class CUtf8TextFile {
+// State of a growing document, which text is only appended (see --incremental).
+// Tokens of the stable prefix of its text are kept, so only the appended text
+// is analyzed by mystem. Matches do not cross a token absent in all dictionaries
+// (see CMatcher), so occupations of matches before the last such token of the
+// prefix are final and only the following tokens are matched again.
+// The state is saved with the key of templates and dictionaries
+// and it is reset if the text does not start with the prefix.
+// The whole state is read and written by each run (it may be compressed or
+// packed like other caches), so its cost grows with the document as does
+// the cost of preparing the text and tagging named entities.
+class CIncrementalState {
 public:
-	explicit CUtf8TextFile( const string& filename );
-
-	string Text( CInterval interval ) const;
+	// bytes of the stable prefix of the prepared text, their hash and characters
+	size_t TextBytes;
+	uint64_t TextHash;
+	size_t TextChars;
+	// tokens of the prefix made by mystem, without named entities
+	CTokens Tokens;
+	// number of final tokens with named entities and their hash (see HashTokens)
+	size_t FinalTokens;
+	uint64_t FinalTokensHash;
+	// final occupations of each set of templates
+	vector<COccupations> Occupations;
+
+	explicit CIncrementalState( size_t setsCount = 0 ) :
+		TextBytes( 0 ),
+		TextHash( HashBytes( "", 0 ) ),
+		TextChars( 0 ),
+		FinalTokens( 0 ),
+		FinalTokensHash( HashBytes( "", 0 ) ),
+		Occupations( setsCount )
+	{
+	}
 
-private:
-	typedef array<char, 4> CChar;
-	vector<CChar> chars;
+	// Load the state saved with the key, returns false (and the empty state)
+	// if there is no such file or it was saved with another key.
+	bool Load( const string& filename, const string& key );
+	void Save( const string& filename, const string& key ) const;
+	bool IsPrefixOf( const string& text ) const;
 };
 
-CUtf8TextFile::CUtf8TextFile( const string& filename )
+bool CIncrementalState::Load( const string& filename, const string& key )
 {
-	ifstream input( filename );
-	if( !input.good() ) {
-		throw CException( "File `" + filename + "` not found." );
+	*this = CIncrementalState( Occupations.size() );
+	CDocumentInput inputFile( filename );
+	istream& input = inputFile.Stream();
+	if( !ReadCacheKey( input, key ) ) {
+		return false;
 	}
-
-	do {
-		string line;
-		getline( input, line );
-		if( !line.empty() && line.back() == '\r' ) {
-			line.pop_back();
-		}
-
-		size_t index = 0;
-		for( char c : line ) {
-			const unsigned char uc = static_cast<unsigned char>( c );
-			if( uc >= 128 && uc < 192 ) {
-				chars.back()[++index] = c;
-			} else {
-				index = 0;
-				chars.push_back( { c, '\0', '\0', '\0' } );
-			}
+	input >> TextBytes >> hex >> TextHash >> dec >> TextChars
+		>> FinalTokens >> hex >> FinalTokensHash >> dec;
+	for( COccupations& occupations : Occupations ) {
+		size_t count = 0;
+		input >> count;
+		for( size_t i = 0; i < count && input.good(); i++ ) {
+			COccupation occupation;
+			input >> occupation.Variant >> occupation.Who.Begin >> occupation.Who.End
+				>> occupation.Where.Begin >> occupation.Where.End
+				>> occupation.Job.Begin >> occupation.Job.End;
+			occupations.push_back( occupation );
 		}
-		chars.push_back( { '\n', '\0', '\0', '\0' } );
-	} while( input.good() );
+	}
+	if( input.fail() ) {
+		throw CException( "Bad todua-incremental file `" + filename + "` format." );
+	}
+	Tokens.Read( input, filename );
+	return true;
 }
 
-string CUtf8TextFile::Text( CInterval interval ) const
+void CIncrementalState::Save( const string& filename, const string& key ) const
 {
-	if( !interval.Defined() ) {
-		throw logic_error( "CUtf8TextFile::Text() undefined interval" );
-	}
-	string text;
-	for( size_t i = interval.Begin; i < interval.End; i++ ) {
-		text.push_back( chars[i][0] );
-		for( size_t j = 1; j < chars[i].size() && chars[i][j] != '\0'; j++ ) {
-			text.push_back( chars[i][j] );
+	CDocumentOutput outputFile( filename );
+	ostream& output = outputFile.Stream();
+	output << key << "\n";
+	output << TextBytes << "\t" << hex << TextHash << dec << "\t" << TextChars << "\n";
+	output << FinalTokens << "\t" << hex << FinalTokensHash << dec << "\n";
+	for( const COccupations& occupations : Occupations ) {
+		output << occupations.size() << "\n";
+		for( const COccupation& occupation : occupations ) {
+			output << occupation.Variant << "\t" << occupation.Who.Begin << "\t"
+				<< occupation.Who.End << "\t" << occupation.Where.Begin << "\t"
+				<< occupation.Where.End << "\t" << occupation.Job.Begin << "\t"
+				<< occupation.Job.End << "\n";
 		}
 	}
-	return text;
+	Tokens.Write( output );
+	outputFile.Close();
 }
 
-///////////////////////////////////////////////////////////////////////////////
+bool CIncrementalState::IsPrefixOf( const string& text ) const
+{
+	return ( TextBytes <= text.length() && HashBytes( text.data(), TextBytes ) == TextHash );
+}
 
-struct COccupation {
-	CInterval Who;
-	CInterval Where;
-	CInterval Job;
+// Extract occupations of a growing document (see CIncrementalState). Task3 files
+// get all occupations, but streams of records get only occupations which
+// became final. Returns false if the budget of the document is overrun,
+// then the state is not saved.
+bool ExtractGrowingDocumentOccupations( const string& baseFilename, const string& key,
+	const CTemplateSets& templateSets, const CMystem& mystem, const size_t threadsCount,
+	deque<COccupationsSink>& sinks, CStatistics& statistics, CTemplatesProfile* profile )
+{
+	statistics.BeginDocument( baseFilename );
+	statistics.Add( CStatistics::C_Bytes, DocumentFileSize( baseFilename + ".txt" ) );
+	statistics.Stage( CStatistics::S_Prepare );
+	const string text = PrepareText( baseFilename + ".txt" );
+
+	statistics.Stage( CStatistics::S_TokensCache );
+	const string stateFilename = IncrementalStateFilename( baseFilename );
+	CIncrementalState state( templateSets.Size() );
+	if( !state.Load( stateFilename, key ) || !state.IsPrefixOf( text ) ) {
+		state = CIncrementalState( templateSets.Size() );
+	}
 
-	bool Check() const
-	{
-		return Who.Defined() && Where.Defined();
+	// only the text after the prefix is analyzed
+	CDocumentBudget* const budget = mystem.Budget();
+	if( budget != nullptr ) {
+		budget->Start();
 	}
-	void Write( ostream& output, const CUtf8TextFile& textFle ) const
+	CTokens tokens = move( state.Tokens );
+	statistics.Add( CStatistics::C_ReusedTokens, tokens.size() );
+	CTokens appendedTokens;
+	AnalyzeText( text.substr( state.TextBytes ), baseFilename + ".txt", appendedTokens,
+		mystem, statistics );
+	MergeRestTokens( appendedTokens, { { 0, state.TextChars } }, tokens );
+
+	statistics.Stage( CStatistics::S_EntitiesRead );
+	CNamedEntities namedEntities;
+	namedEntities.Read( baseFilename );
+	statistics.Add( CStatistics::C_Entities, namedEntities.size() );
+	statistics.Stage( CStatistics::S_EntitiesTagging );
+	CTokens taggedTokens = tokens;
+	SetNamedEntitiyTokenTypes( namedEntities, taggedTokens );
+
+	const bool withinBudget = CheckBudget( baseFilename, budget, statistics );
+	if( !withinBudget && budget->SkipOverrun() ) {
+		statistics.EndDocument();
+		return false;
+	}
+
+	// tokens after the final ones are matched, unless the final ones are changed
+	// (by named entities)
+	statistics.Add( CStatistics::C_Tokens, taggedTokens.size() );
+	statistics.Stage( CStatistics::S_Match );
+	size_t begin = 0;
+	uint64_t finalTokensHash = HashBytes( "", 0 );
+	if( state.FinalTokens <= taggedTokens.size() && HashTokens( taggedTokens, 0,
+		state.FinalTokens, finalTokensHash ) == state.FinalTokensHash )
 	{
-		if( !Check() ) {
-			throw logic_error( "bad occupation" );
-		}
-		output << "Occupation" << endl;
-		output << "who:" << textFle.Text( Who ) << endl;
-		if( Where.Defined() ) {
-			output << "where:" << textFle.Text( Where ) << endl;
+		begin = state.FinalTokens;
+		finalTokensHash = state.FinalTokensHash;
+	} else {
+		state.Occupations.assign( templateSets.Size(), COccupations() );
+	}
+	CTokens restTokens;
+	restTokens.assign( taggedTokens.cbegin() + begin, taggedTokens.cend() );
+	vector<COccupations> occupations;
+	CMatcher::CCounters counters;
+	templateSets.Fill( restTokens, threadsCount, occupations, &counters, profile );
+	AddMatchCounters( counters, statistics );
+
+	// occupations before the final bound of the new stable prefix are final
+	const size_t stableBytes = StableTextEnd( text, state.TextBytes );
+	const size_t stableChars = state.TextChars
+		+ TextLength( text.substr( state.TextBytes, stableBytes - state.TextBytes ) );
+	size_t stableTokens = begin;
+	while( stableTokens < taggedTokens.size() && taggedTokens[stableTokens].End <= stableChars ) {
+		stableTokens++;
+	}
+	const size_t finalTokens = templateSets.FinalBound( taggedTokens, begin, stableTokens );
+	const size_t finalChars = ( finalTokens > 0 ) ? taggedTokens[finalTokens - 1].End : 0;
+
+	statistics.Stage( CStatistics::S_Write );
+	CUtf8TextFile sourceFile( baseFilename + ".txt" );
+	for( size_t i = 0; i < templateSets.Size(); i++ ) {
+		COccupations newFinalOccupations;
+		for( const COccupation& occupation : occupations[i] ) {
+			if( occupation.Who.End <= finalChars && occupation.Where.End <= finalChars
+				&& occupation.Job.End <= finalChars )
+			{
+				newFinalOccupations.push_back( occupation );
+			}
 		}
-		if( Job.Defined() ) {
-			output << "job:" << textFle.Text( Job ) << endl;
+		COccupations& finalOccupations = state.Occupations[i];
+		occupations[i].insert( occupations[i].begin(), finalOccupations.cbegin(),
+			finalOccupations.cend() );
+		for( COccupationsSink& sink : sinks ) {
+			sink.Write( baseFilename, templateSets.Name( i ),
+				( sink.Format() == COccupationsSink::F_Task3 ) ? occupations[i]
+					: newFinalOccupations, sourceFile );
 		}
+		statistics.Add( CStatistics::C_Occupations, occupations[i].size() );
+		finalOccupations.insert( finalOccupations.end(), newFinalOccupations.cbegin(),
+			newFinalOccupations.cend() );
 	}
-};
 
-///////////////////////////////////////////////////////////////////////////////
+	if( withinBudget ) {
+		statistics.Stage( CStatistics::S_TokensCache );
+		state.TextHash = HashBytes( text.data() + state.TextBytes,
+			stableBytes - state.TextBytes, state.TextHash );
+		state.TextBytes = stableBytes;
+		state.TextChars = stableChars;
+		state.Tokens = move( tokens );
+		while( !state.Tokens.empty() && state.Tokens.back().End > stableChars ) {
+			state.Tokens.pop_back();
+		}
+		state.FinalTokens = finalTokens;
+		state.FinalTokensHash = HashTokens( taggedTokens, begin, finalTokens, finalTokensHash );
+		state.Save( stateFilename, key );
+	}
+	statistics.EndDocument();
+	return withinBudget;
+}
 
-class CVariantDefs {
+// Version of the results of the program, a part of keys of the manifest.
+// Increment it with every change of the code which changes the results
+// (.task3 and files of --templates) of the same inputs. A rebuild without
+// such changes keeps documents of manifests up to date.
+const char* const ResultsVersion = "1";
+
+// Manifest of processed documents: the key of inputs of each document, which
+// are its .txt, .spans and .objects, templates, dictionaries and the version
+// of results (see ResultsVersion).
+// A document which key is unchanged and which outputs exist is up to date.
+// Entries are appended as documents are processed, so an interrupted run
+// keeps its progress, and the manifest is rewritten without old entries
+// by Close.
+class CManifest {
 public:
-	CVariantDefs();
+	CManifest() :
+		upToDateCount( 0 ),
+		processedCount( 0 )
+	{
+	}
 
-	size_t AddVariant( string& variant );
-	COccupation Occupation( const size_t variantIndex,
-		CTokens::const_iterator firstMatchedToken ) const;
+	void Open( const string& filename );
+	bool IsUpToDate( const string& baseFilename, const string& key,
+		const vector<string>& outputFilenames );
+	void Update( const string& baseFilename, const string& key );
+	void Close();
 
-private:
-	vector<COccupation> variants;
+	size_t UpToDateCount() const { return upToDateCount; }
+	size_t ProcessedCount() const { return processedCount; }
 
-	bool addToken( string& token, CInterval interval );
-	bool addInterval( CInterval& dest, CInterval newInterval ) const;
+private:
+	string filename;
+	map<string, string> keys;
+	ofstream output;
+	size_t upToDateCount;
+	size_t processedCount;
 };
 
-CVariantDefs::CVariantDefs()
+void CManifest::Open( const string& _filename )
 {
+	filename = _filename;
+	keys.clear();
+	ifstream input( filename );
+	string line;
+	while( getline( input, line ) ) {
+		const size_t tabPos = line.find( '\t' );
+		if( tabPos != string::npos ) {
+			keys[line.substr( 0, tabPos )] = line.substr( tabPos + 1 );
+		}
+	}
+	input.close();
+	output.open( filename, ios::out | ios::app );
+	if( !output.good() ) {
+		throw CException( "Cannot write manifest `" + filename + "`." );
+	}
 }
 
-bool CVariantDefs::addInterval( CInterval& dest, CInterval interval ) const
+bool CManifest::IsUpToDate( const string& baseFilename, const string& key,
+	const vector<string>& outputFilenames )
 {
-	if( !dest.Defined() ) {
-		dest = interval;
-	} else if( dest.End == interval.Begin ) {
-		dest.End = interval.End;
-	} else {
-		return false;
+	auto entry = keys.find( baseFilename );
+	bool upToDate = ( entry != keys.end() && entry->second == key );
+	for( const string& outputFilename : outputFilenames ) {
+		upToDate = upToDate && DocumentFiles.Exists( outputFilename );
 	}
-	return true;
+	if( upToDate ) {
+		upToDateCount++;
+	}
+	return upToDate;
 }
 
-bool CVariantDefs::addToken( string& token, CInterval interval )
+void CManifest::Update( const string& baseFilename, const string& key )
 {
-	COccupation& occupation = variants.back();
-	if( token == "$P" ) {
-		return addInterval( occupation.Who, interval );
-	}
+	keys[baseFilename] = key;
+	output << baseFilename << "\t" << key << endl;
+	processedCount++;
+}
 
-	if( token == "$O" || token == "$L" ) {
-		return addInterval( occupation.Where, interval );
+void CManifest::Close()
+{
+	output.close();
+	output.open( filename, ios::out | ios::trunc );
+	for( const pair<const string, string>& entry : keys ) {
+		output << entry.first << "\t" << entry.second << "\n";
 	}
+	output.close();
+	if( output.fail() ) {
+		throw CException( "Cannot write manifest `" + filename + "`." );
+	}
+}
 
-	const size_t tildePos = token.find_first_of( "~" );
-	if( tildePos == string::npos ) {
-		return true;
+// Set mystem up by the options, the lemma cache
+// and the dedupe index are opened if they are used.
+void SetUpMystem( const COptions& options, CMystem& mystem, CLemmaCache& lemmaCache,
+	CDedupeIndex& dedupeIndex, CDocumentBudget* budget = nullptr )
+{
+	mystem.SetRecordings( options.MystemMode, options.MystemRecordings );
+	mystem.SetReplayLatency( options.MystemLatency );
+	if( !options.LemmaCacheFilename.empty() ) {
+		lemmaCache.Open( options.LemmaCacheFilename );
+		mystem.SetLemmaCache( &lemmaCache, options.LemmaCacheContext );
 	}
-	if( tildePos == 0 ) {
-		return false;
+	if( !options.DedupeFilename.empty() ) {
+		dedupeIndex.Open( options.DedupeFilename );
+		mystem.SetDedupeIndex( &dedupeIndex );
 	}
-
-	const string afterTidle = token.substr( tildePos );
-	token = token.substr( 0, tildePos );
-
-	if( afterTidle == "~job" ) {
-		return addInterval( occupation.Job, interval );
-	} else if( afterTidle == "~where" ) {
-		return addInterval( occupation.Where, interval );
-	} else if( afterTidle == "~who" ) {
-		return addInterval( occupation.Who, interval );
+	if( budget != nullptr && budget->IsLimited() ) {
+		mystem.SetBudget( budget );
 	}
-
-	return ( afterTidle == "~" );
 }
 
-size_t CVariantDefs::AddVariant( string& variant )
+// Print the number of documents over budget if there are such documents.
+void PrintBudgetOverruns( const CDocumentBudget& budget, size_t documentsCount,
+	ostream& messages = cout )
 {
-	variants.push_back( COccupation() );
-	vector<string> tokens = SplitString( variant );
-	CInterval interval( 0, 1 );
-	for( string& token : tokens ) {
-		if( !addToken( token, interval ) ) {
-			throw CException( "Invalid format" );
-		}
-		interval.Offset( 1 );
-	}
-	if( !variants.back().Check() ) {
-		throw CException( "Invalid format" );
-	}
-	variant.clear();
-	for( const string& token : tokens ) {
-		variant += token + " ";
+	if( budget.OverrunsCount() > 0 ) {
+		messages << "over budget: " << budget.OverrunsCount() << " of " << documentsCount
+			<< " documents, " << ( budget.SkipOverrun() ? "skipped" : "without lemmas" ) << endl;
 	}
-	return variants.size();
 }
 
-COccupation CVariantDefs::Occupation( const size_t variantIndex,
-	CTokens::const_iterator firstMatchedToken ) const
+// Write the lemma cache if it is open and print its hit rate.
+void CloseLemmaCache( CLemmaCache& lemmaCache, ostream& messages = cout )
 {
-	COccupation occupation = variants[variantIndex - 1];
-	if( occupation.Who.Defined() ) {
-		occupation.Who.Begin = ( firstMatchedToken + occupation.Who.Begin )->Begin;
-		occupation.Who.End = ( firstMatchedToken + occupation.Who.End - 1 )->End;
+	if( !lemmaCache.IsOpen() ) {
+		return;
 	}
-	if( occupation.Where.Defined() ) {
-		occupation.Where.Begin = ( firstMatchedToken + occupation.Where.Begin )->Begin;
-		occupation.Where.End = ( firstMatchedToken + occupation.Where.End - 1 )->End;
+	const size_t formsCount = lemmaCache.FormsCount();
+	lemmaCache.Close();
+	if( lemmaCache.Documents() > 0 ) {
+		const size_t lookups = lemmaCache.Lookups();
+		messages << "lemma cache: forms: " << formsCount
+			<< ", lookups: " << lookups << ", hits: " << lemmaCache.Hits()
+			<< " (" << fixed << setprecision( 1 )
+			<< ( lookups > 0 ? 100.0 * lemmaCache.Hits() / lookups : 0.0 ) << "%)"
+			<< ", documents without mystem: " << lemmaCache.CachedDocuments()
+			<< " of " << lemmaCache.Documents() << endl;
 	}
-	if( occupation.Job.Defined() ) {
-		occupation.Job.Begin = ( firstMatchedToken + occupation.Job.Begin )->Begin;
-		occupation.Job.End = ( firstMatchedToken + occupation.Job.End - 1 )->End;
+}
+
+// Write the dedupe index if it is open and print found duplicates.
+void CloseDedupeIndex( CDedupeIndex& dedupeIndex, ostream& messages = cout )
+{
+	if( !dedupeIndex.IsOpen() ) {
+		return;
 	}
-	if( !occupation.Check() ) {
-		throw logic_error( "CVariantDefs::Occupation" );
+	dedupeIndex.Close();
+	if( dedupeIndex.Documents() > 0 ) {
+		messages << "dedupe: documents: " << dedupeIndex.Documents()
+			<< ", duplicates: " << dedupeIndex.Duplicates()
+			<< ", near duplicates: " << dedupeIndex.NearDuplicates()
+			<< ", reused sentences: " << dedupeIndex.ReusedSentences()
+			<< " of " << dedupeIndex.Sentences() << endl;
 	}
-	return occupation;
 }
 
-///////////////////////////////////////////////////////////////////////////////
-
-void LoadTemplates( const string& templatesFilename,
-	CDictionaries& dictionaries, CVariantDefs& variantDefs )
+// Base filenames of documents, which are lines of a file.
+vector<string> ReadDocumentsList( const string& listFilename )
 {
-	ifstream templatesFile( templatesFilename );
-	if( !templatesFile.good() ) {
-		throw CException( "Cannot read templates `" + templatesFilename + "`." );
+	ifstream list( listFilename );
+	if( !list.good() ) {
+		throw CException( "Cannot read list of documents `" + listFilename + "`." );
 	}
-	size_t lineNumber = 0;
-	do {
-		string line;
-		++lineNumber;
-		getline( templatesFile, line );
-		ConvertUtf8ToWindows1251( line );
-		vector<string> variants = MakeAllVariants( line );
-		if( variants.empty() ) {
-			throw CException( "Invalid templates `" + templatesFilename + "`"
-				" line " + to_string( lineNumber ) + "." );
+	vector<string> baseFilenames;
+	string line;
+	while( getline( list, line ) ) {
+		if( !line.empty() && line.back() == '\r' ) {
+			line.pop_back();
 		}
-		if( variants.size() == 1 && variants.front().empty() ) {
-			variants.clear();
+		if( !line.empty() ) {
+			baseFilenames.push_back( line );
 		}
+	}
+	return baseFilenames;
+}
 
-		for( string& variant : variants ) {
-			const size_t index = variantDefs.AddVariant( variant );
-			dictionaries.AddLine( variant, index );
+// Documents of the shard of the options, see --shard.
+vector<string> ShardDocuments( const vector<string>& baseFilenames, const COptions& options )
+{
+	vector<string> shardFilenames;
+	for( const string& baseFilename : baseFilenames ) {
+		const uint64_t hash = HashBytes( baseFilename.data(), baseFilename.length() );
+		if( hash % options.ShardsCount == options.Shard ) {
+			shardFilenames.push_back( baseFilename );
 		}
-	} while( templatesFile.good() );
+	}
+	return shardFilenames;
 }
 
-///////////////////////////////////////////////////////////////////////////////
+// Files of the next documents of a list are read ahead (see --async-io)
+// while the current document is processed.
+class CDocumentsReadAhead {
+public:
+	CDocumentsReadAhead( const vector<string>& _baseFilenames, size_t _depth ) :
+		baseFilenames( _baseFilenames ),
+		depth( _depth ),
+		current( 0 ),
+		readCount( 0 )
+	{
+	}
 
-const char* const MystemExeName = "mystem";
+	// Forget files of the previous document and read ahead files
+	// of the next ones, called before each document of the list.
+	void Next();
 
-string GetMystemPath( const string& exePath )
+private:
+	const vector<string>& baseFilenames;
+	const size_t depth;
+	size_t current;
+	size_t readCount;
+
+	static vector<string> filenames( const string& baseFilename );
+};
+
+void CDocumentsReadAhead::Next()
 {
-	const size_t pos = exePath.find_last_of( "\\/" );
-	if( pos != string::npos ) {
-		return exePath.substr( 0, pos + 1 ) + MystemExeName;
+	if( current > 0 ) {
+		for( const string& filename : filenames( baseFilenames[current - 1] ) ) {
+			DocumentFiles.Forget( filename );
+		}
 	}
-	return MystemExeName;
+	for( ; readCount < min( current + 1 + depth, baseFilenames.size() ); readCount++ ) {
+		for( const string& filename : filenames( baseFilenames[readCount] ) ) {
+			DocumentFiles.ReadAhead( filename );
+		}
+	}
+	current++;
 }
 
-///////////////////////////////////////////////////////////////////////////////
+vector<string> CDocumentsReadAhead::filenames( const string& baseFilename )
+{
+	return { baseFilename + ".txt", baseFilename + ".spans", baseFilename + ".objects",
+		TokensCacheFilename( baseFilename ), SubstitutionsCacheFilename( baseFilename ),
+		IncrementalStateFilename( baseFilename ) };
+}
 
-void ParseTokens( const string& baseFilename, CTokens& tokens,
-	const string& mystemPath = MystemExeName )
+// Extract occupations of a document or of a list of documents (--batch),
+// extract subcommand extracts them only from cached tokens.
+void ExtractOccupations( const COptions& options, const char* argv0 )
 {
-	// prepare file
-	const string tempFilename1 = "temp1.txt";
-	const string tempFilename2 = "temp2.txt";
-	const string mystrem = "\"" + mystemPath + "\" -ncwd --eng-gr -e cp1251 "
-		+ tempFilename1 + " " + tempFilename2;
-	PrepareTextFile( baseFilename + ".txt", tempFilename1 );
-	if( !System( mystrem ) ) {
-		throw CException( "Cannot run `mystem`." );
+	const bool extractOnly = ( options.Arguments[0] == "extract" );
+	const size_t firstArgument = extractOnly ? 1 : 0;
+	const string templatesFilename = options.Arguments[firstArgument + 1];
+	if( extractOnly && options.Incremental ) {
+		throw CException( "Option `--incremental` requires mystem, which extract does not use." );
 	}
 
-	// extract tokens
-	tokens.Parse( tempFilename2 );
+	if( !options.TraceFilename.empty() ) {
+		Trace.Open( options.TraceFilename );
+	}
+	CStatistics statistics;
+	statistics.BeginLoading();
+
+	// templates
+	CTemplateSets templateSets;
+	templateSets.Add( "task3", templatesFilename );
+	string templatesKey = "task3 " + FileHash( templatesFilename );
+	for( const pair<string, string>& templates : options.Templates ) {
+		templateSets.Add( templates.first, templates.second );
+		templatesKey += " " + templates.first + " " + FileHash( templates.second );
+	}
 
-#ifdef _WIN32
-	System( ( "DEL " + tempFilename1 + " " + tempFilename2 ).c_str() );
-#else
-	System( ( "rm " + tempFilename1 + " " + tempFilename2 ).c_str() );
-#endif
-}
+	// replaces
+	CDictionaries dictionaries;
+	LoadDictionaries( options, firstArgument + 2, dictionaries );
+	SetUpMatcher( dictionaries, "dictionaries" );
+	const string dictionariesKey = DictionariesKey( options, firstArgument + 2 );
+	templateSets.SetDictionaries( dictionaries, dictionariesKey );
+	const string incrementalKey = templatesKey + " | " + dictionariesKey
+		+ ( ( TextEncoding == TE_Utf8 ) ? " | utf-8" : "" );
+	statistics.EndLoading();
+
+	CMystem mystem( GetMystemPath( argv0 ) );
+	CLemmaCache lemmaCache;
+	CDedupeIndex dedupeIndex;
+	CDocumentBudget budget( options.DocumentTimeBudget, options.DocumentSizeBudget,
+		options.SkipOverBudget );
+	SetUpMystem( options, mystem, lemmaCache, dedupeIndex, &budget );
+
+	// base filenames (without extension)
+	vector<string> baseFilenames;
+	if( options.Batch || extractOnly ) {
+		baseFilenames = ShardDocuments( ReadDocumentsList( options.Arguments[firstArgument] ),
+			options );
+	} else {
+		baseFilenames.push_back( options.Arguments[0] );
+	}
 
-///////////////////////////////////////////////////////////////////////////////
+	CTemplatesProfile profile;
+	const bool profiling = !options.ProfileFilename.empty();
+	if( profiling ) {
+		templateSets.StartProfile( profile );
+	}
 
-class COccupations : public vector<COccupation> {
-public:
-	void Fill( const CTokens& tokens,
-		const CDictionaries& templates, const CVariantDefs& variantDefs );
-	void Write( const string& baseFilename ) const;
-};
+	// outputs, messages go to stderr if records are written to stdout
+	deque<COccupationsSink> sinks;
+	bool writeTask3 = options.Outputs.empty();
+	ostream* messages = &cout;
+	if( writeTask3 ) {
+		sinks.emplace_back( COccupationsSink::F_Task3, "" );
+	}
+	for( const pair<string, string>& output : options.Outputs ) {
+		sinks.emplace_back( COccupationsSink::ParseFormat( output.first ), output.second );
+		writeTask3 = writeTask3 || sinks.back().Format() == COccupationsSink::F_Task3;
+		if( sinks.back().IsStdout() ) {
+			messages = &cerr;
+		}
+	}
+
+	CManifest manifest;
+	const bool useManifest = !options.ManifestFilename.empty();
+	if( useManifest ) {
+		manifest.Open( options.ManifestFilename );
+	}
+	CDocumentsReadAhead readAhead( baseFilenames, options.AsyncIo );
+	for( const string& baseFilename : baseFilenames ) {
+		readAhead.Next();
+		const string tokensKey = TokensKey( baseFilename );
+		string key;
+		if( useManifest ) {
+			key = tokensKey + " | " + templatesKey + " | " + dictionariesKey
+				+ " | " + ResultsVersion;
+			vector<string> outputFilenames;
+			for( size_t i = 0; writeTask3 && i < templateSets.Size(); i++ ) {
+				outputFilenames.push_back( baseFilename + "." + templateSets.Name( i ) );
+			}
+			if( manifest.IsUpToDate( baseFilename, key, outputFilenames ) ) {
+				continue;
+			}
+		}
+		const bool withinBudget = options.Incremental
+			? ExtractGrowingDocumentOccupations( baseFilename, incrementalKey, templateSets,
+				mystem, options.Threads, sinks, statistics, profiling ? &profile : nullptr )
+			: ExtractDocumentOccupations( baseFilename, tokensKey, templateSets,
+				extractOnly ? nullptr : &mystem, options.Threads, sinks, statistics,
+				profiling ? &profile : nullptr );
+		// a document over budget is processed again by the next run
+		if( useManifest && withinBudget ) {
+			manifest.Update( baseFilename, key );
+		}
+	}
+	for( COccupationsSink& sink : sinks ) {
+		sink.Close();
+	}
+	if( useManifest ) {
+		manifest.Close();
+		*messages << "documents: " << baseFilenames.size()
+			<< ", rebuilt: " << manifest.ProcessedCount()
+			<< ", skipped: " << manifest.UpToDateCount() << endl;
+	}
+	CloseLemmaCache( lemmaCache, *messages );
+	CloseDedupeIndex( dedupeIndex, *messages );
+	PrintBudgetOverruns( budget, baseFilenames.size(), *messages );
+	if( !options.StatisticsFilename.empty() ) {
+		statistics.Write( options.StatisticsFilename );
+	}
+	if( profiling ) {
+		profile.Write( options.ProfileFilename,
+			CTemplatesProfile::ParseSortColumn( options.ProfileSort ) );
+	}
+	Trace.Close();
+}
 
-void COccupations::Fill( const CTokens& tokens,
-	const CDictionaries& templates, const CVariantDefs& variantDefs )
+// Cache tokens of a list of documents, see PrepareTokens.
+void TokenizeDocuments( const COptions& options, const char* argv0 )
 {
-	CFinder finder( templates );
-	for( const CToken& token : tokens ) {
-		finder.Push( token.Lexem );
+	if( !options.TraceFilename.empty() ) {
+		Trace.Open( options.TraceFilename );
 	}
-	finder.Finish();
+	CMystem mystem( GetMystemPath( argv0 ) );
+	CLemmaCache lemmaCache;
+	CDedupeIndex dedupeIndex;
+	CDocumentBudget budget( options.DocumentTimeBudget, options.DocumentSizeBudget,
+		options.SkipOverBudget );
+	SetUpMystem( options, mystem, lemmaCache, dedupeIndex, &budget );
+
+	CStatistics statistics;
+	const vector<string> baseFilenames =
+		ShardDocuments( ReadDocumentsList( options.Arguments[1] ), options );
+	CDocumentsReadAhead readAhead( baseFilenames, options.AsyncIo );
+	for( const string& baseFilename : baseFilenames ) {
+		readAhead.Next();
+		statistics.BeginDocument( baseFilename );
+		statistics.Add( CStatistics::C_Bytes, DocumentFileSize( baseFilename + ".txt" ) );
+		CTokens tokens;
+		PrepareTokens( baseFilename, TokensKey( baseFilename ), tokens, &mystem, statistics );
+		statistics.Add( CStatistics::C_Tokens, tokens.size() );
+		statistics.EndDocument();
+	}
+	CloseLemmaCache( lemmaCache );
+	CloseDedupeIndex( dedupeIndex );
+	PrintBudgetOverruns( budget, baseFilenames.size() );
+	if( !options.StatisticsFilename.empty() ) {
+		statistics.Write( options.StatisticsFilename );
+	}
+	Trace.Close();
+}
 
-	for( const CFinder::CMatch& match : finder.Matches() ) {
-		// add occupation
-		push_back( variantDefs.Occupation( match.Dictionary, tokens.cbegin() + match.Begin ) );
+// Evaluate templates on documents with gold facts, see CEvaluation.
+void EvaluateTemplates( const COptions& options, const char* argv0 )
+{
+	const auto start = chrono::steady_clock::now();
+	CTemplateSets templateSets;
+	templateSets.Add( "task3", options.Arguments[2] );
+	CDictionaries dictionaries;
+	LoadDictionaries( options, 3, dictionaries );
+	SetUpMatcher( dictionaries, "dictionaries" );
+	templateSets.SetDictionaries( dictionaries, DictionariesKey( options, 3 ) );
+
+	CMystem mystem( GetMystemPath( argv0 ) );
+	CLemmaCache lemmaCache;
+	CDedupeIndex dedupeIndex;
+	SetUpMystem( options, mystem, lemmaCache, dedupeIndex );
+
+	// tokens absent in the cache are made one by one,
+	// because mystem uses the same temporary files
+	const vector<string> baseFilenames = ReadDocumentsList( options.Arguments[1] );
+	vector<string> tokensKeys;
+	CStatistics statistics;
+	for( const string& baseFilename : baseFilenames ) {
+		tokensKeys.push_back( TokensKey( baseFilename ) );
+		CDocumentInput cache( TokensCacheFilename( baseFilename ) );
+		if( !ReadCacheKey( cache.Stream(), tokensKeys.back() ) ) {
+			statistics.BeginDocument( baseFilename );
+			CTokens tokens;
+			PrepareTokens( baseFilename, tokensKeys.back(), tokens, &mystem, statistics );
+			statistics.EndDocument();
+		}
+	}
+	CloseLemmaCache( lemmaCache );
+	CloseDedupeIndex( dedupeIndex );
+
+	// documents are evaluated in parallel, each by one thread
+	vector<CEvaluation::CDocument> documents( baseFilenames.size() );
+	atomic<size_t> nextDocument( 0 );
+	ProcessInParallel( "evaluation", min( options.Threads, baseFilenames.size() ),
+		[&]( const size_t )
+	{
+		for( size_t i = nextDocument++; i < baseFilenames.size(); i = nextDocument++ ) {
+			CTokens tokens;
+			if( !tokens.Load( TokensCacheFilename( baseFilenames[i] ), tokensKeys[i] ) ) {
+				throw CException( "Cannot read tokens cache of `" + baseFilenames[i] + "`." );
+			}
+			vector<COccupations> occupations;
+			MatchTokens( baseFilenames[i], tokensKeys[i], tokens, templateSets, 1, occupations );
+			documents[i] = CEvaluation::Evaluate( baseFilenames[i], occupations.front() );
+		}
+	} );
+
+	CEvaluation evaluation( templateSets.Source( 0 ) );
+	for( const CEvaluation::CDocument& document : documents ) {
+		evaluation.Add( document );
 	}
+	evaluation.Write( cout );
+	cout << endl << "seconds: " << setprecision( 3 )
+		<< chrono::duration<double>( chrono::steady_clock::now() - start ).count() << endl;
 }
 
-void COccupations::Write( const string& baseFilename ) const
+// File extensions of a document which are imported into packs.
+vector<string> PackedExtensions( const COptions& options )
 {
-	CUtf8TextFile sourceFile( baseFilename + ".txt" );
-	ofstream output( baseFilename + ".task3" );
-	for( const COccupation& occupation : *this ) {
-		occupation.Write( output, sourceFile );
-		output << endl;
+	vector<string> extensions = { ".txt", ".spans", ".objects", ".facts", ".todua-tokens",
+		".todua-substitutions", ".todua-incremental", ".todua-mystem", ".task3" };
+	for( const pair<string, string>& templates : options.Templates ) {
+		extensions.push_back( "." + templates.first );
 	}
+	return extensions;
 }
 
-///////////////////////////////////////////////////////////////////////////////
+// Add files of documents of a list to a pack and its sibling packs
+// (see CDocumentFiles).
+void ImportPack( const COptions& options )
+{
+	const vector<string> baseFilenames = ReadDocumentsList( options.Arguments[2] );
+	const vector<string> extensions = PackedExtensions( options );
+	DocumentFiles.Open( options.Arguments[1] );
+	size_t filesCount = 0;
+	for( const string& baseFilename : baseFilenames ) {
+		for( const string& extension : extensions ) {
+			const string filename = baseFilename + extension;
+			ifstream file( filename, ios::in | ios::binary );
+			string contents;
+			if( file.good() ) {
+				contents.assign( istreambuf_iterator<char>( file ), istreambuf_iterator<char>() );
+			} else if( !ReadCompressedFile( filename, contents ) ) {
+				continue;
+			}
+			DocumentFiles.Write( filename, contents );
+			filesCount++;
+		}
+	}
+	DocumentFiles.Close();
+	cout << "documents: " << baseFilenames.size() << ", files: " << filesCount << endl;
+}
+
+// Write files of a pack and its sibling packs.
+void ExportPack( const COptions& options )
+{
+	const string packFilename = options.Arguments[1];
+	DocumentFiles.Open( packFilename, true );
+	const vector<string> filenames = DocumentFiles.Names();
+	string buffer;
+	for( const string& filename : filenames ) {
+		const char* data = nullptr;
+		size_t size = 0;
+		if( !DocumentFiles.Find( filename, data, size, buffer ) ) {
+			throw CException( "Cannot read file `" + filename + "` of pack `"
+				+ packFilename + "`." );
+		}
+		ofstream file( filename, ios::out | ios::binary );
+		file.write( data, size );
+		if( !file.good() ) {
+			throw CException( "Cannot write file `" + filename + "`." );
+		}
+	}
+	DocumentFiles.Close();
+	cout << "files: " << filenames.size() << endl;
+}
 
 int main( int argc, const char* argv[] )
 {
@@ -1136,53 +8308,39 @@ int main( int argc, const char* argv[] )
 #ifdef _WIN32
 		system( "chcp 1251" );
 #endif
-		if( argc < 3 ) {
-			throw CException( "Too few arguments.\n"
-				"Usage: occup BASE_FILENAME TEMPLATES_FILENAME [DICTIONARIES]..\n"
-				"Example: occup Book_100 Templates.txt ListWork.txt ListOccupation.txt" );
-		}
-
-		// base filename (without extension)
-		const string baseFilename = argv[1];
-		const string templatesFilename = argv[2];
-		const string toduaTokensFilename = baseFilename + ".todua-tokens";
-
-		// templates
-		CDictionaries templates;
-		CVariantDefs variantDefs;
-		LoadTemplates( templatesFilename, templates, variantDefs );
-
-		// replaces
-		CDictionaries dictionaries;
-		for( int arg = 3; arg < argc; arg++ ) {
-			dictionaries.AddFile( argv[arg], arg - 2 );
-		}
-
-		// prepare tokens
-		CTokens tokens;
-		tokens.Load( toduaTokensFilename );
-
-		if( tokens.empty() ) {
-			ParseTokens( baseFilename, tokens, GetMystemPath( argv[0] ) );
-
-			// extract named entities
-			CNamedEntities namedEntities;
-			namedEntities.Read( baseFilename );
-
-			// set named entity type for tokens
-			SetNamedEntitiyTokenTypes( namedEntities, tokens );
-
-			// dump token for future executions.
-			tokens.Save( toduaTokensFilename );
+		COptions options;
+		options.Parse( argc, argv );
+		TextEncoding = options.Encoding;
+		UseGeneratedMatchers = options.GeneratedMatchers;
+		DocumentFiles.SetCompressCaches( options.CompressCaches );
+
+		if( options.Arguments[0] == "build-dictionaries" ) {
+			BuildDictionaries( options );
+		} else if( options.Arguments[0] == "generate-matcher" ) {
+			GenerateMatcher( options );
+		} else if( options.Arguments[0] == "generate-corpus" ) {
+			GenerateCorpus( options );
+		} else if( options.Arguments[0] == "benchmark" ) {
+			RunBenchmark( options );
+		} else if( options.Arguments[0] == "import-pack" ) {
+			ImportPack( options );
+		} else if( options.Arguments[0] == "export-pack" ) {
+			ExportPack( options );
+		} else {
+			if( !options.PackFilename.empty() ) {
+				DocumentFiles.Open( options.PackFilename );
+			} else if( options.AsyncIo > 0 ) {
+				DocumentFiles.StartAsyncIo( options.AsyncIo );
+			}
+			if( options.Arguments[0] == "eval" ) {
+				EvaluateTemplates( options, argv[0] );
+			} else if( options.Arguments[0] == "tokenize" ) {
+				TokenizeDocuments( options, argv[0] );
+			} else {
+				ExtractOccupations( options, argv[0] );
+			}
+			DocumentFiles.Close();
 		}
-
-		// Normalize by dictionaries
-		ProcessTokensByDictionaries( dictionaries, tokens );
-
-		// Write result
-		COccupations occupations;
-		occupations.Fill( tokens, templates, variantDefs );
-		occupations.Write( baseFilename );
 	} catch( exception& e ) {
 		cerr << "Error: " << e.what() << endl;
 		return 1;
@@ -0,0 +1,122 @@
+#include "mappedfile.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+using namespace std;
+
+// empty files are not mapped, data points here
+static const char EmptyFileData = '\0';
+
+CMappedFile::CMappedFile() :
+	data( nullptr ),
+	size( 0 )
+#ifdef _WIN32
+	, file( INVALID_HANDLE_VALUE ),
+	mapping( nullptr )
+#endif
+{
+}
+
+CMappedFile::~CMappedFile()
+{
+	Close();
+}
+
+#ifdef _WIN32
+
+bool CMappedFile::Open( const string& filename )
+{
+	Close();
+	file = CreateFileA( filename.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+		nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr );
+	if( file == INVALID_HANDLE_VALUE ) {
+		return false;
+	}
+	LARGE_INTEGER fileSize;
+	if( !GetFileSizeEx( file, &fileSize ) ) {
+		Close();
+		return false;
+	}
+	size = static_cast<size_t>( fileSize.QuadPart );
+	if( size == 0 ) {
+		data = &EmptyFileData;
+		return true;
+	}
+	mapping = CreateFileMappingA( file, nullptr, PAGE_READONLY, 0, 0, nullptr );
+	if( mapping == nullptr ) {
+		Close();
+		return false;
+	}
+	data = static_cast<const char*>( MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 ) );
+	if( data == nullptr ) {
+		Close();
+		return false;
+	}
+	return true;
+}
+
+void CMappedFile::Close()
+{
+	if( data != nullptr && data != &EmptyFileData ) {
+		UnmapViewOfFile( data );
+	}
+	if( mapping != nullptr ) {
+		CloseHandle( mapping );
+	}
+	if( file != INVALID_HANDLE_VALUE ) {
+		CloseHandle( file );
+	}
+	data = nullptr;
+	size = 0;
+	mapping = nullptr;
+	file = INVALID_HANDLE_VALUE;
+}
+
+#else
+
+bool CMappedFile::Open( const string& filename )
+{
+	Close();
+	const int file = open( filename.c_str(), O_RDONLY );
+	if( file == -1 ) {
+		return false;
+	}
+	struct stat fileStat;
+	if( fstat( file, &fileStat ) != 0 ) {
+		close( file );
+		return false;
+	}
+	size = static_cast<size_t>( fileStat.st_size );
+	if( size == 0 ) {
+		data = &EmptyFileData;
+		close( file );
+		return true;
+	}
+	void* mapped = mmap( nullptr, size, PROT_READ, MAP_SHARED, file, 0 );
+	close( file );
+	if( mapped == MAP_FAILED ) {
+		size = 0;
+		return false;
+	}
+	data = static_cast<const char*>( mapped );
+	return true;
+}
+
+void CMappedFile::Close()
+{
+	if( data != nullptr && data != &EmptyFileData ) {
+		munmap( const_cast<char*>( data ), size );
+	}
+	data = nullptr;
+	size = 0;
+}
+
+#endif
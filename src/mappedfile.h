@@ -0,0 +1,31 @@
+#pragma once
+
+#include <string>
+#include <cstddef>
+
+// Read-only view of a whole file mapped into memory, the file may be
+// appended while it is mapped (the view keeps its size).
+class CMappedFile {
+public:
+	CMappedFile();
+	~CMappedFile();
+
+	// Map the file, return false if the file cannot be mapped.
+	bool Open( const std::string& filename );
+	void Close();
+
+	bool IsOpen() const { return data != nullptr; }
+	const char* Data() const { return data; }
+	size_t Size() const { return size; }
+
+private:
+	const char* data;
+	size_t size;
+#ifdef _WIN32
+	void* file;
+	void* mapping;
+#endif
+
+	CMappedFile( const CMappedFile& ) = delete;
+	CMappedFile& operator=( const CMappedFile& ) = delete;
+};
@@ -0,0 +1,229 @@
+#include "processinfo.h"
+
+#include <new>
+#include <atomic>
+#include <cstdlib>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <psapi.h>
+#include <malloc.h>
+#elif defined( __APPLE__ )
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <malloc/malloc.h>
+#else
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <malloc.h>
+#endif
+
+using namespace std;
+
+#ifdef _WIN32
+
+static double FileTimeToSeconds( const FILETIME& time )
+{
+	ULARGE_INTEGER value;
+	value.LowPart = time.dwLowDateTime;
+	value.HighPart = time.dwHighDateTime;
+	return value.QuadPart * 1e-7; // 100-nanosecond intervals
+}
+
+double ProcessCpuTime()
+{
+	FILETIME creationTime;
+	FILETIME exitTime;
+	FILETIME kernelTime;
+	FILETIME userTime;
+	if( GetProcessTimes( GetCurrentProcess(), &creationTime, &exitTime,
+		&kernelTime, &userTime ) == 0 )
+	{
+		return 0;
+	}
+	return FileTimeToSeconds( kernelTime ) + FileTimeToSeconds( userTime );
+}
+
+size_t PeakResidentSetSize()
+{
+	PROCESS_MEMORY_COUNTERS counters;
+	if( K32GetProcessMemoryInfo( GetCurrentProcess(), &counters, sizeof( counters ) ) == 0 ) {
+		return 0;
+	}
+	return counters.PeakWorkingSetSize;
+}
+
+static string HostName()
+{
+	char name[MAX_COMPUTERNAME_LENGTH + 1];
+	DWORD length = sizeof( name );
+	return ( GetComputerNameA( name, &length ) != 0 ? string( name, length ) : "" );
+}
+
+static unsigned long ProcessId()
+{
+	return GetCurrentProcessId();
+}
+
+static size_t BlockSize( void* block )
+{
+	return _msize( block );
+}
+
+#else
+
+static double TimeValueToSeconds( const timeval& time )
+{
+	return time.tv_sec + time.tv_usec * 1e-6;
+}
+
+double ProcessCpuTime()
+{
+	double seconds = 0;
+	const int whos[] = { RUSAGE_SELF, RUSAGE_CHILDREN };
+	for( const int who : whos ) {
+		rusage usage;
+		if( getrusage( who, &usage ) == 0 ) {
+			seconds += TimeValueToSeconds( usage.ru_utime ) + TimeValueToSeconds( usage.ru_stime );
+		}
+	}
+	return seconds;
+}
+
+size_t PeakResidentSetSize()
+{
+	rusage usage;
+	if( getrusage( RUSAGE_SELF, &usage ) != 0 ) {
+		return 0;
+	}
+#ifdef __APPLE__
+	return static_cast<size_t>( usage.ru_maxrss ); // bytes
+#else
+	return static_cast<size_t>( usage.ru_maxrss ) * 1024; // kilobytes
+#endif
+}
+
+static string HostName()
+{
+	char name[256] = {};
+	return ( gethostname( name, sizeof( name ) - 1 ) == 0 ? string( name ) : "" );
+}
+
+static unsigned long ProcessId()
+{
+	return static_cast<unsigned long>( getpid() );
+}
+
+static size_t BlockSize( void* block )
+{
+#ifdef __APPLE__
+	return malloc_size( block );
+#else
+	return malloc_usable_size( block );
+#endif
+}
+
+#endif
+
+string ProcessUniqueName()
+{
+	string name;
+	for( const char c : HostName() ) {
+		const bool isAllowed = ( c >= 'a' && c <= 'z' ) || ( c >= 'A' && c <= 'Z' )
+			|| ( c >= '0' && c <= '9' ) || c == '-' || c == '_';
+		name += ( isAllowed ? c : '_' );
+	}
+	return name + "-" + to_string( ProcessId() );
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Only relaxed atomic operations are used, so counting is cheap.
+static atomic<size_t> LiveBytes( 0 );
+static atomic<size_t> PeakLiveBytes( 0 );
+static atomic<size_t> Allocations( 0 );
+
+CAllocationCounters AllocationCounters()
+{
+	CAllocationCounters counters;
+	counters.LiveBytes = LiveBytes.load( memory_order_relaxed );
+	counters.PeakLiveBytes = PeakLiveBytes.load( memory_order_relaxed );
+	counters.Allocations = Allocations.load( memory_order_relaxed );
+	return counters;
+}
+
+void ResetPeakLiveBytes()
+{
+	PeakLiveBytes.store( LiveBytes.load( memory_order_relaxed ), memory_order_relaxed );
+}
+
+static void* Allocate( size_t size )
+{
+	void* block = malloc( size == 0 ? 1 : size );
+	if( block != nullptr ) {
+		const size_t blockSize = BlockSize( block );
+		const size_t liveBytes = LiveBytes.fetch_add( blockSize, memory_order_relaxed ) + blockSize;
+		size_t peakLiveBytes = PeakLiveBytes.load( memory_order_relaxed );
+		while( liveBytes > peakLiveBytes && !PeakLiveBytes.compare_exchange_weak(
+			peakLiveBytes, liveBytes, memory_order_relaxed ) )
+		{
+		}
+		Allocations.fetch_add( 1, memory_order_relaxed );
+	}
+	return block;
+}
+
+static void Free( void* block )
+{
+	if( block != nullptr ) {
+		LiveBytes.fetch_sub( BlockSize( block ), memory_order_relaxed );
+		free( block );
+	}
+}
+
+void* operator new( size_t size )
+{
+	void* block = Allocate( size );
+	if( block == nullptr ) {
+		throw bad_alloc();
+	}
+	return block;
+}
+
+void* operator new[]( size_t size )
+{
+	return operator new( size );
+}
+
+void* operator new( size_t size, const nothrow_t& ) noexcept
+{
+	return Allocate( size );
+}
+
+void* operator new[]( size_t size, const nothrow_t& ) noexcept
+{
+	return Allocate( size );
+}
+
+void operator delete( void* block ) noexcept
+{
+	Free( block );
+}
+
+void operator delete[]( void* block ) noexcept
+{
+	Free( block );
+}
+
+void operator delete( void* block, const nothrow_t& ) noexcept
+{
+	Free( block );
+}
+
+void operator delete[]( void* block, const nothrow_t& ) noexcept
+{
+	Free( block );
+}
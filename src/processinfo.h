@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+// CPU time in seconds used by all threads of the process and by its child
+// processes which were waited for (e.g. mystem started by system()).
+// On Windows time of child processes is not included.
+double ProcessCpuTime();
+
+// Peak resident set size (working set on Windows) of the process in bytes.
+size_t PeakResidentSetSize();
+
+// Name of the process which is unique among processes of all hosts sharing
+// a directory: the host name and the process id, letters, digits, - and _.
+std::string ProcessUniqueName();
+
+// Counters of the global operator new and delete, which are replaced
+// to count bytes of live heap blocks and allocations of all threads.
+struct CAllocationCounters {
+	size_t LiveBytes;
+	size_t PeakLiveBytes;
+	size_t Allocations;
+};
+
+CAllocationCounters AllocationCounters();
+// Start the next peak of live bytes from the current live bytes.
+void ResetPeakLiveBytes();
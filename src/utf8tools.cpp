@@ -257,6 +257,52 @@ bool ConvertUtf8ToWindows1251( string& text, const char replacemnt )
 	return convertUtf8ToWindows1251<true>( text, replacemnt );
 }
 
+size_t DecodeUtf8Char( const string& text, const size_t offset, unsigned int& code )
+{
+	const unsigned char lead = static_cast<unsigned char>( text[offset] );
+	size_t length = 0;
+	if( lead < 0x80 ) {
+		code = lead;
+		return 1;
+	} else if( lead < 0xC0 ) {
+		return 0;
+	} else if( lead < 0xE0 ) {
+		length = 2;
+		code = lead & 0x1F;
+	} else if( lead < 0xF0 ) {
+		length = 3;
+		code = lead & 0x0F;
+	} else if( lead < 0xF8 ) {
+		length = 4;
+		code = lead & 0x07;
+	} else {
+		return 0;
+	}
+
+	if( offset + length > text.length() ) {
+		return 0;
+	}
+	for( size_t i = 1; i < length; i++ ) {
+		const unsigned char c = static_cast<unsigned char>( text[offset + i] );
+		if( ( c & 0xC0 ) != 0x80 ) {
+			return 0;
+		}
+		code = ( code << 6 ) | ( c & 0x3F );
+	}
+	return length;
+}
+
+size_t Utf8Length( const string& text )
+{
+	size_t length = 0;
+	for( const char c : text ) {
+		if( ( static_cast<unsigned char>( c ) & 0xC0 ) != 0x80 ) {
+			length++;
+		}
+	}
+	return length;
+}
+
 #if 0
 ///////////////////////////////////////////////////////////////////////////////
 
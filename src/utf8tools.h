@@ -7,3 +7,10 @@ bool ConvertUtf8ToWindows1251( std::string& text );
 
 // Convert UTF-8 text to CP1251 text (replace all non cp1251 symbols with replacement).
 bool ConvertUtf8ToWindows1251( std::string& text, const char replacemnt );
+
+// Decode the UTF-8 character at the offset of the text into its code,
+// returns the length of the character in bytes or 0 if it is not valid.
+size_t DecodeUtf8Char( const std::string& text, size_t offset, unsigned int& code );
+
+// Number of characters of UTF-8 text.
+size_t Utf8Length( const std::string& text );